@@ -0,0 +1,96 @@
+#ifndef PATCHMATCH_BOUNDEDQUEUE_H
+#define PATCHMATCH_BOUNDEDQUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/**
+ * Thread safe FIFO queue holding at most 'capacity' elements, used to connect the stages of a pipeline.
+ * Producers block while the queue is full, so a fast stage can never run ahead of a slow one by more than 'capacity'
+ * elements. Closing the queue lets consumers drain the remaining elements, after which pop returns false.
+ */
+template<typename T>
+class BoundedQueue {
+
+public:
+    explicit BoundedQueue(size_t capacity) : _capacity(capacity) { }
+
+    /**
+     * Blocks until there is space. Returns false (and drops 'element') if the queue was closed.
+     */
+    bool push(T element) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _not_full.wait(lock, [this] { return _closed || _elements.size() < _capacity; });
+        if (_closed)
+            return false;
+        _elements.push_back(std::move(element));
+        _not_empty.notify_one();
+        return true;
+    }
+
+    /**
+     * Same as push, but returns false instead of blocking if the queue is full.
+     */
+    bool tryPush(T element) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_closed || _elements.size() >= _capacity)
+            return false;
+        _elements.push_back(std::move(element));
+        _not_empty.notify_one();
+        return true;
+    }
+
+    /**
+     * Same as pop, but returns false instead of blocking if the queue is empty.
+     */
+    bool tryPop(T *element) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_elements.empty())
+            return false;
+        *element = std::move(_elements.front());
+        _elements.pop_front();
+        _not_full.notify_one();
+        return true;
+    }
+
+    /**
+     * Blocks until an element is available. Returns false if the queue is closed and empty.
+     */
+    bool pop(T *element) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _not_empty.wait(lock, [this] { return _closed || !_elements.empty(); });
+        if (_elements.empty())
+            return false;
+        *element = std::move(_elements.front());
+        _elements.pop_front();
+        _not_full.notify_one();
+        return true;
+    }
+
+    /**
+     * No more elements will be pushed. Wakes up all waiting producers and consumers.
+     */
+    void close() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed = true;
+        _not_full.notify_all();
+        _not_empty.notify_all();
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _elements.size();
+    }
+
+    size_t capacity() const { return _capacity; }
+
+private:
+    const size_t _capacity;
+    std::deque<T> _elements;
+    bool _closed = false;
+    mutable std::mutex _mutex;
+    std::condition_variable _not_full, _not_empty;
+};
+
+#endif //PATCHMATCH_BOUNDEDQUEUE_H
@@ -3,10 +3,13 @@
 #include "VotedReconstruction.h"
 #include "util.h"
 #include "VotedGradientReconstruction.h"
+#include "MaskedPoissonSolver.h"
 #include "PoissonSolver.h"
+#include "LabPyramid.h"
 
 using boost::format;
 using cv::bitwise_not;
+using cv::buildPyramid;
 using cv::findNonZero;
 using cv::countNonZero;
 using cv::Mat;
@@ -17,6 +20,7 @@ using cv::Scalar;
 using cv::threshold;
 using pmutil::computeGradientX;
 using pmutil::computeGradientY;
+using std::shared_ptr;
 using std::vector;
 using std::max_element;
 using std::min_element;
@@ -26,9 +30,38 @@ using std::min_element;
  */
 constexpr int EM_STEPS = 20;
 constexpr bool WEXLER_UPSCALE = true;
-constexpr bool DUMP_INTERMEDIARY_RESULTS = true;
+/**
+ * If true, the solution before every EM step is written to an EXR file, for debugging. Default: false.
+ */
+constexpr bool DUMP_INTERMEDIARY_RESULTS = false;
 constexpr bool DUMP_UPSCALING_DEBUG_OUTPUT = false;
+/**
+ * Estimated cost of an EM step relative to one on the next coarser scale, which has a quarter of the pixels. Used to
+ * predict the duration of the first EM step of a scale for deadlines. Default: 4.
+ */
+constexpr double EM_STEP_COST_PER_SCALE = 4;
 constexpr bool VOTED_MEAN_SHIFT_RECONSTRUCTION = true;
+/**
+ * If true, the gradient reconstruction only solves for the hole pixels (starting from the previous EM solution),
+ * instead of the whole target rectangle. Only used if VOTED_MEAN_SHIFT_RECONSTRUCTION is false, so the default
+ * pipeline never reaches it; it is checked against PoissonSolver in the unit tests only, not on whole fills.
+ * Default: true.
+ */
+constexpr bool MASKED_POISSON_SOLVER = true;
+/**
+ * Weight of the gradient term in the patch distance (lambda of RandomizedPatchMatch). Default: 0.5.
+ */
+constexpr float GRADIENT_WEIGHT = 0.5f;
+/**
+ * If true, patches are matched up to a per channel gain and bias, which helps with lighting changes. Default: false.
+ */
+constexpr bool GAIN_BIAS_COMPENSATION = false;
+/**
+ * If true, source patches overlapping the hole are excluded from the search by a mask, so they are rejected by a
+ * lookup in a validity bitmap before any pixel is read. Else, the hole is painted with hole_color, so these patches
+ * are rejected by their (huge) distance. Default: true.
+ */
+constexpr bool EXCLUDE_HOLE_FROM_SEARCH = true;
 const cv::Vec3f HoleFilling::hole_color = cv::Vec3f(10000, 10000, 10000);
 
 namespace {
@@ -39,17 +72,25 @@ namespace {
     bool compare_by_y(Point a, Point b) {
         return a.y < b.y;
     }
+}
 
-    int computeNrScales(const Mat &img, int patch_size) {
-        int min_dimension = std::min(img.cols, img.rows);
-        float min_downscaled_size = 2 * patch_size;
-        return static_cast<int>(log2f( min_dimension / min_downscaled_size) + 0.5f);
-    }
+HoleFilling::HoleFilling(const Mat &img, const Mat &hole, int patch_size,
+                         const SourceTransformations &transformations) :
+        HoleFilling(PreparedSource::create(img, patch_size, transformations, GRADIENT_WEIGHT), hole) {
 }
 
-HoleFilling::HoleFilling(const Mat &img, const Mat &hole, int patch_size) : _patch_size(patch_size),
-        _nr_scales(computeNrScales(img, patch_size)) {
-    buildPyramid(img.clone(), _img_pyr, _nr_scales);
+HoleFilling::HoleFilling(const vector<Mat> &img_pyr, const Mat &hole, int patch_size,
+                         const SourceTransformations &transformations) :
+        HoleFilling(std::make_shared<PreparedSource>(img_pyr, patch_size, transformations, GRADIENT_WEIGHT), hole) {
+}
+
+HoleFilling::HoleFilling(const shared_ptr<PreparedSource> &source, const Mat &hole) :
+        _nr_scales(nrScales(source->imagePyramid()[0].size(), source->patchSize())), _source(source),
+        _patch_size(source->patchSize()), _transformations(source->transformations()), _em_steps(EM_STEPS) {
+    CV_Assert(source->gradientWeight() == GRADIENT_WEIGHT);
+    const vector<Mat> &img_pyr = source->imagePyramid();
+    CV_Assert(static_cast<int>(img_pyr.size()) > _nr_scales);
+    _img_pyr.assign(img_pyr.begin(), img_pyr.begin() + _nr_scales + 1);
     buildPyramid(hole, _hole_pyr, _nr_scales);
     _hole_pyr.push_back(hole);
     for (Mat h: _hole_pyr) {
@@ -59,21 +100,94 @@ HoleFilling::HoleFilling(const Mat &img, const Mat &hole, int patch_size) : _pat
     while (countNonZero(_hole_pyr[_nr_scales]) == 0) {
         _nr_scales--;
     }
+    _next_scale = _nr_scales;
 
     // Initialize target rects.
     _target_area_pyr.resize(_nr_scales + 1);
     _offset_map_pyr.resize(_nr_scales + 1);
+    _seed_pyr.resize(_nr_scales + 1);
     for (int i = 0; i < _nr_scales + 1; i ++) {
-        _target_rect_pyr.push_back(computeTargetRect(_img_pyr[i], _hole_pyr[i], patch_size));
+        _target_rect_pyr.push_back(computeTargetRect(_img_pyr[i], _hole_pyr[i], _patch_size));
     }
 }
 
+int HoleFilling::nrScales(const cv::Size &size, int patch_size) {
+    int min_dimension = std::min(size.width, size.height);
+    float min_downscaled_size = 2 * patch_size;
+    return static_cast<int>(log2f( min_dimension / min_downscaled_size) + 0.5f);
+}
+
 Mat HoleFilling::run() {
-    for (int scale = _nr_scales; scale >= 0; scale--) {
+    return run(RunOptions()).image;
+}
+
+std::future<RunResult> HoleFilling::runAsync(const RunOptions &options) {
+    return std::async(std::launch::async, [this, options] { return run(options); });
+}
+
+RunResult HoleFilling::run(const RunOptions &options) {
+    ThreadPool::Scope thread_pool_scope(_thread_pool != nullptr ? *_thread_pool : ThreadPool::current());
+    RunResult result = runScales(0, options);
+    result.image = previewFrom(result.scale);
+    return result;
+}
+
+RunResult HoleFilling::runPreview(int stop_scale, const RunOptions &options) {
+    CV_Assert(stop_scale >= 0);
+    ThreadPool::Scope thread_pool_scope(_thread_pool != nullptr ? *_thread_pool : ThreadPool::current());
+    RunResult result = runScales(std::min(stop_scale, _nr_scales), options);
+    if (result.scale == 0 || _offset_map_pyr[result.scale] == nullptr) {
+        result.image = previewFrom(result.scale);
+        return result;
+    }
+    // The patches of the full resolution image are only sampled where votes need them, so this is cheap.
+    Mat upscaled = votedUpscale(result.scale, 0, _source->sources(0));
+    result.image = _img_pyr[0].clone();
+    Mat write_back_mask = _hole_pyr[0](_target_rect_pyr[0]);
+    upscaled.copyTo(result.image(_target_rect_pyr[0]), write_back_mask);
+    return result;
+}
+
+RunResult HoleFilling::runScales(const int stop_scale, const RunOptions &options) {
+    RunResult result;
+    result.scale = std::min(_next_scale + 1, _nr_scales);
+    result.completed = true;
+    // Duration of the last EM step, to predict the next one.
+    RunOptions::Clock::duration em_step_duration = RunOptions::Clock::duration::zero();
+    for (int scale = _next_scale; scale >= stop_scale && result.completed; scale--) {
         Mat source = _img_pyr[scale];
-        // Set 'hole' in source, so we will not get trivial solution (i. e. hole is filled with hole).
-        source.setTo(hole_color, _hole_pyr[scale]);
-        RandomizedPatchMatch rmp(source, _target_rect_pyr[scale].size(), _patch_size, 0);
+        if (!EXCLUDE_HOLE_FROM_SEARCH) {
+            // Set 'hole' in source, so we will not get trivial solution (i. e. hole is filled with hole). In a copy,
+            // as the pyramid may be shared.
+            source = source.clone();
+            source.setTo(hole_color, _hole_pyr[scale]);
+            if (!_excluded_pyr.empty())
+                source.setTo(hole_color, _excluded_pyr[scale]);
+        }
+        // The painted source can not share the transformed sources of the image.
+        RandomizedPatchMatch rmp = EXCLUDE_HOLE_FROM_SEARCH ?
+                RandomizedPatchMatch(_source->sourcesFrom(scale), _target_rect_pyr[scale].size(), _patch_size,
+                                     GRADIENT_WEIGHT) :
+                RandomizedPatchMatch(source, _target_rect_pyr[scale].size(), _patch_size, _transformations,
+                                     GRADIENT_WEIGHT);
+        if (EXCLUDE_HOLE_FROM_SEARCH) {
+            SearchConstraints constraints;
+            constraints.excluded = _hole_pyr[scale];
+            if (!_excluded_pyr.empty())
+                constraints.excluded = _hole_pyr[scale] | _excluded_pyr[scale];
+            constraints.target_origin = _target_rect_pyr[scale].tl();
+            rmp.setSearchSpace(_source->searchSpace(scale, constraints));
+        }
+        if (GAIN_BIAS_COMPENSATION) {
+            GainBiasCompensation compensation;
+            compensation.enabled = true;
+            rmp.setGainBiasCompensation(compensation);
+        }
+        if (_seed_pyr[scale] != nullptr)
+            rmp.setInitialSolution(_seed_pyr[scale]);
+        // The gradient reconstruction only knows the gradients of the primary source.
+        if (_library != nullptr && _library->size() > 0 && VOTED_MEAN_SHIFT_RECONSTRUCTION)
+            rmp.setSourceLibrary(_library, scale);
         if (scale == _nr_scales) {
             // Make some initial guess, here mean color of whole image.
             // TODO: Do some interpolation of borders for better initial guess.
@@ -88,7 +202,7 @@ Mat HoleFilling::run() {
             _target_area_pyr[_nr_scales] = initial_guess;
         } else {
             Mat upscaled_solution;
-            upscaleSolution(scale, rmp.getSourcesRotated(), upscaled_solution);
+            upscaleSolution(scale, rmp.getTransformedSources(), upscaled_solution);
             // Copy upscaled solution at hole region to current target area.
             _target_area_pyr[scale] = source(_target_rect_pyr[scale]).clone();
             // Only copy upscaled solution in hole region.
@@ -96,7 +210,18 @@ Mat HoleFilling::run() {
             upscaled_solution.copyTo(_target_area_pyr[scale], hole_mask(_target_rect_pyr[scale]));
         }
         rmp.setTargetArea(_target_area_pyr[scale]);
-        for (int i = 0; i < EM_STEPS; i++) {
+        if (scale != _nr_scales)
+            em_step_duration *= EM_STEP_COST_PER_SCALE;
+        // The hole and the size of the offset map stay the same over the EM steps, so the voting index does too.
+        shared_ptr<const VotingIndex> voting_index;
+        for (int i = 0; i < _em_steps; i++) {
+            const RunOptions::Clock::time_point em_step_start = RunOptions::Clock::now();
+            // Upscaling needs the nearest neighbor field of the previous scale, so we can only stop after a step.
+            if (options.cancellation.isCancelled() ||
+                    (options.deadline - em_step_start < em_step_duration && result.em_steps > 0)) {
+                result.completed = false;
+                break;
+            }
             if (DUMP_INTERMEDIARY_RESULTS) {
                 double pd = 0;
                 if (i > 0) {
@@ -111,8 +236,14 @@ Mat HoleFilling::run() {
             Mat reconstructed;
             if (VOTED_MEAN_SHIFT_RECONSTRUCTION) {
                 Mat hole_for_target = _hole_pyr[scale](_target_rect_pyr[scale]);
-                VotedReconstruction vr(_offset_map_pyr[scale], rmp.getSourcesRotated(), hole_for_target, _patch_size);
-                float mean_shift_bandwith_scale = 3 - i * (3 - 0.2f) / (EM_STEPS - 1);
+                VotedReconstruction vr(_offset_map_pyr[scale], rmp.getTransformedSources(), hole_for_target, _patch_size);
+                vr.setSourceLibrary(_library, scale);
+                if (voting_index == nullptr) {
+                    const cv::Size offset_map_size(_offset_map_pyr[scale]->_width, _offset_map_pyr[scale]->_height);
+                    voting_index = std::make_shared<const VotingIndex>(hole_for_target, offset_map_size, _patch_size);
+                }
+                vr.setVotingIndex(voting_index);
+                float mean_shift_bandwith_scale = 3 - i * (3 - 0.2f) / std::max(_em_steps - 1, 1);
                 vr.reconstruct(reconstructed, mean_shift_bandwith_scale);
             } else {
                 Mat currentSolution = solutionFor(scale);
@@ -134,50 +265,91 @@ Mat HoleFilling::run() {
                 reconstructed_img.copyTo(target_img, write_back_mask);
                 reconstructed_grad_x.copyTo(target_grad_x, write_back_mask);
                 reconstructed_grad_y.copyTo(target_grad_y, write_back_mask);
-                PoissonSolver ps(target_img, target_grad_x, target_grad_y);
-                ps.solve(reconstructed);
+                if (MASKED_POISSON_SOLVER) {
+                    MaskedPoissonSolver mps(target_img, target_grad_x, target_grad_y, write_back_mask);
+                    mps.solve(reconstructed, _target_area_pyr[scale]);
+                } else {
+                    PoissonSolver ps(target_img, target_grad_x, target_grad_y);
+                    ps.solve(reconstructed);
+                }
             }
             // Set reconstruction as new 'guess', i. e. set target area to current reconstruction.
             Mat write_back_mask = _hole_pyr[scale](_target_rect_pyr[scale]);
             reconstructed.copyTo(_target_area_pyr[scale], write_back_mask);
             rmp.setTargetArea(_target_area_pyr[scale]);
+            result.scale = scale;
+            result.em_steps++;
+            em_step_duration = RunOptions::Clock::now() - em_step_start;
         }
+        if (!result.completed)
+            break;
+        _next_scale = scale - 1;
+        if (options.on_scale_done)
+            options.on_scale_done(scale, previewFrom(scale));
+    }
+    return result;
+}
+
+Mat HoleFilling::previewFrom(const int scale) const {
+    Mat upscaled = solutionFor(scale);
+    for (int s = scale; s > 0; s--)
+        pyrUp(upscaled, upscaled, _img_pyr[s - 1].size());
+    if (scale == 0)
+        return upscaled;
+    Mat preview = _img_pyr[0].clone();
+    upscaled.copyTo(preview, _hole_pyr[0]);
+    return preview;
+}
+
+shared_ptr<SourceLibrary> HoleFilling::sourceLibrary() {
+    if (_library == nullptr)
+        _library = std::make_shared<SourceLibrary>(_transformations, _patch_size, GRADIENT_WEIGHT);
+    return _library;
+}
+
+float HoleFilling::gradientWeight() {
+    return GRADIENT_WEIGHT;
+}
+
+void HoleFilling::setSearchExclusion(const Mat &excluded) {
+    buildPyramid(excluded, _excluded_pyr, _nr_scales);
+    for (Mat e: _excluded_pyr) {
+        threshold(e, e, 0, 255, cv::THRESH_BINARY);
     }
-    return solutionFor(0);
 }
 
-void HoleFilling::upscaleSolution(const int current_scale, const vector<Mat> &rotated_sources,
-                                 Mat &upscaled_solution) const {
+void HoleFilling::seedFrom(const HoleFilling &previous, const Point &motion) {
+    seedFrom(previous._offset_map_pyr, previous._target_rect_pyr, motion);
+}
+
+void HoleFilling::seedFrom(const vector<shared_ptr<OffsetMap>> &offset_map_pyr, const vector<Rect> &target_rect_pyr,
+                           const Point &motion) {
+    const int nr_scales = std::min(static_cast<int>(std::min(offset_map_pyr.size(), target_rect_pyr.size())) - 1,
+                                   _nr_scales);
+    for (int scale = 0; scale <= nr_scales; scale++) {
+        const shared_ptr<OffsetMap> &previous_offset_map = offset_map_pyr[scale];
+        if (previous_offset_map == nullptr)
+            continue;
+        const Rect &target_rect = _target_rect_pyr[scale];
+        const int factor = 1 << scale;
+        const Point scaled_motion(cvRound(static_cast<float>(motion.x) / factor),
+                                  cvRound(static_cast<float>(motion.y) / factor));
+        _seed_pyr[scale] = previous_offset_map->shifted(target_rect_pyr[scale].tl(), target_rect.tl(), scaled_motion,
+                                                        target_rect.width - _patch_size + 1,
+                                                        target_rect.height - _patch_size + 1);
+    }
+}
+
+void HoleFilling::upscaleSolution(const int current_scale, const std::shared_ptr<const TransformedSources> rotated_sources,
+                                  Mat &upscaled_solution) const {
     if (WEXLER_UPSCALE) {
         // Better method for upscaling, see Wexler2007 Section 3.2
         int previous_scale = current_scale + 1;
-        auto previous_offset_map = _offset_map_pyr[previous_scale];
-        Rect prev_target_area_rect = _target_rect_pyr[previous_scale];
-        Rect target_area_rect = _target_rect_pyr[current_scale];
-
-        // We're working on target area of previous scale times two, so take also hole region from there.
-        Rect hole_rect = Rect(prev_target_area_rect.tl() * 2, prev_target_area_rect.size() * 2) &
-                Rect(Point(0,0), _hole_pyr[current_scale].size());
-        Mat hole_for_target = _hole_pyr[current_scale](hole_rect);
-        VotedReconstruction vr(previous_offset_map, rotated_sources, hole_for_target, _patch_size, 2);
-        // TODO: Find out what mean shift scale works best here.
-        Mat upscaled_full;
-        vr.reconstruct(upscaled_full, 3);
-
-        // Cut out the needed portion of the upscaled target area by
-        // projecting top left of previous target area to new scale, compute offset to needed top left.
-        Point offset = target_area_rect.tl() - prev_target_area_rect.tl() * 2;
-        Rect cutout_rect(offset, target_area_rect.size());
-
-        // In case our target area was right at the edge of the image, we might need to increase the size a bit here.
-        if (cutout_rect.x + cutout_rect.width > upscaled_full.cols ||
-                cutout_rect.y + cutout_rect.height > upscaled_full.rows) {
-            copyMakeBorder(upscaled_full, upscaled_full, 0, 2, 0, 2, cv::BORDER_REFLECT);
-        }
-
-        upscaled_solution = upscaled_full(cutout_rect);
+        upscaled_solution = votedUpscale(previous_scale, current_scale, rotated_sources);
 
         if (DUMP_UPSCALING_DEBUG_OUTPUT) {
+            Rect prev_target_area_rect = _target_rect_pyr[previous_scale];
+            Rect target_area_rect = _target_rect_pyr[current_scale];
             Mat source = _img_pyr[current_scale].clone();
             Rect upscaled_rect(prev_target_area_rect.x * 2, prev_target_area_rect.y * 2,
                                prev_target_area_rect.width * 2, prev_target_area_rect.height * 2);
@@ -186,8 +358,9 @@ void HoleFilling::upscaleSolution(const int current_scale, const vector<Mat> &ro
             source(Rect(Point(0, 0), _hole_pyr[current_scale].size())).setTo(cv::Scalar(0, 0, 0),
                                                                              _hole_pyr[current_scale]);
 
+            Mat hole_for_target = _hole_pyr[current_scale](upscaled_rect &
+                                                           Rect(Point(0, 0), _hole_pyr[current_scale].size()));
             cv::imwrite("wexler_upscaled" + std::to_string(current_scale) + "_hole.exr", hole_for_target);
-            pmutil::imwrite_lab("wexler_upscaled" + std::to_string(current_scale) + "_full.exr", upscaled_full);
             pmutil::imwrite_lab("wexler_upscaled" + std::to_string(current_scale) + ".exr", upscaled_solution);
             pmutil::imwrite_lab("wexler_upscaled" + std::to_string(current_scale) + "_target_area_in_img.exr", source);
         }
@@ -199,7 +372,38 @@ void HoleFilling::upscaleSolution(const int current_scale, const vector<Mat> &ro
     }
 }
 
-Rect HoleFilling::computeTargetRect(const Mat &img, const Mat &hole, int patch_size) const {
+Mat HoleFilling::votedUpscale(const int coarse_scale, const int fine_scale,
+                              const shared_ptr<const TransformedSources> &fine_sources) const {
+    const int factor = 1 << (coarse_scale - fine_scale);
+    Rect prev_target_area_rect = _target_rect_pyr[coarse_scale];
+    Rect target_area_rect = _target_rect_pyr[fine_scale];
+
+    // We're working on target area of the coarse scale times the factor, so take also hole region from there.
+    Rect hole_rect = Rect(prev_target_area_rect.tl() * factor, prev_target_area_rect.size() * factor) &
+            Rect(Point(0,0), _hole_pyr[fine_scale].size());
+    Mat hole_for_target = _hole_pyr[fine_scale](hole_rect);
+    VotedReconstruction vr(_offset_map_pyr[coarse_scale], fine_sources, hole_for_target, _patch_size, factor);
+    vr.setSourceLibrary(_library, fine_scale);
+    // TODO: Find out what mean shift scale works best here.
+    Mat upscaled_full;
+    vr.reconstruct(upscaled_full, 3);
+
+    // Cut out the needed portion of the upscaled target area by
+    // projecting top left of coarse target area to the fine scale, compute offset to needed top left.
+    Point offset = target_area_rect.tl() - prev_target_area_rect.tl() * factor;
+    Rect cutout_rect(offset, target_area_rect.size());
+
+    // In case our target area was right at the edge of the image, we might need to increase the size a bit here.
+    if (cutout_rect.x + cutout_rect.width > upscaled_full.cols ||
+            cutout_rect.y + cutout_rect.height > upscaled_full.rows) {
+        const int bottom = std::max(cutout_rect.y + cutout_rect.height - upscaled_full.rows, 0);
+        const int right = std::max(cutout_rect.x + cutout_rect.width - upscaled_full.cols, 0);
+        copyMakeBorder(upscaled_full, upscaled_full, 0, bottom, 0, right, cv::BORDER_REFLECT);
+    }
+    return upscaled_full(cutout_rect);
+}
+
+Rect HoleFilling::computeTargetRect(const Mat &img, const Mat &hole, int patch_size) {
     vector<Point> non_zero_locations;
     findNonZero(hole, non_zero_locations);
     int min_x = min_element(non_zero_locations.begin(), non_zero_locations.end(), compare_by_x)->x;
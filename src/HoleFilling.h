@@ -1,9 +1,59 @@
 #ifndef PATCHMATCH_HOLEFILLING_H
 #define PATCHMATCH_HOLEFILLING_H
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
 #include <memory>
 #include <opencv2/imgproc/imgproc.hpp>
 #include "OffsetMap.h"
+#include "PreparedSource.h"
+#include "SourceLibrary.h"
+#include "ThreadPool.h"
+#include "TransformedSources.h"
+
+/**
+ * Shared flag to stop a running hole filling from another thread. Copies refer to the same flag.
+ */
+class CancellationToken {
+public:
+    CancellationToken() : _cancelled(std::make_shared<std::atomic<bool>>(false)) { }
+
+    void cancel() { *_cancelled = true; }
+
+    bool isCancelled() const { return *_cancelled; }
+
+private:
+    std::shared_ptr<std::atomic<bool>> _cancelled;
+};
+
+struct RunOptions {
+    typedef std::chrono::steady_clock Clock;
+
+    CancellationToken cancellation;
+    // The hole filling stops before an EM step that is expected to end after the deadline.
+    Clock::time_point deadline = Clock::time_point::max();
+    // Called (on the thread running the hole filling) after every scale with the scale and a preview of the result
+    // at full resolution.
+    std::function<void(int, const cv::Mat &)> on_scale_done;
+
+    static RunOptions withTimeout(const std::chrono::milliseconds &timeout) {
+        RunOptions options;
+        options.deadline = Clock::now() + timeout;
+        return options;
+    }
+};
+
+struct RunResult {
+    // The filled image at full resolution, upscaled from the finest scale reached if stopped early.
+    cv::Mat image;
+    // Finest scale an EM step was done on (or the coarsest scale if none was done).
+    int scale = 0;
+    int em_steps = 0;
+    // False if stopped by cancellation or the deadline.
+    bool completed = false;
+};
 
 class HoleFilling {
 
@@ -13,24 +63,147 @@ public:
      * @param img the image of which we want to fill the hole of, usually in L*a*b* color space.
      * @param hole a bitmask of the hole, non-zero where the hole is, zero otherwise (one channel uint8).
      * @param patch_size the sizes of the patches to be used. A useful default is 7.
+     * @param transformations the transformations of the source searched additionally to translation.
+     */
+    HoleFilling(const cv::Mat &img, const cv::Mat &hole, int patch_size,
+                const SourceTransformations &transformations = SourceTransformations());
+
+    /**
+     * Same as above, with the image given as Gaussian pyramid (as by cv::buildPyramid) of at least
+     * nrScales(img_pyr[0].size(), patch_size) + 1 levels, further levels are ignored. The levels are used without
+     * copying and never modified, so callers that already have the pyramid (or convert the image anyway) avoid a copy
+     * and can share it, e.g. between similar frames of a video.
      */
-    HoleFilling(const cv::Mat &img, const cv::Mat &hole, int patch_size);
+    HoleFilling(const std::vector<cv::Mat> &img_pyr, const cv::Mat &hole, int patch_size,
+                const SourceTransformations &transformations = SourceTransformations());
+
+    /**
+     * Same as above, with the preprocessing of the image (pyramid, transformed sources and search spaces) shared with
+     * other hole fillings of it, e.g. jobs of a server on the same image. Patch size and transformations are the ones
+     * of 'source', which has to be created with gradientWeight().
+     */
+    HoleFilling(const std::shared_ptr<PreparedSource> &source, const cv::Mat &hole);
 
     /**
      * Returns a the full image with the hole inpainted. Has the same color space as the image given in construction.
      */
     cv::Mat run();
+
+    /**
+     * Same as above, but can be stopped by the cancellation token or deadline of 'options', in which case the best
+     * solution found so far is returned. Fine scales are the most expensive, so once the EM steps are expected to end
+     * after the deadline, the remaining ones are skipped.
+     */
+    RunResult run(const RunOptions &options);
+
+    /**
+     * Runs on a separate thread. This hole filling must not be used or destroyed until the result is retrieved.
+     */
+    std::future<RunResult> runAsync(const RunOptions &options = RunOptions());
+
+    /**
+     * Fast preview: Only runs the scales down to 'stop_scale' and reconstructs the full resolution image from the
+     * nearest neighbor field of 'stop_scale' by voting with patches 2^stop_scale times as large (see Wexler et al.).
+     * Scales done are kept, so a following run() continues at the next finer scale.
+     */
+    RunResult runPreview(int stop_scale, const RunOptions &options = RunOptions());
     cv::Mat solutionFor(const int scale) const;
 
+    /**
+     * Seeds the nearest neighbor fields of every scale with the ones found by 'previous' (which has to be run
+     * already), e.g. the previous frame of a video. The content of this image is assumed to be the one of 'previous',
+     * translated by 'motion' (in pixels at full resolution).
+     */
+    void seedFrom(const HoleFilling &previous, const cv::Point &motion);
+
+    /**
+     * Same as above, with the nearest neighbor field and target rect of every scale given directly. Scales without
+     * nearest neighbor field (nullptr) are not seeded.
+     */
+    void seedFrom(const std::vector<std::shared_ptr<OffsetMap>> &offset_map_pyr,
+                  const std::vector<cv::Rect> &target_rect_pyr, const cv::Point &motion);
+
+    /**
+     * Source patches overlapping 'excluded' (one channel uint8, non-zero where excluded) are not used, additionally
+     * to the ones overlapping the hole. E.g. pixels filled by an earlier hole filling, which are no real content.
+     */
+    void setSearchExclusion(const cv::Mat &excluded);
+
+    /**
+     * The target rect for 'hole' in 'img': the bounding box of all patches overlapping the hole, inside the image.
+     */
+    static cv::Rect computeTargetRect(const cv::Mat &img, const cv::Mat &hole, int patch_size);
+
+    /**
+     * Number of times an image of 'size' is downscaled for hole filling with 'patch_size', before skipping the scales
+     * where the hole vanishes.
+     */
+    static int nrScales(const cv::Size &size, int patch_size);
+
+    /**
+     * Number of expectation maximization steps per scale. Seeded hole fillings usually need fewer.
+     */
+    void setEmSteps(int em_steps) { _em_steps = em_steps; }
+
+    /**
+     * Library of additional source images searched for patches, created empty on the first call. Images added need
+     * to be in the color space of the image given in construction.
+     */
+    std::shared_ptr<SourceLibrary> sourceLibrary();
+
+    /**
+     * Shares a library between several hole fillings. It has to be created with the patch size and transformations
+     * of this hole filling and the gradient weight returned by gradientWeight().
+     */
+    void setSourceLibrary(const std::shared_ptr<SourceLibrary> &library) { _library = library; }
+    static float gradientWeight();
+
+    /**
+     * Runs all parallel work of this hole filling (matching, voting, Poisson solving) on its own pool of 'nr_threads'
+     * threads, including the one calling run(). Without, the pool of the calling thread is used (see
+     * ThreadPool::current()), so many hole fillings of one process share the cores instead of oversubscribing them.
+     * With 'pin_threads', the workers are pinned to cores no other pinned pool of the process uses.
+     */
+    void setNumThreads(int nr_threads, bool pin_threads = false) {
+        _thread_pool = std::make_shared<ThreadPool>(nr_threads, pin_threads);
+    }
+
     std::vector<cv::Mat> _img_pyr, _hole_pyr, _target_area_pyr;
     std::vector<std::shared_ptr<OffsetMap>> _offset_map_pyr;
     std::vector<cv::Rect> _target_rect_pyr;
     int _nr_scales;
 private:
+    const std::shared_ptr<PreparedSource> _source;
     const int _patch_size;
-    void upscaleSolution(const int current_scale, const std::vector<cv::Mat> &rotated_sources,
-                            cv::Mat &upscaled_solution) const;
-    cv::Rect computeTargetRect(const cv::Mat &img, const cv::Mat &hole, int patch_size) const;
+    const SourceTransformations _transformations;
+    int _em_steps;
+    // Finest scale not yet done by run() or runPreview(), -1 if all are.
+    int _next_scale;
+    // Nearest neighbor fields to try in the first EM step of every scale, might be nullptr.
+    std::vector<std::shared_ptr<OffsetMap>> _seed_pyr;
+    std::shared_ptr<SourceLibrary> _library;
+    std::shared_ptr<ThreadPool> _thread_pool;
+    // Additionally excluded from the search on every scale, empty if nothing is.
+    std::vector<cv::Mat> _excluded_pyr;
+    void upscaleSolution(const int current_scale, const std::shared_ptr<const TransformedSources> rotated_sources,
+                         cv::Mat &upscaled_solution) const;
+
+    /**
+     * Target area of 'fine_scale' reconstructed from the nearest neighbor field of 'coarse_scale' by voting, with the
+     * patches of 'fine_sources' (the sources of 'fine_scale').
+     */
+    cv::Mat votedUpscale(const int coarse_scale, const int fine_scale,
+                         const std::shared_ptr<const TransformedSources> &fine_sources) const;
+
+    /**
+     * Runs the scales from _next_scale down to 'stop_scale'.
+     */
+    RunResult runScales(const int stop_scale, const RunOptions &options);
+
+    /**
+     * The solution of 'scale' upscaled to full resolution, the pixels outside of the hole taken from the image.
+     */
+    cv::Mat previewFrom(const int scale) const;
 };
 
 #endif //PATCHMATCH_HOLEFILLING_H
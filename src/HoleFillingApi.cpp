@@ -0,0 +1,105 @@
+#include "HoleFillingApi.h"
+#include "LabPyramid.h"
+#include "ThreadPool.h"
+
+using cv::countNonZero;
+using cv::Mat;
+using cv::mixChannels;
+using cv::Range;
+using cv::threshold;
+using pmutil::buildLabPyramid;
+using std::vector;
+
+namespace {
+    int matType(PixelFormat format) {
+        switch (format) {
+            case PixelFormat::BGR8:
+                return CV_8UC3;
+            case PixelFormat::RGBA8:
+                return CV_8UC4;
+            default:
+                return CV_32FC3;
+        }
+    }
+
+    /**
+     * Writes rows of the result to the output: the input outside of the hole, the L*a*b* result converted to the
+     * output format inside. Rows without hole pixels are only copied.
+     */
+    class ParallelFromLab : public cv::ParallelLoopBody {
+
+    private:
+        const Mat &_lab, &_input, &_hole;
+        Mat &_output;
+        const PixelFormat _format;
+
+    public:
+        ParallelFromLab(const Mat &lab, const Mat &input, const Mat &hole, Mat &output, PixelFormat format) :
+                _lab(lab), _input(input), _hole(hole), _output(output), _format(format) { }
+
+        virtual void operator()(const Range &range) const override {
+            const int code = _format == PixelFormat::RGBA8 ? CV_Lab2RGB : CV_Lab2BGR;
+            const int from_to[] = {0, 0, 1, 1, 2, 2};
+            Mat converted, with_alpha;
+            for (int y = range.start; y < range.end; y++) {
+                Mat output_row = _output.row(y);
+                if (_input.data != _output.data)
+                    _input.row(y).copyTo(output_row);
+                const Mat hole_row = _hole.row(y);
+                if (countNonZero(hole_row) == 0)
+                    continue;
+                cvtColor(_lab.row(y), converted, code);
+                if (_format != PixelFormat::BGR32F)
+                    converted.convertTo(converted, CV_8U, 255);
+                if (_format == PixelFormat::RGBA8) {
+                    // Keep the alpha of the input.
+                    output_row.copyTo(with_alpha);
+                    mixChannels(&converted, 1, &with_alpha, 1, from_to, 3);
+                    with_alpha.copyTo(output_row, hole_row);
+                } else {
+                    converted.copyTo(output_row, hole_row);
+                }
+            }
+        }
+    };
+}
+
+Mat asMat(const ImageBuffer &buffer) {
+    CV_Assert(buffer.data != nullptr && buffer.width > 0 && buffer.height > 0);
+    return Mat(buffer.height, buffer.width, matType(buffer.format), buffer.data, buffer.stride);
+}
+
+Mat asMat(const MaskBuffer &buffer) {
+    CV_Assert(buffer.data != nullptr && buffer.width > 0 && buffer.height > 0);
+    return Mat(buffer.height, buffer.width, CV_8U, const_cast<uint8_t *>(buffer.data), buffer.stride);
+}
+
+bool fillHole(const ImageBuffer &input, const MaskBuffer &mask, const ImageBuffer &output, int patch_size,
+              const RunOptions &options) {
+    const Mat input_mat = asMat(input);
+    Mat output_mat = asMat(output);
+    CV_Assert(mask.width == input.width && mask.height == input.height);
+    CV_Assert(output_mat.size() == input_mat.size());
+    CV_Assert(output.format == input.format);
+    // HoleFilling thresholds its hole in place, so the caller's mask is only read.
+    Mat hole;
+    threshold(asMat(mask), hole, 0, 255, cv::THRESH_BINARY);
+
+    ThreadPool &pool = ThreadPool::current();
+    const Range rows(0, input_mat.rows);
+    if (countNonZero(hole) == 0) {
+        if (output.data != input.data)
+            input_mat.copyTo(output_mat);
+        return true;
+    }
+
+    vector<Mat> lab_pyr;
+    buildLabPyramid(input_mat, lab_pyr, HoleFilling::nrScales(input_mat.size(), patch_size),
+                    input.format == PixelFormat::RGBA8 ? CV_RGB2Lab : CV_BGR2Lab);
+
+    HoleFilling hole_filling(lab_pyr, hole, patch_size);
+    RunResult result = hole_filling.run(options);
+    ParallelFromLab from_lab(result.image, input_mat, hole, output_mat, output.format);
+    pool.parallelFor(rows, from_lab);
+    return result.completed;
+}
@@ -0,0 +1,53 @@
+#ifndef PATCHMATCH_HOLEFILLINGAPI_H
+#define PATCHMATCH_HOLEFILLINGAPI_H
+
+#include <cstddef>
+#include <cstdint>
+#include "HoleFilling.h"
+
+enum class PixelFormat {
+    // 8 bit per channel, in the channel order of OpenCV.
+    BGR8,
+    // 8 bit per channel. Alpha is not used for the filling, the one of the input is kept.
+    RGBA8,
+    // 32 bit float per channel, in [0, 1].
+    BGR32F,
+};
+
+/**
+ * Pixels owned by the caller, rows 'stride' bytes apart (0 if there is no padding). Not copied, the buffer has to
+ * outlive the call it is given to.
+ */
+struct ImageBuffer {
+    void *data = nullptr;
+    int width = 0, height = 0;
+    size_t stride = 0;
+    PixelFormat format = PixelFormat::BGR8;
+};
+
+/**
+ * One byte per pixel, non-zero where the hole is.
+ */
+struct MaskBuffer {
+    const uint8_t *data = nullptr;
+    int width = 0, height = 0;
+    size_t stride = 0;
+};
+
+/**
+ * Fills the hole of 'input' and writes the result to 'output', which needs the size and format of the input and can
+ * be the input itself (filling in place). Pixels outside of the hole are copied unchanged, inside, the result is
+ * converted back from L*a*b*. For embedding in applications: no files and no copies of the image besides the one in
+ * L*a*b* needed for the computation, into which the input is converted in a single pass.
+ * Returns false if the run was stopped early by 'options', then the output is filled with the coarser result.
+ */
+bool fillHole(const ImageBuffer &input, const MaskBuffer &mask, const ImageBuffer &output, int patch_size = 7,
+              const RunOptions &options = RunOptions());
+
+/**
+ * Header of 'buffer' as cv::Mat, sharing the memory.
+ */
+cv::Mat asMat(const ImageBuffer &buffer);
+cv::Mat asMat(const MaskBuffer &buffer);
+
+#endif //PATCHMATCH_HOLEFILLINGAPI_H
@@ -0,0 +1,419 @@
+#include "HoleFillingServer.h"
+#include <opencv2/highgui/highgui.hpp>
+#include "HoleFilling.h"
+#include "ThreadPool.h"
+#include "util.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <sstream>
+
+using cv::countNonZero;
+using cv::getTickCount;
+using cv::getTickFrequency;
+using cv::imdecode;
+using cv::imencode;
+using cv::Mat;
+using cv::Range;
+using pmutil::convert_for_computation;
+using std::lock_guard;
+using std::map;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+/**
+ * Time a client has to send its whole request, from the connection being accepted. Default: 10 seconds.
+ */
+constexpr int REQUEST_TIMEOUT_SECONDS = 10;
+/**
+ * Maximum size of the request line and headers. Default: 16 KB.
+ */
+constexpr size_t MAX_HEADER_BYTES = 16 << 10;
+
+namespace {
+    struct Request {
+        string method, path;
+        map<string, string> headers;
+        string body;
+    };
+
+    string lowercase(string text) {
+        for (char &c: text)
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        return text;
+    }
+
+    /**
+     * Receives what the client sent so far, waiting until 'deadline_ticks' at most. Returns 0 if the connection broke
+     * or the deadline passed.
+     */
+    ssize_t receiveBefore(int socket, char *buffer, size_t size, int64 deadline_ticks) {
+        const double remaining_ms = (deadline_ticks - getTickCount()) * 1000. / getTickFrequency();
+        if (remaining_ms <= 0)
+            return 0;
+        pollfd readable;
+        readable.fd = socket;
+        readable.events = POLLIN;
+        readable.revents = 0;
+        if (poll(&readable, 1, static_cast<int>(remaining_ms) + 1) <= 0)
+            return 0;
+        return recv(socket, buffer, size, 0);
+    }
+
+    /**
+     * Reads one HTTP/1.1 request until 'deadline_ticks'. Returns false if the connection broke, the deadline passed or
+     * the request is malformed or too large.
+     */
+    bool readRequest(int socket, size_t max_body_bytes, int64 deadline_ticks, Request *request) {
+        string data;
+        char buffer[8192];
+        size_t header_end;
+        while ((header_end = data.find("\r\n\r\n")) == string::npos) {
+            if (data.size() > MAX_HEADER_BYTES)
+                return false;
+            const ssize_t received = receiveBefore(socket, buffer, sizeof(buffer), deadline_ticks);
+            if (received <= 0)
+                return false;
+            data.append(buffer, static_cast<size_t>(received));
+        }
+
+        std::istringstream header(data.substr(0, header_end));
+        string line;
+        std::getline(header, line);
+        std::istringstream request_line(line);
+        request_line >> request->method >> request->path;
+        if (request->method.empty() || request->path.empty())
+            return false;
+        while (std::getline(header, line)) {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            const size_t colon = line.find(':');
+            if (colon == string::npos)
+                continue;
+            const size_t value_start = line.find_first_not_of(' ', colon + 1);
+            request->headers[lowercase(line.substr(0, colon))] =
+                    value_start == string::npos ? "" : line.substr(value_start);
+        }
+
+        size_t content_length = 0;
+        auto length_header = request->headers.find("content-length");
+        if (length_header != request->headers.end())
+            content_length = std::strtoul(length_header->second.c_str(), nullptr, 10);
+        if (content_length > max_body_bytes)
+            return false;
+        request->body = data.substr(header_end + 4);
+        while (request->body.size() < content_length) {
+            const ssize_t received = receiveBefore(socket, buffer, sizeof(buffer), deadline_ticks);
+            if (received <= 0)
+                return false;
+            request->body.append(buffer, static_cast<size_t>(received));
+        }
+        request->body.resize(content_length);
+        return true;
+    }
+
+    void sendAll(int socket, const char *data, size_t size) {
+        while (size > 0) {
+            const ssize_t sent = send(socket, data, size, MSG_NOSIGNAL);
+            if (sent <= 0)
+                return;
+            data += sent;
+            size -= static_cast<size_t>(sent);
+        }
+    }
+
+    /**
+     * Sends the response and closes the connection.
+     */
+    void respond(int socket, int status, const string &reason, const string &content_type, const string &body,
+                 const string &extra_headers = "") {
+        std::ostringstream header;
+        header << "HTTP/1.1 " << status << " " << reason << "\r\n"
+               << "Content-Type: " << content_type << "\r\n"
+               << "Content-Length: " << body.size() << "\r\n"
+               << extra_headers
+               << "Connection: close\r\n\r\n";
+        const string header_text = header.str();
+        sendAll(socket, header_text.data(), header_text.size());
+        sendAll(socket, body.data(), body.size());
+        close(socket);
+    }
+}
+
+/**
+ * Fills a batch of jobs in parallel.
+ */
+class HoleFillingServer::ParallelBatch : public cv::ParallelLoopBody {
+
+private:
+    HoleFillingServer &_server;
+    const vector<Job> &_batch;
+
+public:
+    ParallelBatch(HoleFillingServer &server, const vector<Job> &batch) : _server(server), _batch(batch) { }
+
+    virtual void operator()(const Range &range) const override {
+        for (int i = range.start; i < range.end; i++)
+            _server.fill(_batch[i]);
+    }
+};
+
+HoleFillingServer::HoleFillingServer(const ServerOptions &options) :
+        _options(options), _running(false), _connections(options.max_pending_connections),
+        _jobs(options.queue_capacity), _nr_filled(0), _nr_rejected(0), _nr_failed(0), _nr_bad_requests(0),
+        _nr_batches(0), _cache_hits(0) {
+    CV_Assert(options.nr_workers > 0 && options.nr_readers > 0 && options.max_batch_size > 0);
+}
+
+HoleFillingServer::~HoleFillingServer() {
+    stop();
+}
+
+void HoleFillingServer::start() {
+    CV_Assert(!_running);
+    _listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (_listen_socket < 0)
+        CV_Error(cv::Error::StsError, string("Could not create socket: ") + std::strerror(errno));
+    const int reuse = 1;
+    setsockopt(_listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(static_cast<uint16_t>(_options.port));
+    if (bind(_listen_socket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 ||
+            ::listen(_listen_socket, SOMAXCONN) < 0) {
+        const string error = std::strerror(errno);
+        close(_listen_socket);
+        _listen_socket = -1;
+        CV_Error(cv::Error::StsError, "Could not listen on port " + std::to_string(_options.port) + ": " + error);
+    }
+    socklen_t length = sizeof(address);
+    getsockname(_listen_socket, reinterpret_cast<sockaddr *>(&address), &length);
+    _port = ntohs(address.sin_port);
+
+    _running = true;
+    for (int i = 0; i < _options.nr_workers; i++)
+        _workers.emplace_back(&HoleFillingServer::work, this);
+    for (int i = 0; i < _options.nr_readers; i++)
+        _readers.emplace_back(&HoleFillingServer::read, this);
+    _listener = std::thread(&HoleFillingServer::listen, this);
+}
+
+void HoleFillingServer::stop() {
+    if (!_running.exchange(false))
+        return;
+    // Wakes up the listener blocked in accept.
+    shutdown(_listen_socket, SHUT_RDWR);
+    close(_listen_socket);
+    _listener.join();
+    // Readers answer the connections accepted so far, every one within the request timeout.
+    _connections.close();
+    for (std::thread &reader: _readers)
+        reader.join();
+    _readers.clear();
+    _jobs.close();
+    for (std::thread &worker: _workers)
+        worker.join();
+    _workers.clear();
+}
+
+string HoleFillingServer::metrics() const {
+    std::ostringstream out;
+    out << "# TYPE hole_filling_requests_total counter\n"
+        << "hole_filling_requests_total{result=\"filled\"} " << _nr_filled << "\n"
+        << "hole_filling_requests_total{result=\"rejected\"} " << _nr_rejected << "\n"
+        << "hole_filling_requests_total{result=\"failed\"} " << _nr_failed << "\n"
+        << "hole_filling_requests_total{result=\"bad_request\"} " << _nr_bad_requests << "\n"
+        << "# TYPE hole_filling_batches_total counter\n"
+        << "hole_filling_batches_total " << _nr_batches << "\n"
+        << "# TYPE hole_filling_source_cache_hits_total counter\n"
+        << "hole_filling_source_cache_hits_total " << _cache_hits << "\n"
+        << "# TYPE hole_filling_queue_length gauge\n"
+        << "hole_filling_queue_length " << _jobs.size() << "\n"
+        << _latencies.toPrometheus("hole_filling_request_seconds");
+    return out.str();
+}
+
+void HoleFillingServer::listen() {
+    while (_running) {
+        const int socket = accept(_listen_socket, nullptr, nullptr);
+        if (socket < 0) {
+            if (!_running)
+                return;
+            continue;
+        }
+        Connection connection;
+        connection.socket = socket;
+        connection.accepted_ticks = getTickCount();
+        // Nothing is read here, so a slow client never holds up accepting the next connections.
+        if (!_connections.tryPush(connection)) {
+            _nr_rejected++;
+            respond(socket, 503, "Service Unavailable", "text/plain", "Too many connections\n", "Retry-After: 1\r\n");
+        }
+    }
+}
+
+void HoleFillingServer::read() {
+    Connection connection;
+    while (_connections.pop(&connection))
+        handle(connection);
+}
+
+void HoleFillingServer::handle(const Connection &connection) {
+    const int socket = connection.socket;
+    const int64 deadline_ticks = connection.accepted_ticks +
+                                 static_cast<int64>(REQUEST_TIMEOUT_SECONDS * getTickFrequency());
+    Request request;
+    if (!readRequest(socket, _options.max_request_bytes, deadline_ticks, &request)) {
+        _nr_bad_requests++;
+        respond(socket, 400, "Bad Request", "text/plain", "Malformed or too large request\n");
+        return;
+    }
+    if (request.method == "GET" && request.path == "/health") {
+        respond(socket, 200, "OK", "text/plain", "ok\n");
+        return;
+    }
+    if (request.method == "GET" && request.path == "/metrics") {
+        respond(socket, 200, "OK", "text/plain; version=0.0.4", metrics());
+        return;
+    }
+    if (request.path != "/fill") {
+        respond(socket, 404, "Not Found", "text/plain", "Not found\n");
+        return;
+    }
+    if (request.method != "POST") {
+        respond(socket, 405, "Method Not Allowed", "text/plain", "Use POST\n", "Allow: POST\r\n");
+        return;
+    }
+
+    auto image_length = request.headers.find("x-image-length");
+    const size_t split = image_length == request.headers.end() ? 0 :
+                         std::strtoul(image_length->second.c_str(), nullptr, 10);
+    if (split == 0 || split >= request.body.size()) {
+        _nr_bad_requests++;
+        respond(socket, 400, "Bad Request", "text/plain", "X-Image-Length has to split the body into image and mask\n");
+        return;
+    }
+    Job job;
+    job.socket = socket;
+    job.received_ticks = connection.accepted_ticks;
+    job.encoded_image = request.body.substr(0, split);
+    job.encoded_mask = request.body.substr(split);
+    if (!_jobs.tryPush(std::move(job))) {
+        _nr_rejected++;
+        respond(socket, 503, "Service Unavailable", "text/plain", "Too many jobs queued\n", "Retry-After: 1\r\n");
+    }
+}
+
+void HoleFillingServer::work() {
+    Job job;
+    bool has_job = false;
+    while (has_job || _jobs.pop(&job)) {
+        // A job left over from the previous batch is decoded already.
+        if (!has_job && !decode(&job))
+            continue;
+        has_job = false;
+        vector<Job> batch(1, job);
+        // Small jobs waiting are filled together, a large one ends the batch and is filled next.
+        while (batch.front().small && batch.size() < _options.max_batch_size && _jobs.tryPop(&job)) {
+            if (!decode(&job))
+                continue;
+            if (!job.small) {
+                has_job = true;
+                break;
+            }
+            batch.push_back(job);
+        }
+        _nr_batches++;
+        ParallelBatch parallel_batch(*this, batch);
+        ThreadPool::current().parallelFor(Range(0, static_cast<int>(batch.size())), parallel_batch);
+    }
+}
+
+bool HoleFillingServer::decode(Job *job) {
+    try {
+        job->source = preprocess(job->encoded_image);
+        if (job->source != nullptr)
+            job->image = job->source->imagePyramid()[0];
+        job->hole = imdecode(Mat(1, static_cast<int>(job->encoded_mask.size()), CV_8U,
+                                 const_cast<char *>(job->encoded_mask.data())), cv::IMREAD_GRAYSCALE);
+        if (job->image.empty() || job->hole.empty() || job->image.size() != job->hole.size())
+            CV_Error(cv::Error::StsBadArg, "Image and mask have to be decodable and of the same size");
+    } catch (const cv::Exception &e) {
+        _nr_bad_requests++;
+        respond(job->socket, 400, "Bad Request", "text/plain", string(e.err.c_str()) + "\n");
+        return false;
+    }
+    // The encodings are not needed anymore, jobs in a batch are kept until it is filled.
+    job->encoded_image.clear();
+    job->encoded_mask.clear();
+    job->hole = job->hole != 0;
+    job->small = countNonZero(job->hole) <= _options.small_job_hole_pixels;
+    return true;
+}
+
+void HoleFillingServer::fill(const Job &job) {
+    try {
+        Mat filled;
+        if (countNonZero(job.hole) == 0) {
+            filled = job.image;
+        } else {
+            HoleFilling hole_filling(job.source, job.hole);
+            filled = hole_filling.run();
+        }
+        Mat bgr;
+        cvtColor(filled, bgr, CV_Lab2BGR);
+        bgr.convertTo(bgr, CV_8UC3, 255);
+        vector<uchar> encoded;
+        imencode(".png", bgr, encoded);
+        _nr_filled++;
+        _latencies.record((getTickCount() - job.received_ticks) / getTickFrequency());
+        respond(job.socket, 200, "OK", "image/png", string(encoded.begin(), encoded.end()));
+    } catch (const std::exception &e) {
+        _nr_failed++;
+        respond(job.socket, 500, "Internal Server Error", "text/plain", string(e.what()) + "\n");
+    }
+}
+
+shared_ptr<PreparedSource> HoleFillingServer::preprocess(const string &encoded) {
+    const size_t hash = std::hash<string>()(encoded);
+    {
+        lock_guard<mutex> lock(_cache_mutex);
+        for (auto cached = _source_cache.begin(); cached != _source_cache.end(); cached++) {
+            // The hash only rules out most entries quickly, a collision must not return another image.
+            if (cached->hash == hash && cached->encoded == encoded) {
+                _source_cache.splice(_source_cache.begin(), _source_cache, cached);
+                _cache_hits++;
+                return _source_cache.front().source;
+            }
+        }
+    }
+    Mat image = imdecode(Mat(1, static_cast<int>(encoded.size()), CV_8U, const_cast<char *>(encoded.data())),
+                         cv::IMREAD_COLOR);
+    if (image.empty())
+        return nullptr;
+    convert_for_computation(image, 1.f);
+    // Transformed sources and search spaces are added on the first use, by the hole fillings sharing it.
+    const shared_ptr<PreparedSource> source = PreparedSource::create(image, _options.patch_size,
+                                                                     SourceTransformations(),
+                                                                     HoleFilling::gradientWeight());
+    if (_options.source_cache_size > 0) {
+        lock_guard<mutex> lock(_cache_mutex);
+        CachedSource cached;
+        cached.hash = hash;
+        cached.encoded = encoded;
+        cached.source = source;
+        _source_cache.push_front(std::move(cached));
+        if (_source_cache.size() > _options.source_cache_size)
+            _source_cache.pop_back();
+    }
+    return source;
+}
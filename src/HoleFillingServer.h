@@ -0,0 +1,135 @@
+#ifndef PATCHMATCH_HOLEFILLINGSERVER_H
+#define PATCHMATCH_HOLEFILLINGSERVER_H
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "BoundedQueue.h"
+#include "LatencyHistogram.h"
+#include "PreparedSource.h"
+
+struct ServerOptions {
+    // Port to listen on (localhost only), 0 for any free one.
+    int port = 0;
+    // Number of jobs filled concurrently. All workers share the global ThreadPool.
+    int nr_workers = 2;
+    // Number of connections whose requests are read concurrently, so slow clients do not hold up others.
+    int nr_readers = 4;
+    // Accepted connections waiting for a reader, further ones are rejected with 503.
+    size_t max_pending_connections = 64;
+    // Jobs waiting for a worker, further ones are rejected with 503.
+    size_t queue_capacity = 16;
+    int patch_size = 7;
+    // Jobs with at most this many hole pixels are small, a worker fills up to max_batch_size of them at once.
+    int small_job_hole_pixels = 4096;
+    size_t max_batch_size = 4;
+    // Number of preprocessed images (decoded and converted, with pyramid, transformed sources and search spaces, see
+    // PreparedSource) kept for jobs on the same image.
+    size_t source_cache_size = 8;
+    size_t max_request_bytes = 64 << 20;
+};
+
+/**
+ * Long running hole filling service on a localhost HTTP socket, so clients do not pay process start and
+ * preprocessing per image.
+ *
+ * POST /fill takes the image and the mask (non-zero where the hole is), both encoded in any format cv::imdecode
+ * understands, concatenated in the body. The header X-Image-Length gives the length of the image. The response is the
+ * filled image as PNG. Requests are read by a pool of readers, each with a deadline for the whole request, and queued
+ * for a pool of workers, which decode and fill them. If a queue is full, requests are rejected right away with 503
+ * and a Retry-After header. Small jobs are batched and filled in parallel by one worker.
+ * GET /metrics exports request counts and the latency histogram in the Prometheus text format, GET /health answers
+ * "ok".
+ */
+class HoleFillingServer {
+
+public:
+    explicit HoleFillingServer(const ServerOptions &options = ServerOptions());
+
+    /**
+     * Stops the server if it is still running.
+     */
+    ~HoleFillingServer();
+
+    /**
+     * Binds the socket and starts listening and the workers. Throws cv::Exception if the socket can not be bound.
+     */
+    void start();
+
+    /**
+     * Stops accepting connections, finishes the queued jobs and joins all threads.
+     */
+    void stop();
+
+    /**
+     * The port listened on, valid after start().
+     */
+    int port() const { return _port; }
+
+    std::string metrics() const;
+
+private:
+    struct Connection {
+        int socket;
+        int64 accepted_ticks;
+    };
+
+    struct Job {
+        int socket;
+        std::string encoded_image, encoded_mask;
+        // Decoded by the worker, see decode(). 'image' is the first level of the pyramid of 'source'.
+        std::shared_ptr<PreparedSource> source;
+        cv::Mat image, hole;
+        int64 received_ticks;
+        bool small;
+    };
+
+    struct CachedSource {
+        size_t hash;
+        std::string encoded;
+        std::shared_ptr<PreparedSource> source;
+    };
+
+    class ParallelBatch;
+
+    const ServerOptions _options;
+    int _listen_socket = -1;
+    int _port = 0;
+    std::atomic<bool> _running;
+    std::thread _listener;
+    std::vector<std::thread> _readers, _workers;
+    BoundedQueue<Connection> _connections;
+    BoundedQueue<Job> _jobs;
+
+    LatencyHistogram _latencies;
+    std::atomic<uint64_t> _nr_filled, _nr_rejected, _nr_failed, _nr_bad_requests, _nr_batches;
+
+    // Preprocessed images with their encoding, most recently used first.
+    std::mutex _cache_mutex;
+    std::list<CachedSource> _source_cache;
+    std::atomic<uint64_t> _cache_hits;
+
+    void listen();
+    void read();
+    void work();
+    void handle(const Connection &connection);
+
+    /**
+     * Decodes image and mask of 'job'. Answers the request with 400 and returns false if they are not valid.
+     */
+    bool decode(Job *job);
+    void fill(const Job &job);
+
+    /**
+     * Decodes and converts the image for computation and prepares it for hole filling, or takes it from the cache.
+     * Returns nullptr if the image can not be decoded.
+     */
+    std::shared_ptr<PreparedSource> preprocess(const std::string &encoded);
+};
+
+#endif //PATCHMATCH_HOLEFILLINGSERVER_H
@@ -0,0 +1,236 @@
+#include "HoleFillingSession.h"
+#include "VotedReconstruction.h"
+
+using cv::boundingRect;
+using cv::buildPyramid;
+using cv::countNonZero;
+using cv::findNonZero;
+using cv::Mat;
+using cv::mean;
+using cv::Point;
+using cv::pyrDown;
+using cv::pyrUp;
+using cv::Rect;
+using cv::Size;
+using cv::threshold;
+using std::make_shared;
+using std::shared_ptr;
+using std::vector;
+
+/**
+ * Margin (in patches) around the changed pixels that is refilled, so the refilled region blends with its
+ * surroundings. Default: 2.
+ */
+constexpr int REFILL_MARGIN_PATCHES = 2;
+/**
+ * Number of EM steps per scale of a refill, which is seeded with the kept nearest neighbor fields. Default: 5.
+ */
+constexpr int REFILL_EM_STEPS = 5;
+
+namespace {
+    /**
+     * Recomputes 'coarse', the next level of the Gaussian pyramid of 'fine', inside 'coarse_region' only. Same as
+     * pyrDown of the whole level there: the part of 'fine' read (two more pixels to every side) starts at an even
+     * position, and the pixels at its cut borders are not copied.
+     */
+    void pyrDownRegion(const Mat &fine, Mat &coarse, const Rect &coarse_region) {
+        const Rect fine_region = Rect(coarse_region.tl() * 2 - Point(2, 2), coarse_region.br() * 2 + Point(2, 2)) &
+                Rect(Point(0, 0), fine.size());
+        Mat downscaled;
+        pyrDown(fine(fine_region), downscaled);
+        const Point origin(fine_region.x / 2, fine_region.y / 2);
+        downscaled(Rect(coarse_region.tl() - origin, coarse_region.size())).copyTo(coarse(coarse_region));
+    }
+
+    /**
+     * The part 'fine_region' of pyrUp of 'coarse', computed from the pixels of 'coarse' around it only.
+     */
+    Mat upscaledRegion(const Mat &coarse, const Rect &fine_region) {
+        const Rect coarse_region = Rect(Point(fine_region.x / 2 - 1, fine_region.y / 2 - 1),
+                                        Point((fine_region.br().x + 1) / 2 + 1, (fine_region.br().y + 1) / 2 + 1)) &
+                Rect(Point(0, 0), coarse.size());
+        Mat upscaled;
+        pyrUp(coarse(coarse_region), upscaled);
+        return upscaled(Rect(fine_region.tl() - coarse_region.tl() * 2, fine_region.size()));
+    }
+}
+
+HoleFillingSession::HoleFillingSession(const Mat &img, const Mat &hole, int patch_size,
+                                       const SourceTransformations &transformations) :
+        _source(PreparedSource::create(img, patch_size, transformations, HoleFilling::gradientWeight())),
+        _patch_size(patch_size), _nr_scales(HoleFilling::nrScales(img.size(), patch_size)) {
+    CV_Assert(hole.size() == img.size() && hole.type() == CV_8U);
+    _refilled_region = Rect(Point(0, 0), img.size());
+    // Same as the hole pyramid of HoleFilling, thresholded after building all levels.
+    buildPyramid(hole != 0, _blurred_hole_pyr, _nr_scales);
+    for (const Mat &blurred_hole : _blurred_hole_pyr) {
+        Mat level_hole;
+        threshold(blurred_hole, level_hole, 0, 255, cv::THRESH_BINARY);
+        _hole_pyr.push_back(level_hole);
+    }
+    for (const Mat &level : _source->imagePyramid())
+        _target_area_pyr.push_back(level.clone());
+    _offset_map_pyr.resize(_nr_scales + 1);
+    _target_rect_pyr.resize(_nr_scales + 1);
+    _matcher_pyr.resize(_nr_scales + 1);
+    if (countNonZero(_hole_pyr[0]) == 0)
+        return;
+
+    // The initial fill shares the image pyramid and its transformed sources with the refills.
+    HoleFilling hole_filling(_source, _hole_pyr[0]);
+    hole_filling.run();
+    // Coarser scales, where the hole vanishes, are skipped by the hole filling and keep the image.
+    for (int scale = 0; scale <= hole_filling._nr_scales; scale++) {
+        _target_area_pyr[scale] = hole_filling.solutionFor(scale);
+        _offset_map_pyr[scale] = hole_filling._offset_map_pyr[scale];
+        _target_rect_pyr[scale] = hole_filling._target_rect_pyr[scale];
+    }
+}
+
+Mat HoleFillingSession::setHole(const Mat &hole) {
+    CV_Assert(hole.size() == filled().size() && hole.type() == CV_8U);
+    Mat new_hole = hole != 0;
+    Mat changed = new_hole != _hole_pyr[0];
+    if (countNonZero(changed) == 0) {
+        _refilled_region = Rect();
+        return filled();
+    }
+    vector<Point> changed_points;
+    findNonZero(changed, changed_points);
+    const Rect changed_rect = boundingRect(changed_points);
+    const int margin = REFILL_MARGIN_PATCHES * _patch_size;
+    _refilled_region = Rect(changed_rect.x - margin, changed_rect.y - margin, changed_rect.width + 2 * margin,
+                            changed_rect.height + 2 * margin) & Rect(Point(0, 0), new_hole.size());
+
+    // Levels of the hole pyramid only change inside the region of their level, fine to coarse.
+    const vector<Rect> region_pyr = refilledRegionPyramid();
+    vector<Mat> added_pyr(_nr_scales + 1);
+    for (int scale = 0; scale <= _nr_scales; scale++) {
+        const Rect &region = region_pyr[scale];
+        const Mat previous_hole = _hole_pyr[scale](region).clone();
+        if (scale == 0)
+            new_hole(region).copyTo(_blurred_hole_pyr[0](region));
+        else
+            pyrDownRegion(_blurred_hole_pyr[scale - 1], _blurred_hole_pyr[scale], region);
+        Mat level_hole = _hole_pyr[scale](region);
+        threshold(_blurred_hole_pyr[scale](region), level_hole, 0, 255, cv::THRESH_BINARY);
+        added_pyr[scale] = level_hole & ~previous_hole;
+        // Pixels no longer in the hole get their original value back.
+        Mat restored = previous_hole & ~level_hole;
+        _source->imagePyramid()[scale](region).copyTo(_target_area_pyr[scale](region), restored);
+        reanchor(scale);
+    }
+    // Coarse to fine, as the pixels added to the hole start from the refilled coarser level.
+    for (int scale = _nr_scales; scale >= 0; scale--)
+        refillScale(scale, region_pyr[scale], added_pyr[scale]);
+    return filled();
+}
+
+vector<Rect> HoleFillingSession::refilledRegionPyramid() const {
+    vector<Rect> region_pyr(1, _refilled_region);
+    for (int scale = 1; scale <= _nr_scales; scale++) {
+        // A pixel of the coarser level is blurred from two pixels of the finer level to every side.
+        const Rect &finer = region_pyr.back();
+        const Rect coarser(Point(finer.x / 2 - 1, finer.y / 2 - 1),
+                           Point((finer.br().x + 1) / 2 + 1, (finer.br().y + 1) / 2 + 1));
+        region_pyr.push_back(coarser & Rect(Point(0, 0), _hole_pyr[scale].size()));
+    }
+    return region_pyr;
+}
+
+void HoleFillingSession::reanchor(const int scale) {
+    const Mat &hole = _hole_pyr[scale];
+    Rect target_rect;
+    if (countNonZero(hole) > 0)
+        target_rect = HoleFilling::computeTargetRect(hole, hole, _patch_size);
+    shared_ptr<OffsetMap> &offset_map = _offset_map_pyr[scale];
+    if (target_rect.width < _patch_size || target_rect.height < _patch_size)
+        offset_map = nullptr;
+    else if (offset_map != nullptr && target_rect != _target_rect_pyr[scale])
+        offset_map = offset_map->shifted(_target_rect_pyr[scale].tl(), target_rect.tl(), Point(0, 0),
+                                         target_rect.width - _patch_size + 1, target_rect.height - _patch_size + 1);
+    _target_rect_pyr[scale] = target_rect;
+}
+
+void HoleFillingSession::refillScale(const int scale, const Rect &region, const Mat &added) {
+    // Only the hole pixels inside the region are refilled, the other ones are context like the rest of the level.
+    vector<Point> refilled_points;
+    findNonZero(_hole_pyr[scale](region), refilled_points);
+    if (refilled_points.empty())
+        return;
+    const Rect refilled_rect = boundingRect(refilled_points) + region.tl();
+    const Point patch_extent(_patch_size - 1, _patch_size - 1);
+    const Rect refill_rect = Rect(refilled_rect.tl() - patch_extent, refilled_rect.br() + patch_extent) &
+            Rect(Point(0, 0), _hole_pyr[scale].size());
+    if (refill_rect.width < _patch_size || refill_rect.height < _patch_size)
+        return;
+    const Rect region_in_refill = (region & refill_rect) - refill_rect.tl();
+    Mat refill_hole = Mat::zeros(refill_rect.size(), CV_8U);
+    _hole_pyr[scale](region & refill_rect).copyTo(refill_hole(region_in_refill));
+    Mat added_in_refill = Mat::zeros(refill_rect.size(), CV_8U);
+    added((region & refill_rect) - region.tl()).copyTo(added_in_refill(region_in_refill));
+
+    // Pixels added to the hole still hold the image, so they start from the coarser level instead. On the coarsest
+    // level, from the mean color around them, like the initial guess of HoleFilling.
+    Mat target_area = _target_area_pyr[scale](refill_rect).clone();
+    if (countNonZero(added_in_refill) > 0) {
+        if (scale < _nr_scales)
+            upscaledRegion(_target_area_pyr[scale + 1], refill_rect).copyTo(target_area, added_in_refill);
+        else
+            target_area.setTo(mean(target_area, refill_hole == 0), added_in_refill);
+    }
+
+    RandomizedPatchMatch &rmp = matcherFor(scale);
+    SearchConstraints constraints;
+    // Filled pixels are no real content, inside the region or not.
+    constraints.excluded = _hole_pyr[scale];
+    constraints.target_origin = refill_rect.tl();
+    rmp.setSearchSpace(_source->searchSpace(scale, constraints));
+    const Size offset_map_size(refill_rect.width - _patch_size + 1, refill_rect.height - _patch_size + 1);
+    const Rect &target_rect = _target_rect_pyr[scale];
+    shared_ptr<OffsetMap> &kept_offset_map = _offset_map_pyr[scale];
+    rmp.setInitialSolution(kept_offset_map == nullptr ? nullptr :
+                           kept_offset_map->shifted(target_rect.tl(), refill_rect.tl(), Point(0, 0),
+                                                    offset_map_size.width, offset_map_size.height));
+    rmp.setTargetArea(target_area);
+    // The refilled pixels and the size of the offset map stay the same over the EM steps, so the voting index does too.
+    const shared_ptr<const VotingIndex> voting_index = make_shared<const VotingIndex>(refill_hole, offset_map_size,
+                                                                                      _patch_size);
+    shared_ptr<OffsetMap> offset_map;
+    for (int i = 0; i < REFILL_EM_STEPS; i++) {
+        offset_map = rmp.match();
+        VotedReconstruction vr(offset_map, rmp.getTransformedSources(), refill_hole, _patch_size);
+        vr.setVotingIndex(voting_index);
+        Mat reconstructed;
+        vr.reconstruct(reconstructed, 3 - i * (3 - 0.2f) / std::max(REFILL_EM_STEPS - 1, 1));
+        reconstructed.copyTo(target_area, refill_hole);
+        rmp.setTargetArea(target_area);
+    }
+    target_area.copyTo(_target_area_pyr[scale](refill_rect), refill_hole);
+
+    // The refill rect is inside the target rect, as its patches overlap the hole.
+    if (kept_offset_map == nullptr) {
+        kept_offset_map = offset_map->shifted(refill_rect.tl(), target_rect.tl(), Point(0, 0),
+                                              target_rect.width - _patch_size + 1,
+                                              target_rect.height - _patch_size + 1);
+        return;
+    }
+    const Point position = refill_rect.tl() - target_rect.tl();
+    for (int x = 0; x < offset_map->_width; x++) {
+        for (int y = 0; y < offset_map->_height; y++) {
+            OffsetMapEntry *entry = kept_offset_map->ptr(position.y + y, position.x + x);
+            *entry = offset_map->at(y, x);
+            entry->offset -= position;
+        }
+    }
+}
+
+RandomizedPatchMatch &HoleFillingSession::matcherFor(const int scale) {
+    shared_ptr<RandomizedPatchMatch> &matcher = _matcher_pyr[scale];
+    if (matcher == nullptr) {
+        // Sized for the whole level, the target areas of the refills are smaller.
+        matcher = make_shared<RandomizedPatchMatch>(_source->sourcesFrom(scale), _hole_pyr[scale].size(), _patch_size,
+                                                    HoleFilling::gradientWeight());
+    }
+    return *matcher;
+}
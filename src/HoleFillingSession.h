@@ -0,0 +1,83 @@
+#ifndef PATCHMATCH_HOLEFILLINGSESSION_H
+#define PATCHMATCH_HOLEFILLINGSESSION_H
+
+#include <memory>
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "HoleFilling.h"
+#include "patch_match_provider/RandomizedPatchMatch.h"
+
+/**
+ * Hole filling of one image whose hole is edited interactively. The image pyramid (with its transformed sources), the
+ * hole pyramid, the filled levels and nearest neighbor fields of every scale and the matchers are kept across edits.
+ * An edit only refills the pixels that changed plus a margin around them: the levels of the hole pyramid are only
+ * updated inside this region, and EM steps only run on the part of the target rect of every scale around the hole
+ * pixels inside it, seeded with the kept nearest neighbor fields. The rest of the filled image is context. Small brush
+ * strokes thus only cost a small hole filling.
+ */
+class HoleFillingSession {
+
+public:
+    /**
+     * @param img the image, usually in L*a*b* color space.
+     * @param hole the initial hole, non-zero where the hole is (one channel uint8).
+     * @param patch_size see HoleFilling.
+     * @param transformations see HoleFilling.
+     */
+    HoleFillingSession(const cv::Mat &img, const cv::Mat &hole, int patch_size,
+                       const SourceTransformations &transformations = SourceTransformations());
+
+    /**
+     * Replaces the hole by 'hole' (same size as the image) and returns the image filled accordingly. Pixels no
+     * longer in the hole get their original value back. The result is filled(), so following edits change it.
+     */
+    cv::Mat setHole(const cv::Mat &hole);
+
+    /**
+     * The image with the current hole filled.
+     */
+    const cv::Mat &filled() const { return _target_area_pyr[0]; }
+
+    /**
+     * Region refilled by the last call of setHole, empty if nothing changed. The whole image for the initial fill.
+     */
+    const cv::Rect &lastRefilledRegion() const { return _refilled_region; }
+
+    std::vector<std::shared_ptr<OffsetMap>> _offset_map_pyr;
+    std::vector<cv::Rect> _target_rect_pyr;
+
+private:
+    const std::shared_ptr<PreparedSource> _source;
+    const int _patch_size, _nr_scales;
+    /**
+     * The Gaussian pyramid of the hole and the masks where its levels are non-zero, the hole pyramid of HoleFilling.
+     */
+    std::vector<cv::Mat> _blurred_hole_pyr, _hole_pyr;
+    /**
+     * Every level of the image with its hole filled. Whole levels, so they stay valid when the target rects move.
+     */
+    std::vector<cv::Mat> _target_area_pyr;
+    // Matcher of every scale, nullptr until the scale is refilled for the first time.
+    std::vector<std::shared_ptr<RandomizedPatchMatch>> _matcher_pyr;
+    cv::Rect _refilled_region;
+
+    /**
+     * '_refilled_region' on every level: the pixels of the level the changed pixels can reach through the pyramid.
+     */
+    std::vector<cv::Rect> refilledRegionPyramid() const;
+
+    /**
+     * Moves the kept nearest neighbor field of 'scale' to the target rect of its current hole.
+     */
+    void reanchor(const int scale);
+
+    /**
+     * EM steps on the hole pixels of 'scale' inside 'region', with the patches overlapping them as target. 'added'
+     * (of the size of 'region') is non-zero where pixels were added to the hole, which start from the coarser level.
+     */
+    void refillScale(const int scale, const cv::Rect &region, const cv::Mat &added);
+
+    RandomizedPatchMatch &matcherFor(const int scale);
+};
+
+#endif //PATCHMATCH_HOLEFILLINGSESSION_H
@@ -0,0 +1,170 @@
+#include "LabPyramid.h"
+#include "ThreadPool.h"
+
+using cv::borderInterpolate;
+using cv::Mat;
+using cv::Range;
+using cv::Size;
+using std::vector;
+
+/**
+ * Number of destination rows of a pyramid level per band. Small enough that the source rows of a band stay in the
+ * cache while they are downscaled, large enough that the rows at the band borders, which are read (and converted) by
+ * both neighboring bands, are few. Default: 8.
+ */
+constexpr int PYRAMID_BAND_ROWS = 8;
+
+namespace {
+    void convertRow(const Mat &input_row, Mat &lab_row, Mat &buffer, int code) {
+        if (input_row.depth() == CV_32F) {
+            cvtColor(input_row, lab_row, code);
+        } else {
+            input_row.convertTo(buffer, CV_32F, 1 / 255.f);
+            cvtColor(buffer, lab_row, code);
+        }
+    }
+
+    class ParallelConvert : public cv::ParallelLoopBody {
+
+    private:
+        const Mat &_input;
+        Mat &_lab;
+        const int _code;
+
+    public:
+        ParallelConvert(const Mat &input, Mat &lab, int code) : _input(input), _lab(lab), _code(code) { }
+
+        virtual void operator()(const Range &range) const override {
+            Mat buffer;
+            for (int y = range.start; y < range.end; y++) {
+                Mat lab_row = _lab.row(y);
+                convertRow(_input.row(y), lab_row, buffer, _code);
+            }
+        }
+    };
+
+    /**
+     * Computes one pyramid level from the previous one, band by band. If '_input' is given, the previous level is
+     * converted from it on the way: every band converts the source rows between its own and the next band's, in the
+     * order they are needed, and the few rows at its border owned by the neighbors into a buffer.
+     */
+    class ParallelPyrDown : public cv::ParallelLoopBody {
+
+    private:
+        const Mat &_input;
+        Mat &_src, &_dst;
+        const int _code;
+
+    public:
+        ParallelPyrDown(const Mat &input, Mat &src, Mat &dst, int code) :
+                _input(input), _src(src), _dst(dst), _code(code) { }
+
+        virtual void operator()(const Range &range) const override {
+            constexpr int MAX_BORDER_ROWS = 4;
+            Mat border(MAX_BORDER_ROWS, _src.cols, _src.type()), buffer;
+            vector<float> tmp(static_cast<size_t>(_src.cols) * _src.channels());
+            const float *rows[5];
+            for (int band = range.start; band < range.end; band++) {
+                const int dst_begin = band * PYRAMID_BAND_ROWS;
+                const int dst_end = std::min(dst_begin + PYRAMID_BAND_ROWS, _dst.rows);
+                const int owned_begin = 2 * dst_begin;
+                const int owned_end = dst_end == _dst.rows ? _src.rows : 2 * dst_end;
+                int converted_end = owned_begin;
+                int border_rows[MAX_BORDER_ROWS];
+                int nr_border_rows = 0;
+                for (int y = dst_begin; y < dst_end; y++) {
+                    for (int k = 0; k < 5; k++) {
+                        const int i = borderInterpolate(2 * y - 2 + k, _src.rows, cv::BORDER_REFLECT_101);
+                        if (_input.empty()) {
+                            rows[k] = _src.ptr<float>(i);
+                        } else if (i >= owned_begin && i < owned_end) {
+                            for (; converted_end <= i; converted_end++) {
+                                Mat row = _src.row(converted_end);
+                                convertRow(_input.row(converted_end), row, buffer, _code);
+                            }
+                            rows[k] = _src.ptr<float>(i);
+                        } else {
+                            int b = 0;
+                            while (b < nr_border_rows && border_rows[b] != i)
+                                b++;
+                            if (b == nr_border_rows) {
+                                CV_Assert(b < MAX_BORDER_ROWS);
+                                Mat row = border.row(b);
+                                convertRow(_input.row(i), row, buffer, _code);
+                                border_rows[nr_border_rows++] = i;
+                            }
+                            rows[k] = border.ptr<float>(b);
+                        }
+                    }
+                    pmutil::pyrDownRow(rows, tmp.data(), _dst.ptr<float>(y), _src.cols, _dst.cols, _src.channels());
+                }
+                for (; !_input.empty() && converted_end < owned_end; converted_end++) {
+                    Mat row = _src.row(converted_end);
+                    convertRow(_input.row(converted_end), row, buffer, _code);
+                }
+            }
+        }
+    };
+
+    int nrBands(int rows) {
+        return (rows + PYRAMID_BAND_ROWS - 1) / PYRAMID_BAND_ROWS;
+    }
+
+    void pyrDownLevels(vector<Mat> &pyr, int max_level) {
+        const Mat no_input;
+        for (int level = static_cast<int>(pyr.size()); level <= max_level; level++) {
+            const Size size((pyr[level - 1].cols + 1) / 2, (pyr[level - 1].rows + 1) / 2);
+            pyr.push_back(Mat(size, pyr[level - 1].type()));
+            ParallelPyrDown pyr_down(no_input, pyr[level - 1], pyr[level], -1);
+            ThreadPool::current().parallelFor(Range(0, nrBands(pyr[level].rows)), pyr_down);
+        }
+    }
+}
+
+namespace pmutil {
+
+    void buildPyramidParallel(const Mat &img, vector<Mat> &pyr, int max_level) {
+        if (img.depth() != CV_32F) {
+            buildPyramid(img, pyr, max_level);
+            return;
+        }
+        pyr.assign(1, img);
+        pyrDownLevels(pyr, max_level);
+    }
+
+    void buildLabPyramid(const Mat &img, vector<Mat> &pyr, int max_level, int code) {
+        CV_Assert(img.depth() == CV_8U || img.depth() == CV_32F);
+        pyr.assign(1, Mat(img.size(), CV_32FC3));
+        if (max_level == 0) {
+            ParallelConvert convert(img, pyr[0], code);
+            ThreadPool::current().parallelFor(Range(0, img.rows), convert, PYRAMID_BAND_ROWS);
+            return;
+        }
+        pyr.push_back(Mat(Size((img.cols + 1) / 2, (img.rows + 1) / 2), CV_32FC3));
+        ParallelPyrDown convert_and_pyr_down(img, pyr[0], pyr[1], code);
+        ThreadPool::current().parallelFor(Range(0, nrBands(pyr[1].rows)), convert_and_pyr_down);
+        pyrDownLevels(pyr, max_level);
+    }
+
+    void pyrDownRow(const float *const rows[5], float *tmp, float *dst, int src_cols, int dst_cols, int channels) {
+        const int length = src_cols * channels;
+        for (int i = 0; i < length; i++)
+            tmp[i] = rows[0][i] + rows[4][i] + 4 * (rows[1][i] + rows[3][i]) + 6 * rows[2][i];
+
+        constexpr float NORMALIZATION = 1 / 256.f;
+        for (int x = 0; x < dst_cols; x++) {
+            int xs[5];
+            if (x >= 1 && 2 * x + 2 < src_cols) {
+                for (int k = 0; k < 5; k++)
+                    xs[k] = (2 * x - 2 + k) * channels;
+            } else {
+                for (int k = 0; k < 5; k++)
+                    xs[k] = borderInterpolate(2 * x - 2 + k, src_cols, cv::BORDER_REFLECT_101) * channels;
+            }
+            for (int c = 0; c < channels; c++) {
+                dst[x * channels + c] = (tmp[xs[0] + c] + tmp[xs[4] + c] + 4 * (tmp[xs[1] + c] + tmp[xs[3] + c]) +
+                                         6 * tmp[xs[2] + c]) * NORMALIZATION;
+            }
+        }
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef PATCHMATCH_LABPYRAMID_H
+#define PATCHMATCH_LABPYRAMID_H
+
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+
+/**
+ * Preprocessing of images for computation, parallel across bands of rows.
+ */
+namespace pmutil {
+
+    /**
+     * Same as cv::buildPyramid (5x5 Gaussian, reflected borders), but 'img' itself is level 0 (not a copy) and every
+     * level is computed in parallel bands of rows, each in a single pass over its source rows. Only float images are
+     * done in bands, others are passed on to cv::buildPyramid.
+     */
+    void buildPyramidParallel(const cv::Mat &img, std::vector<cv::Mat> &pyr, int max_level);
+
+    /**
+     * Converts 'img' (8 bit, scaled to [0, 1], or float; three or four channels) with 'code' (e.g. CV_BGR2Lab) to float
+     * L*a*b* and builds its Gaussian pyramid, as buildPyramidParallel. The conversion is fused with building level 1:
+     * every band converts the rows it needs right before downscaling them, while they are in the cache.
+     */
+    void buildLabPyramid(const cv::Mat &img, std::vector<cv::Mat> &pyr, int max_level, int code = CV_BGR2Lab);
+
+    /**
+     * Downscales one row: 'rows' are the five (border interpolated) source rows around the center row 2 * y of the
+     * destination row y. 'tmp' has room for one source row.
+     */
+    void pyrDownRow(const float *const rows[5], float *tmp, float *dst, int src_cols, int dst_cols, int channels);
+}
+
+#endif //PATCHMATCH_LABPYRAMID_H
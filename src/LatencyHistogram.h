@@ -0,0 +1,67 @@
+#ifndef PATCHMATCH_LATENCYHISTOGRAM_H
+#define PATCHMATCH_LATENCYHISTOGRAM_H
+
+#include <atomic>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * Thread safe histogram of latencies with fixed bucket bounds (in seconds), exported in the Prometheus text format.
+ */
+class LatencyHistogram {
+
+public:
+    explicit LatencyHistogram(const std::vector<double> &bounds = defaultBounds())
+            : _bounds(bounds), _counts(bounds.size() + 1) {
+        for (std::atomic<uint64_t> &count: _counts)
+            count = 0;
+    }
+
+    void record(double seconds) {
+        size_t bucket = 0;
+        while (bucket < _bounds.size() && seconds > _bounds[bucket])
+            bucket++;
+        _counts[bucket]++;
+        // No atomic add for doubles in C++11, so the sum is kept in microseconds.
+        _sum_micros += static_cast<uint64_t>(seconds * 1e6);
+    }
+
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (const std::atomic<uint64_t> &count: _counts)
+            total += count;
+        return total;
+    }
+
+    /**
+     * The histogram as Prometheus metric 'name', with cumulative buckets.
+     */
+    std::string toPrometheus(const std::string &name) const {
+        std::ostringstream out;
+        out << "# TYPE " << name << " histogram\n";
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < _bounds.size(); i++) {
+            cumulative += _counts[i];
+            out << name << "_bucket{le=\"" << _bounds[i] << "\"} " << cumulative << "\n";
+        }
+        cumulative += _counts.back();
+        out << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+        out << name << "_sum " << _sum_micros / 1e6 << "\n";
+        out << name << "_count " << cumulative << "\n";
+        return out.str();
+    }
+
+    static std::vector<double> defaultBounds() {
+        return {0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30};
+    }
+
+private:
+    const std::vector<double> _bounds;
+    // One count per bucket, the last one for latencies above all bounds.
+    std::vector<std::atomic<uint64_t>> _counts;
+    std::atomic<uint64_t> _sum_micros{0};
+};
+
+#endif //PATCHMATCH_LATENCYHISTOGRAM_H
@@ -0,0 +1,312 @@
+#include "MaskedPoissonSolver.h"
+#include "ThreadPool.h"
+#include "util.h"
+
+using cv::Mat;
+using cv::Point;
+using cv::Range;
+using cv::Rect;
+using cv::Size;
+using pmutil::computeDivergence;
+using std::array;
+using std::max;
+using std::vector;
+
+constexpr float MaskedPoissonSolver::DEFAULT_TOLERANCE;
+constexpr int MaskedPoissonSolver::DEFAULT_MAX_ITERATIONS;
+
+/**
+ * Coarsening stops once a level has at most this many unknowns.
+ */
+constexpr size_t COARSEST_LEVEL_SIZE = 64;
+constexpr int MAX_LEVELS = 16;
+/**
+ * Number of damped Jacobi sweeps before and after the coarse grid correction, and on the coarsest level.
+ */
+constexpr int SMOOTHING_SWEEPS = 2;
+constexpr int COARSEST_SWEEPS = 20;
+constexpr float JACOBI_DAMPING = 0.8f;
+
+namespace {
+    constexpr int NR_DIRECTIONS = 4;
+    const Point DIRECTIONS[NR_DIRECTIONS] = {Point(-1, 0), Point(1, 0), Point(0, -1), Point(0, 1)};
+
+    /**
+     * Vectors of every level, reused over all iterations of one solve.
+     */
+    struct MultigridWorkspace {
+        vector<vector<float>> rhs, x, tmp;
+
+        explicit MultigridWorkspace(size_t nr_levels) : rhs(nr_levels), x(nr_levels), tmp(nr_levels) { }
+    };
+
+    double dot(const vector<float> &a, const vector<float> &b) {
+        double sum = 0;
+        for (size_t i = 0; i < a.size(); i++)
+            sum += static_cast<double>(a[i]) * b[i];
+        return sum;
+    }
+
+    void applyOperator(const MultigridLevel &level, const vector<float> &x, vector<float> &ax) {
+        ax.resize(x.size());
+        for (size_t p = 0; p < x.size(); p++) {
+            float sum = level.diagonal[p] * x[p];
+            for (int dir = 0; dir < NR_DIRECTIONS; dir++) {
+                const int neighbor = level.neighbors[p][dir];
+                if (neighbor >= 0)
+                    sum -= level.weights[p][dir] * x[neighbor];
+            }
+            ax[p] = sum;
+        }
+    }
+
+    void jacobi(const MultigridLevel &level, const vector<float> &rhs, int sweeps, vector<float> &x,
+                vector<float> &tmp) {
+        for (int sweep = 0; sweep < sweeps; sweep++) {
+            applyOperator(level, x, tmp);
+            for (size_t p = 0; p < x.size(); p++) {
+                if (level.diagonal[p] > 0)
+                    x[p] += JACOBI_DAMPING * (rhs[p] - tmp[p]) / level.diagonal[p];
+            }
+        }
+    }
+
+    /**
+     * Approximately solves A x = rhs on level 'l', with rhs taken from and x written to the workspace.
+     * Starts from zero and uses the same number of sweeps before and after the correction, so the V-cycle is a
+     * symmetric positive definite operator and can be used as preconditioner for conjugate gradients.
+     */
+    void vCycle(const vector<MultigridLevel> &levels, size_t l, MultigridWorkspace *ws) {
+        const MultigridLevel &level = levels[l];
+        const vector<float> &rhs = ws->rhs[l];
+        vector<float> &x = ws->x[l];
+        vector<float> &tmp = ws->tmp[l];
+        x.assign(level.size(), 0.f);
+        if (l + 1 == levels.size()) {
+            jacobi(level, rhs, COARSEST_SWEEPS, x, tmp);
+            return;
+        }
+
+        jacobi(level, rhs, SMOOTHING_SWEEPS, x, tmp);
+        // Restrict the residual by summing over every aggregate.
+        applyOperator(level, x, tmp);
+        vector<float> &coarse_rhs = ws->rhs[l + 1];
+        coarse_rhs.assign(levels[l + 1].size(), 0.f);
+        for (size_t p = 0; p < level.size(); p++)
+            coarse_rhs[level.parents[p]] += rhs[p] - tmp[p];
+        vCycle(levels, l + 1, ws);
+        // Prolongate the correction, constant over every aggregate.
+        const vector<float> &coarse_x = ws->x[l + 1];
+        for (size_t p = 0; p < level.size(); p++)
+            x[p] += coarse_x[level.parents[p]];
+        jacobi(level, rhs, SMOOTHING_SWEEPS, x, tmp);
+    }
+
+    /**
+     * Aggregates 2x2 blocks of 'fine' into one unknown each, with the Galerkin operator P^T A P.
+     */
+    MultigridLevel coarsen(MultigridLevel &fine, const Size &fine_grid_size, Size &coarse_grid_size) {
+        coarse_grid_size = Size((fine_grid_size.width + 1) / 2, (fine_grid_size.height + 1) / 2);
+        Mat index(coarse_grid_size, CV_32S, cv::Scalar(-1));
+        MultigridLevel coarse;
+        fine.parents.resize(fine.size());
+        for (size_t p = 0; p < fine.size(); p++) {
+            const Point coarse_pixel(fine.pixels[p].x / 2, fine.pixels[p].y / 2);
+            int &coarse_idx = index.at<int>(coarse_pixel);
+            if (coarse_idx < 0) {
+                coarse_idx = static_cast<int>(coarse.size());
+                coarse.pixels.push_back(coarse_pixel);
+                coarse.diagonal.push_back(0);
+                coarse.neighbors.push_back({{-1, -1, -1, -1}});
+                coarse.weights.push_back({{0, 0, 0, 0}});
+            }
+            fine.parents[p] = coarse_idx;
+        }
+
+        for (size_t p = 0; p < fine.size(); p++) {
+            const int parent = fine.parents[p];
+            coarse.diagonal[parent] += fine.diagonal[p];
+            for (int dir = 0; dir < NR_DIRECTIONS; dir++) {
+                const int neighbor = fine.neighbors[p][dir];
+                if (neighbor < 0)
+                    continue;
+                const int neighbor_parent = fine.parents[neighbor];
+                if (neighbor_parent == parent) {
+                    // Couplings inside an aggregate end up on the diagonal.
+                    coarse.diagonal[parent] -= fine.weights[p][dir];
+                } else {
+                    // Neighbors across a block edge always lie in the neighboring block in the same direction.
+                    coarse.neighbors[parent][dir] = neighbor_parent;
+                    coarse.weights[parent][dir] += fine.weights[p][dir];
+                }
+            }
+        }
+        return coarse;
+    }
+
+    /**
+     * Preconditioned conjugate gradients for one channel. Returns the number of iterations.
+     */
+    int solveChannel(const vector<MultigridLevel> &levels, const Mat &img, const Mat &divergence, const Mat &mask,
+                     const Mat &initial_guess, float tolerance, int max_iterations, Mat &result) {
+        const MultigridLevel &fine = levels[0];
+        const Rect image_rect(Point(0, 0), img.size());
+        const size_t n = fine.size();
+
+        // Right side: negative divergence, plus the known neighbors moved over from the operator.
+        vector<float> b(n), x(n);
+        for (size_t p = 0; p < n; p++) {
+            const Point pixel = fine.pixels[p];
+            float rhs = -divergence.at<float>(pixel);
+            for (int dir = 0; dir < NR_DIRECTIONS; dir++) {
+                const Point neighbor = pixel + DIRECTIONS[dir];
+                if (image_rect.contains(neighbor) && mask.at<uchar>(neighbor) == 0)
+                    rhs += img.at<float>(neighbor);
+            }
+            b[p] = rhs;
+            x[p] = initial_guess.at<float>(pixel);
+        }
+
+        MultigridWorkspace ws(levels.size());
+        vector<float> r(n), ap(n), p(n);
+        applyOperator(fine, x, ap);
+        for (size_t i = 0; i < n; i++)
+            r[i] = b[i] - ap[i];
+        const double threshold = tolerance * max(std::sqrt(dot(b, b)), 1e-12);
+
+        int iteration = 0;
+        double rz = 0;
+        while (std::sqrt(dot(r, r)) > threshold && iteration < max_iterations) {
+            ws.rhs[0] = r;
+            vCycle(levels, 0, &ws);
+            const vector<float> &z = ws.x[0];
+            const double rz_new = dot(r, z);
+            if (iteration == 0) {
+                p = z;
+            } else {
+                const float beta = static_cast<float>(rz_new / rz);
+                for (size_t i = 0; i < n; i++)
+                    p[i] = z[i] + beta * p[i];
+            }
+            rz = rz_new;
+
+            applyOperator(fine, p, ap);
+            const float alpha = static_cast<float>(rz / dot(p, ap));
+            for (size_t i = 0; i < n; i++) {
+                x[i] += alpha * p[i];
+                r[i] -= alpha * ap[i];
+            }
+            iteration++;
+        }
+
+        result = img.clone();
+        for (size_t i = 0; i < n; i++)
+            result.at<float>(fine.pixels[i]) = x[i];
+        return iteration;
+    }
+
+    class ParallelMaskedChannelSolver : public cv::ParallelLoopBody {
+
+    private:
+        const vector<MultigridLevel> &_levels;
+        const vector<Mat> &_img_chans, &_divergence_chans, &_guess_chans;
+        const Mat &_mask;
+        const float _tolerance;
+        const int _max_iterations;
+        vector<Mat> &_result_chans;
+        vector<int> &_iterations;
+
+    public:
+        ParallelMaskedChannelSolver(const vector<MultigridLevel> &levels, const vector<Mat> &img_chans,
+                                    const vector<Mat> &divergence_chans, const vector<Mat> &guess_chans,
+                                    const Mat &mask, float tolerance, int max_iterations,
+                                    vector<Mat> &result_chans, vector<int> &iterations) :
+                _levels(levels), _img_chans(img_chans), _divergence_chans(divergence_chans),
+                _guess_chans(guess_chans), _mask(mask), _tolerance(tolerance), _max_iterations(max_iterations),
+                _result_chans(result_chans), _iterations(iterations) { }
+
+        virtual void operator()(const Range &range) const override {
+            for (int c = range.start; c < range.end; c++) {
+                _iterations[c] = solveChannel(_levels, _img_chans[c], _divergence_chans[c], _mask, _guess_chans[c],
+                                              _tolerance, _max_iterations, _result_chans[c]);
+            }
+        }
+    };
+}
+
+MaskedPoissonSolver::MaskedPoissonSolver(const Mat &img, const Mat &gradient_x, const Mat &gradient_y,
+                                         const Mat &mask, float tolerance, int max_iterations) :
+        _img(img), _mask(mask), _tolerance(tolerance), _max_iterations(max_iterations) {
+    CV_DbgAssert(img.size() == gradient_x.size());
+    CV_DbgAssert(img.size() == gradient_y.size());
+    CV_DbgAssert(img.size() == mask.size());
+    computeDivergence(gradient_x, gradient_y, _divergence);
+    buildHierarchy();
+}
+
+void MaskedPoissonSolver::buildHierarchy() {
+    const Rect image_rect(Point(0, 0), _img.size());
+    Mat index(_img.size(), CV_32S, cv::Scalar(-1));
+    MultigridLevel fine;
+    for (int y = 0; y < _img.rows; y++) {
+        for (int x = 0; x < _img.cols; x++) {
+            if (_mask.at<uchar>(y, x) > 0) {
+                index.at<int>(y, x) = static_cast<int>(fine.size());
+                fine.pixels.push_back(Point(x, y));
+            }
+        }
+    }
+    if (fine.size() == 0)
+        return;
+
+    // 5 point laplacian, pixels outside of the image are left out (Neumann boundary).
+    for (const Point &pixel: fine.pixels) {
+        float diagonal = 0;
+        array<int, 4> neighbors = {{-1, -1, -1, -1}};
+        array<float, 4> weights = {{0, 0, 0, 0}};
+        for (int dir = 0; dir < NR_DIRECTIONS; dir++) {
+            const Point neighbor = pixel + DIRECTIONS[dir];
+            if (!image_rect.contains(neighbor))
+                continue;
+            diagonal += 1;
+            const int neighbor_idx = index.at<int>(neighbor);
+            if (neighbor_idx >= 0) {
+                neighbors[dir] = neighbor_idx;
+                weights[dir] = 1;
+            }
+        }
+        fine.diagonal.push_back(diagonal);
+        fine.neighbors.push_back(neighbors);
+        fine.weights.push_back(weights);
+    }
+    _levels.push_back(fine);
+
+    Size grid_size = _img.size();
+    while (_levels.back().size() > COARSEST_LEVEL_SIZE && _levels.size() < MAX_LEVELS) {
+        Size coarse_grid_size;
+        MultigridLevel coarse = coarsen(_levels.back(), grid_size, coarse_grid_size);
+        if (coarse.size() == _levels.back().size())
+            break;
+        _levels.push_back(coarse);
+        grid_size = coarse_grid_size;
+    }
+}
+
+void MaskedPoissonSolver::solve(Mat &result, const Mat &initial_guess) {
+    _iterations = 0;
+    if (_levels.empty()) {
+        result = _img.clone();
+        return;
+    }
+    vector<Mat> img_chans, divergence_chans, guess_chans;
+    cv::split(_img, img_chans);
+    cv::split(_divergence, divergence_chans);
+    cv::split(initial_guess.empty() ? _img : initial_guess, guess_chans);
+    vector<Mat> result_chans(img_chans.size());
+    vector<int> iterations(img_chans.size(), 0);
+    ParallelMaskedChannelSolver pmcs(_levels, img_chans, divergence_chans, guess_chans, _mask, _tolerance,
+                                     _max_iterations, result_chans, iterations);
+    ThreadPool::current().parallelFor(Range(0, static_cast<int>(img_chans.size())), pmcs);
+    cv::merge(result_chans, result);
+    _iterations = *std::max_element(iterations.begin(), iterations.end());
+}
@@ -0,0 +1,78 @@
+#ifndef PATCHMATCH_MASKEDPOISSONSOLVER_H
+#define PATCHMATCH_MASKEDPOISSONSOLVER_H
+
+#include <array>
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+
+/**
+ * One level of the multigrid hierarchy of MaskedPoissonSolver. Unknowns are coupled to their 4 neighbors, the operator
+ * is (A x)_p = diagonal_p * x_p - sum_k weights_p[k] * x_(neighbors_p[k]).
+ */
+struct MultigridLevel {
+    // Position of every unknown on the grid of this level.
+    std::vector<cv::Point> pixels;
+    std::vector<float> diagonal;
+    // Index of the neighboring unknown (left, right, up, down) or -1 if there is none.
+    std::vector<std::array<int, 4>> neighbors;
+    std::vector<std::array<float, 4>> weights;
+    // Index of the unknown on the next coarser level every unknown is aggregated into.
+    std::vector<int> parents;
+
+    size_t size() const { return pixels.size(); }
+};
+
+/**
+ * Solves the Poisson equation only for the pixels inside a mask, the pixels around it are the (Dirichlet) boundary.
+ * In contrast to PoissonSolver, the work scales with the number of masked pixels instead of the whole image.
+ *
+ * The sparse system is solved by conjugate gradients, preconditioned with one V-cycle of an aggregation multigrid
+ * (2x2 blocks, Galerkin coarse operators, damped Jacobi smoothing). Iteration starts from a given guess, e.g. the
+ * solution of the previous EM step, and stops once the residual is reduced by 'tolerance'.
+ */
+class MaskedPoissonSolver {
+public:
+    static constexpr float DEFAULT_TOLERANCE = 1e-5f;
+    static constexpr int DEFAULT_MAX_ITERATIONS = 100;
+
+    /**
+     * @param img float image giving the values of all pixels outside of mask.
+     * @param gradient_x the x gradients (forward differences, see pmutil::computeGradientX) the solution should have.
+     * @param gradient_y the y gradients the solution should have.
+     * @param mask CV_8U, non zero for the pixels that are solved for.
+     * @param tolerance iteration stops once the residual is smaller than tolerance times the norm of the right side.
+     * @param max_iterations maximum number of conjugate gradient iterations per channel.
+     */
+    MaskedPoissonSolver(const cv::Mat &img, const cv::Mat &gradient_x, const cv::Mat &gradient_y,
+                        const cv::Mat &mask, float tolerance = DEFAULT_TOLERANCE,
+                        int max_iterations = DEFAULT_MAX_ITERATIONS);
+
+    /**
+     * Solves all channels, pixels outside of the mask are copied from img.
+     * @param initial_guess its values inside the mask are the starting point of the iteration. If empty, the values
+     * of img are used.
+     */
+    void solve(cv::Mat &result, const cv::Mat &initial_guess = cv::Mat());
+
+    /**
+     * Number of iterations the last call to solve needed, maximum over all channels.
+     */
+    int iterations() const { return _iterations; }
+
+    /**
+     * Number of levels of the multigrid hierarchy, 0 if the mask is empty.
+     */
+    size_t nrLevels() const { return _levels.size(); }
+
+private:
+    const cv::Mat _img, _mask;
+    cv::Mat _divergence;
+    const float _tolerance;
+    const int _max_iterations;
+    std::vector<MultigridLevel> _levels;
+    int _iterations = 0;
+
+    void buildHierarchy();
+};
+
+#endif //PATCHMATCH_MASKEDPOISSONSOLVER_H
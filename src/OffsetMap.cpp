@@ -1,14 +1,21 @@
 #include "OffsetMap.h"
 
 using cv::Mat;
+using cv::Point;
 using cv::Size;
-using std::sort;
-using std::transform;
+using std::nth_element;
 using std::vector;
 
 namespace {
-    float map_to_distance(const OffsetMapEntry &entry) {
-        return entry.distance;
+    /**
+     * The distance at 'fraction' of 'distances' ordered, which are reordered on the way.
+     */
+    float selectPercentile(vector<float> &distances, double fraction) {
+        CV_Assert(!distances.empty() && fraction >= 0 && fraction <= 1);
+        const vector<float>::iterator percentile = distances.begin() +
+                                                   static_cast<int>((distances.size() - 1) * fraction);
+        nth_element(distances.begin(), percentile, distances.end());
+        return *percentile;
     }
 }
 
@@ -22,12 +29,45 @@ OffsetMapEntry *OffsetMap::ptr(const int y, const int x) {
     return &_data[y + x * _height];
 }
 
-float OffsetMap::get75PercentileDistance() const {
+float OffsetMap::percentileDistance(double fraction) const {
     vector<float> distances(_data.size());
-    transform(_data.begin(), _data.end(), distances.begin(), map_to_distance);
-    sort(distances.begin(), distances.end());
-    int percentile_idx = static_cast<int>((distances.size() - 1) * 3.0 / 4.0);
-    return distances[percentile_idx];
+    for (size_t i = 0; i < _data.size(); i++)
+        distances[i] = _data[i].distance;
+    return selectPercentile(distances, fraction);
+}
+
+DistanceStatistics OffsetMap::statistics() {
+    DistanceStatistics statistics;
+    const bool first = _last_distances.size() != _data.size();
+    if (first)
+        _last_distances.resize(_data.size());
+    for (size_t i = 0; i < _data.size(); i++) {
+        const float distance = _data[i].distance;
+        statistics.summed_distance += distance;
+        if (first || _last_distances[i] != distance) {
+            statistics.nr_updated++;
+            _last_distances[i] = distance;
+        }
+    }
+    vector<float> distances(_last_distances);
+    statistics.percentile_75_distance = selectPercentile(distances, 0.75);
+    return statistics;
+}
+
+std::shared_ptr<OffsetMap> OffsetMap::shifted(const Point &previous_tl, const Point &target_tl, const Point &motion,
+                                              int width, int height) const {
+    std::shared_ptr<OffsetMap> shifted = std::make_shared<OffsetMap>(width, height);
+    const Point lookup_shift = target_tl - motion - previous_tl;
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) {
+            const int previous_x = std::min(std::max(x + lookup_shift.x, 0), _width - 1);
+            const int previous_y = std::min(std::max(y + lookup_shift.y, 0), _height - 1);
+            OffsetMapEntry *entry = shifted->ptr(y, x);
+            *entry = at(previous_y, previous_x);
+            entry->offset += target_tl - previous_tl;
+        }
+    }
+    return shifted;
 }
 
 double OffsetMap::summedDistance() const {
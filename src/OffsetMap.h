@@ -1,37 +1,52 @@
 #ifndef PATCHMATCH_OFFSETMAP_H
 #define PATCHMATCH_OFFSETMAP_H
 
+#include <memory>
 #include <opencv2/imgproc/imgproc.hpp>
+#include "TransformedSources.h"
 
 
 class OffsetMapEntry {
 public:
     cv::Point offset;
     float distance;
-    unsigned int rotation_idx;
-    // TODO: add more attributes like rotation, gain, bias etc.
+    // Index of the transformation (rotation, scale, reflection) of the source the offset refers to.
+    unsigned int transform_idx;
+    // Source the offset refers to, 0 is the primary source, i > 0 the image i - 1 of a SourceLibrary.
+    unsigned int source_idx = 0;
+    // Photometric compensation per channel, the source patch matches gain * patch + bias. Only used if gain/bias
+    // compensation is enabled, identity otherwise.
+    cv::Vec3f gain = cv::Vec3f(1, 1, 1);
+    cv::Vec3f bias = cv::Vec3f(0, 0, 0);
 
     /**
      * May return an empty matrix if the patch to be extracted is not inside the image.
      */
-    const cv::Mat extractFrom(const std::vector<cv::Mat> &srcs, const int x, const int y,
+    const cv::Mat extractFrom(const TransformedSources &srcs, const int x, const int y,
                               const int patch_size, const int scale_change = 1) const {
-        const cv::Mat &src = srcs[rotation_idx];
         cv::Rect roi = cv::Rect((offset.x + x) * scale_change, (offset.y + y) * scale_change,
                                 patch_size * scale_change, patch_size * scale_change);
-        if (roi.x >= 0 && roi.y >= 0 && roi.x + roi.width <= src.cols && roi.y + roi.width <= src.rows)
-            return src(roi);
-        else
-            return cv::Mat();
+        return srcs.patch(transform_idx, roi);
     }
 
     void merge(const OffsetMapEntry &other, float d) {
         this->offset = other.offset;
-        this->rotation_idx = other.rotation_idx;
+        this->transform_idx = other.transform_idx;
+        this->source_idx = other.source_idx;
+        this->gain = other.gain;
+        this->bias = other.bias;
         this->distance = d;
     }
 };
 
+struct DistanceStatistics {
+    double summed_distance = 0;
+    // Wexler et al suggest the 75 percentile as sigma for the voting.
+    float percentile_75_distance = 0;
+    // Entries whose distance changed since the previous statistics() of the map, all entries the first time.
+    size_t nr_updated = 0;
+};
+
 class OffsetMap {
 
 public:
@@ -42,10 +57,29 @@ public:
     bool isFlipped() const { return _flipped; };
     void flip() {
         std::reverse(_data.begin(), _data.end());
+        std::reverse(_last_distances.begin(), _last_distances.end());
         _flipped = !_flipped;
     };
 
-    float get75PercentileDistance() const;
+    /**
+     * Distance at 'fraction' (in [0, 1]) of the entries ordered by distance. Selects it in linear time (no sort).
+     */
+    float percentileDistance(double fraction) const;
+    float get75PercentileDistance() const { return percentileDistance(0.75); };
+
+    /**
+     * Sum, 75 percentile and number of updated entries in a single pass over the map. Starts counting updated entries
+     * anew, so the next call counts the ones changed after this one.
+     */
+    DistanceStatistics statistics();
+
+    /**
+     * Offset map of size width x height for the target patches at 'target_tl', taken from this map of the target
+     * patches at 'previous_tl' for content moved by 'motion'. Offsets are relative to the target rect, so they are
+     * corrected by the change of its position. Target patches without corresponding one take the closest.
+     */
+    std::shared_ptr<OffsetMap> shifted(const cv::Point &previous_tl, const cv::Point &target_tl,
+                                       const cv::Point &motion, int width, int height) const;
 
     const int _height, _width;
 
@@ -59,6 +93,8 @@ public:
 private:
     std::vector<OffsetMapEntry> _data;
     bool _flipped = false;
+    // Distances of the entries in the order of _data as of the previous statistics().
+    std::vector<float> _last_distances;
 };
 
 #endif //PATCHMATCH_OFFSETMAP_H
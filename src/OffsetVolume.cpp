@@ -0,0 +1,39 @@
+#include "OffsetVolume.h"
+
+using std::make_shared;
+using std::vector;
+
+OffsetVolume::OffsetVolume(const int width, const int height, const size_t max_frames) :
+        _width(width), _height(height), _max_frames(max_frames) {
+    CV_Assert(max_frames > 0);
+}
+
+OffsetMap &OffsetVolume::push() {
+    if (_maps.size() == _max_frames) {
+        _maps.pop_front();
+        _frame_offsets.pop_front();
+        _first_frame++;
+    }
+    _maps.push_back(make_shared<OffsetMap>(_width, _height));
+    _frame_offsets.push_back(vector<int>(static_cast<size_t>(_width) * _height, 0));
+    return *_maps.back();
+}
+
+SpaceTimeEntry OffsetVolume::at(const long frame, const int y, const int x) const {
+    SpaceTimeEntry entry;
+    static_cast<OffsetMapEntry &>(entry) = this->frame(frame).at(y, x);
+    entry.frame_offset = _frame_offsets[frame - _first_frame][y + x * _height];
+    return entry;
+}
+
+void OffsetVolume::set(const long frame, const int y, const int x, const SpaceTimeEntry &entry) {
+    *this->frame(frame).ptr(y, x) = entry;
+    _frame_offsets[frame - _first_frame][y + x * _height] = entry.frame_offset;
+}
+
+void OffsetVolume::flip(const long frame) {
+    this->frame(frame).flip();
+    // Same as the entries of the map, see OffsetMap::flip().
+    vector<int> &frame_offsets = _frame_offsets[frame - _first_frame];
+    std::reverse(frame_offsets.begin(), frame_offsets.end());
+}
@@ -0,0 +1,72 @@
+#ifndef PATCHMATCH_OFFSETVOLUME_H
+#define PATCHMATCH_OFFSETVOLUME_H
+
+#include <deque>
+#include <memory>
+#include <vector>
+#include "OffsetMap.h"
+
+/**
+ * Entry of an OffsetVolume: the source frame is the frame of the target plus 'frame_offset'.
+ */
+struct SpaceTimeEntry : public OffsetMapEntry {
+    int frame_offset = 0;
+};
+
+/**
+ * Offset maps of a sliding window of consecutive frames, i. e. a nearest neighbor field over (x, y, t). Frames are
+ * addressed by their absolute index in the video. Only the last 'max_frames' frames are resident, appending a frame to
+ * a full volume drops the oldest one. A single OffsetMap is the special case of a volume with one frame.
+ *
+ * The frame offsets are kept beside the offset maps, so the entries of 2D maps do not carry them. Offset maps of a
+ * volume must only be flipped with flip(frame), which flips their frame offsets along.
+ */
+class OffsetVolume {
+
+public:
+    OffsetVolume(const int width, const int height, const size_t max_frames);
+
+    /**
+     * Appends an offset map for the frame endFrame(), dropping the oldest frame if necessary. Returns the new map.
+     */
+    OffsetMap &push();
+
+    bool contains(const long frame) const { return frame >= _first_frame && frame < endFrame(); }
+    OffsetMap &frame(const long frame) { return *_maps[frame - _first_frame]; }
+    const OffsetMap &frame(const long frame) const { return *_maps[frame - _first_frame]; }
+    std::shared_ptr<OffsetMap> sharedFrame(const long frame) const { return _maps[frame - _first_frame]; }
+
+    /**
+     * Entry (y, x) of the offset map of 'frame' with its frame offset, addressed like OffsetMap::at().
+     */
+    SpaceTimeEntry at(const long frame, const int y, const int x) const;
+    void set(const long frame, const int y, const int x, const SpaceTimeEntry &entry);
+
+    /**
+     * Flips the offset map of 'frame' (see OffsetMap::flip()) together with its frame offsets.
+     */
+    void flip(const long frame);
+
+    /**
+     * Index of the oldest resident frame.
+     */
+    long firstFrame() const { return _first_frame; }
+
+    /**
+     * One past the index of the newest resident frame.
+     */
+    long endFrame() const { return _first_frame + static_cast<long>(_maps.size()); }
+    size_t nrFrames() const { return _maps.size(); }
+    size_t maxFrames() const { return _max_frames; }
+
+    const int _width, _height;
+
+private:
+    const size_t _max_frames;
+    std::deque<std::shared_ptr<OffsetMap>> _maps;
+    // Per frame, in the order of the entries of its offset map.
+    std::deque<std::vector<int>> _frame_offsets;
+    long _first_frame = 0;
+};
+
+#endif //PATCHMATCH_OFFSETVOLUME_H
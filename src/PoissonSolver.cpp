@@ -0,0 +1,220 @@
+#include "PoissonSolver.h"
+#include "ThreadPool.h"
+#include "util.h"
+#include <map>
+#include <mutex>
+
+using cv::dft;
+using cv::Mat;
+using cv::multiply;
+using cv::Point;
+using cv::Range;
+using cv::Rect;
+using cv::Scalar;
+using cv::Size;
+using cv::transpose;
+using pmutil::computeDivergence;
+using std::lock_guard;
+using std::map;
+using std::mutex;
+using std::pair;
+using std::shared_ptr;
+using std::vector;
+
+/**
+ * Maximum number of image sizes a plan is kept for. The hole filling only solves a few distinct sizes.
+ */
+constexpr size_t MAX_CACHED_PLANS = 16;
+
+/**
+ * Everything needed to solve images of one size, that does not depend on the image content.
+ */
+struct DstPlan {
+    // sin(pi * j / (n + 1)) for j in [0, n], where n is the number of interior columns resp. rows.
+    vector<float> sines_x, sines_y;
+    // Inverse of the eigenvalues of the discrete laplacian, times the normalization of the inverse DSTs.
+    // Stored transposed, i. e. with one row per frequency in x, as that is the layout after the forward transform.
+    Mat inverse_eigenvalues;
+};
+
+namespace {
+    /**
+     * Buffers reused by every solve on the same thread.
+     */
+    struct DstScratch {
+        Mat dft_buffer, rows, rows_transformed, cols, cols_transformed;
+    };
+
+    vector<float> dstSines(int n) {
+        vector<float> sines(n + 1);
+        for (int j = 0; j <= n; j++)
+            sines[j] = static_cast<float>(std::sin(CV_PI * j / (n + 1)));
+        return sines;
+    }
+
+    /**
+     * Unnormalized DST-I of every row of 'src' (n columns), i. e.
+     * dest_k = sum_j src_j * sin(pi * (j + 1) * (k + 1) / (n + 1)).
+     * Computed by a single real DFT of length n + 1 (see Numerical Recipes, sinft):
+     * The input is folded to y_j = sin(pi j / (n + 1)) (x_j + x_{n+1-j}) + (x_j - x_{n+1-j}) / 2 (1-based x, y_0 = 0).
+     * Then the even outputs are the negated imaginary parts of the DFT of y, while the odd outputs are the prefix sums
+     * of its real parts.
+     */
+    void dstRows(const Mat &src, const vector<float> &sines, Mat &buffer, Mat &dest) {
+        const int n = src.cols;
+        const int m = n + 1;
+        buffer.create(src.rows, m, CV_32F);
+        for (int r = 0; r < src.rows; r++) {
+            const float *x = src.ptr<float>(r);
+            float *y = buffer.ptr<float>(r);
+            y[0] = 0;
+            for (int j = 1; j < m; j++) {
+                // x is 0-based here, so x_j is x[j - 1] and x_{m-j} is x[m - j - 1].
+                const float a = x[j - 1];
+                const float b = x[m - j - 1];
+                y[j] = sines[j] * (a + b) + 0.5f * (a - b);
+            }
+        }
+        // Rows of the result are packed as Re_0, Re_1, Im_1, Re_2, Im_2, ...
+        dft(buffer, buffer, cv::DFT_ROWS);
+
+        dest.create(src.rows, n, CV_32F);
+        for (int r = 0; r < src.rows; r++) {
+            const float *f = buffer.ptr<float>(r);
+            float *out = dest.ptr<float>(r);
+            // 1-based output X_k is out[k - 1].
+            out[0] = 0.5f * f[0];
+            for (int k = 1; 2 * k <= n; k++)
+                out[2 * k - 1] = -f[2 * k];
+            for (int k = 1; 2 * k + 1 <= n; k++)
+                out[2 * k] = out[2 * k - 2] + f[2 * k - 1];
+        }
+    }
+
+    /**
+     * Solves the interior of one channel, 'mod_diff' is the laplacian with the boundary moved to the right side.
+     */
+    void solveChannel(const DstPlan &plan, const Mat &img, const Mat &mod_diff, Mat &result) {
+        thread_local DstScratch scratch;
+        const int w = img.cols;
+        const int h = img.rows;
+
+        // Forward DST along x, then along y (on the transposed matrix).
+        dstRows(mod_diff, plan.sines_x, scratch.dft_buffer, scratch.rows_transformed);
+        transpose(scratch.rows_transformed, scratch.cols);
+        dstRows(scratch.cols, plan.sines_y, scratch.dft_buffer, scratch.cols_transformed);
+
+        multiply(scratch.cols_transformed, plan.inverse_eigenvalues, scratch.cols_transformed);
+
+        // DST-I is its own inverse up to normalization, which is part of inverse_eigenvalues.
+        dstRows(scratch.cols_transformed, plan.sines_y, scratch.dft_buffer, scratch.cols);
+        transpose(scratch.cols, scratch.rows);
+        dstRows(scratch.rows, plan.sines_x, scratch.dft_buffer, scratch.rows_transformed);
+
+        // The boundary is given, only the interior is solved.
+        result.create(h, w, CV_32F);
+        img.row(0).copyTo(result.row(0));
+        img.row(h - 1).copyTo(result.row(h - 1));
+        img.col(0).copyTo(result.col(0));
+        img.col(w - 1).copyTo(result.col(w - 1));
+        scratch.rows_transformed.copyTo(result(Rect(1, 1, w - 2, h - 2)));
+    }
+
+    class ParallelChannelSolver : public cv::ParallelLoopBody {
+
+    private:
+        const DstPlan &_plan;
+        const vector<Mat> &_img_chans, &_mod_diff_chans;
+        vector<Mat> &_result_chans;
+
+    public:
+        ParallelChannelSolver(const DstPlan &plan, const vector<Mat> &img_chans, const vector<Mat> &mod_diff_chans,
+                              vector<Mat> &result_chans) :
+                _plan(plan), _img_chans(img_chans), _mod_diff_chans(mod_diff_chans), _result_chans(result_chans) { }
+
+        virtual void operator()(const Range &range) const override {
+            for (int c = range.start; c < range.end; c++) {
+                solveChannel(_plan, _img_chans[c], _mod_diff_chans[c], _result_chans[c]);
+            }
+        }
+    };
+}
+
+PoissonSolver::PoissonSolver(const Mat &img, const Mat &gradient_x, const Mat &gradient_y) : img(img) {
+    CV_DbgAssert(img.size() == gradient_x.size());
+    CV_DbgAssert(img.size() == gradient_y.size());
+    if (img.cols > 2 && img.rows > 2)
+        _plan = planFor(img.size());
+    computeDivergence(gradient_x, gradient_y, lap);
+}
+
+shared_ptr<const DstPlan> PoissonSolver::planFor(const Size &size) {
+    static mutex plans_mutex;
+    static map<pair<int, int>, shared_ptr<const DstPlan>> plans;
+
+    const pair<int, int> key(size.width, size.height);
+    {
+        lock_guard<mutex> lock(plans_mutex);
+        auto cached = plans.find(key);
+        if (cached != plans.end())
+            return cached->second;
+    }
+
+    const int nx = size.width - 2;
+    const int ny = size.height - 2;
+    shared_ptr<DstPlan> plan = std::make_shared<DstPlan>();
+    plan->sines_x = dstSines(nx);
+    plan->sines_y = dstSines(ny);
+    // Eigenvalues of the 5 point laplacian are 2 cos(pi k / (nx + 1)) + 2 cos(pi l / (ny + 1)) - 4. Forward and
+    // inverse DST-I together scale by (nx + 1) / 2 * (ny + 1) / 2.
+    const float normalization = 4.f / ((nx + 1) * (ny + 1));
+    plan->inverse_eigenvalues.create(nx, ny, CV_32F);
+    for (int i = 0; i < nx; i++) {
+        float *row = plan->inverse_eigenvalues.ptr<float>(i);
+        const double filter_x = 2 * std::cos(CV_PI * (i + 1) / (nx + 1));
+        for (int j = 0; j < ny; j++) {
+            const double filter_y = 2 * std::cos(CV_PI * (j + 1) / (ny + 1));
+            row[j] = static_cast<float>(normalization / (filter_x + filter_y - 4));
+        }
+    }
+
+    lock_guard<mutex> lock(plans_mutex);
+    if (plans.size() >= MAX_CACHED_PLANS)
+        plans.clear();
+    plans[key] = plan;
+    return plan;
+}
+
+void PoissonSolver::solve(Mat &result) {
+    const int w = img.cols;
+    const int h = img.rows;
+    if (!_plan) {
+        // Everything is boundary.
+        result = img.clone();
+        return;
+    }
+
+    Mat bound = img.clone();
+
+    // Fills out everything but a 1-border on image with black.
+    rectangle(bound, Point(1, 1), Point(img.cols - 2, img.rows - 2), Scalar::all(0), -1);
+    Mat boundary_points;
+    // Computes laplacian (center will be 0).
+    Laplacian(bound, boundary_points, CV_32F);
+
+    // somehow fixes up boundaries?
+    boundary_points = lap - boundary_points;
+
+    //mod_diff is the laplacian of the image with somewhat fixed boundaries.
+    Mat mod_diff = boundary_points(Rect(1, 1, w - 2, h - 2));
+
+    // Every channel is solved for individually, so we split here into single parts and merge at the end.
+    vector<Mat> img_chans;
+    cv::split(img, img_chans);
+    vector<Mat> mod_diff_chans;
+    cv::split(mod_diff, mod_diff_chans);
+    vector<Mat> result_chans(img_chans.size());
+    ParallelChannelSolver pcs(*_plan, img_chans, mod_diff_chans, result_chans);
+    ThreadPool::current().parallelFor(Range(0, static_cast<int>(img_chans.size())), pcs);
+    cv::merge(result_chans, result);
+}
@@ -0,0 +1,72 @@
+#include "PreparedSource.h"
+#include "HoleFilling.h"
+#include "LabPyramid.h"
+
+using cv::Mat;
+using cv::norm;
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::shared_ptr;
+using std::vector;
+
+constexpr size_t PreparedSource::MAX_CACHED_SEARCH_SPACES;
+
+PreparedSource::PreparedSource(const vector<Mat> &img_pyr, int patch_size,
+                               const SourceTransformations &transformations, float gradient_weight) :
+        _img_pyr(img_pyr), _patch_size(patch_size), _transformations(transformations),
+        _gradient_weight(gradient_weight), _sources_pyr(img_pyr.size()), _search_spaces_pyr(img_pyr.size()) {
+    CV_Assert(!img_pyr.empty());
+}
+
+shared_ptr<PreparedSource> PreparedSource::create(const Mat &img, int patch_size,
+                                                  const SourceTransformations &transformations,
+                                                  float gradient_weight) {
+    // The first level of the pyramid is 'img' itself, copy it so the image of the caller is never modified.
+    vector<Mat> img_pyr;
+    pmutil::buildPyramidParallel(img.clone(), img_pyr, HoleFilling::nrScales(img.size(), patch_size));
+    return make_shared<PreparedSource>(img_pyr, patch_size, transformations, gradient_weight);
+}
+
+shared_ptr<TransformedSources> PreparedSource::sources(int scale) const {
+    CV_Assert(scale >= 0 && scale < static_cast<int>(_img_pyr.size()));
+    lock_guard<mutex> lock(_mutex);
+    shared_ptr<TransformedSources> &sources = _sources_pyr[scale];
+    if (sources == nullptr) {
+        // Gradients are interleaved with the colors, as RandomizedPatchMatch needs them.
+        sources = make_shared<TransformedSources>(_img_pyr[scale], _transformations, _patch_size, 0,
+                                                  TransformedSources::DEFAULT_MAX_CACHED_TILES, _gradient_weight);
+    }
+    return sources;
+}
+
+vector<shared_ptr<TransformedSources>> PreparedSource::sourcesFrom(int scale) const {
+    vector<shared_ptr<TransformedSources>> sources_pyr;
+    for (int s = scale; s < static_cast<int>(_img_pyr.size()); s++)
+        sources_pyr.push_back(sources(s));
+    return sources_pyr;
+}
+
+shared_ptr<const SearchSpace> PreparedSource::searchSpace(int scale, const SearchConstraints &constraints) const {
+    CV_Assert(constraints.allowed.empty() && constraints.allowed_labels.empty() && constraints.max_distance <= 0);
+    const shared_ptr<TransformedSources> scale_sources = sources(scale);
+    lock_guard<mutex> lock(_mutex);
+    std::list<CachedSearchSpace> &cached_search_spaces = _search_spaces_pyr[scale];
+    for (auto cached = cached_search_spaces.begin(); cached != cached_search_spaces.end(); cached++) {
+        if (cached->target_origin != constraints.target_origin || cached->excluded.size() != constraints.excluded.size())
+            continue;
+        if (!constraints.excluded.empty() && norm(cached->excluded, constraints.excluded, cv::NORM_INF) != 0)
+            continue;
+        cached_search_spaces.splice(cached_search_spaces.begin(), cached_search_spaces, cached);
+        return cached_search_spaces.front().search_space;
+    }
+    // The validity bitmaps are only built on their first use, so this is cheap.
+    CachedSearchSpace cached;
+    cached.excluded = constraints.excluded.clone();
+    cached.target_origin = constraints.target_origin;
+    cached.search_space = make_shared<const SearchSpace>(constraints, *scale_sources, _patch_size);
+    cached_search_spaces.push_front(cached);
+    if (cached_search_spaces.size() > MAX_CACHED_SEARCH_SPACES)
+        cached_search_spaces.pop_back();
+    return cached_search_spaces.front().search_space;
+}
@@ -0,0 +1,84 @@
+#ifndef PATCHMATCH_PREPAREDSOURCE_H
+#define PATCHMATCH_PREPAREDSOURCE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "TransformedSources.h"
+#include "patch_match_provider/SearchSpace.h"
+
+/**
+ * The preprocessing of an image that does not depend on the hole: its pyramid and the transformed sources of every
+ * scale, plus the search spaces of the holes filled so far. Shared by hole fillings of the same image (e.g. the jobs
+ * of a server), so only the first one pays for it.
+ *
+ * Transformed sources are built on their first request. Search spaces are kept for the last few excluded regions of
+ * every scale, so repeated fills of the same hole also reuse the validity bitmaps. All methods are thread safe.
+ */
+class PreparedSource {
+
+public:
+    /**
+     * Search spaces kept per scale, the least recently used one is dropped. Default: 4.
+     */
+    static constexpr size_t MAX_CACHED_SEARCH_SPACES = 4;
+
+    /**
+     * @param img_pyr Gaussian pyramid of the image, usually in L*a*b* color space, see HoleFilling. Used without
+     * copying and never modified.
+     * @param patch_size the patch size of the hole fillings using it.
+     * @param transformations the transformations searched by the hole fillings using it.
+     * @param gradient_weight see TransformedSources, HoleFilling::gradientWeight() for hole fillings.
+     */
+    PreparedSource(const std::vector<cv::Mat> &img_pyr, int patch_size, const SourceTransformations &transformations,
+                   float gradient_weight);
+
+    /**
+     * Same as above, building the pyramid of 'img' with HoleFilling::nrScales() levels. 'img' is copied.
+     */
+    static std::shared_ptr<PreparedSource> create(const cv::Mat &img, int patch_size,
+                                                  const SourceTransformations &transformations,
+                                                  float gradient_weight);
+
+    const std::vector<cv::Mat> &imagePyramid() const { return _img_pyr; }
+    int patchSize() const { return _patch_size; }
+    const SourceTransformations &transformations() const { return _transformations; }
+    float gradientWeight() const { return _gradient_weight; }
+
+    /**
+     * The transformed sources of level 'scale' of the pyramid.
+     */
+    std::shared_ptr<TransformedSources> sources(int scale) const;
+
+    /**
+     * The transformed sources of the levels from 'scale' to the coarsest one, as taken by RandomizedPatchMatch.
+     */
+    std::vector<std::shared_ptr<TransformedSources>> sourcesFrom(int scale) const;
+
+    /**
+     * Search space for 'constraints' on the sources of 'scale'. Only the excluded pixels and the target origin are
+     * compared to find a cached one, so other constraints must not be set.
+     */
+    std::shared_ptr<const SearchSpace> searchSpace(int scale, const SearchConstraints &constraints) const;
+
+private:
+    struct CachedSearchSpace {
+        cv::Mat excluded;
+        cv::Point target_origin;
+        std::shared_ptr<const SearchSpace> search_space;
+    };
+
+    const std::vector<cv::Mat> _img_pyr;
+    const int _patch_size;
+    const SourceTransformations _transformations;
+    const float _gradient_weight;
+
+    mutable std::mutex _mutex;
+    mutable std::vector<std::shared_ptr<TransformedSources>> _sources_pyr;
+    // Most recently used first, per scale.
+    mutable std::vector<std::list<CachedSearchSpace>> _search_spaces_pyr;
+};
+
+#endif //PATCHMATCH_PREPAREDSOURCE_H
@@ -0,0 +1,103 @@
+#include "SourceLibrary.h"
+#include "util.h"
+#include <opencv2/highgui/highgui.hpp>
+
+using cv::imread;
+using cv::Mat;
+using pmutil::convert_for_computation;
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::pair;
+using std::shared_ptr;
+using std::string;
+
+constexpr size_t SourceLibrary::DEFAULT_MAX_BYTES;
+constexpr size_t SourceLibrary::MAX_CACHED_TILES;
+
+SourceLibrary::SourceLibrary(const SourceTransformations &transformations, int patch_size, float gradient_weight,
+                             size_t max_bytes) :
+        _transformations(transformations), _patch_size(patch_size), _gradient_weight(gradient_weight),
+        _max_bytes(max_bytes) { }
+
+unsigned int SourceLibrary::add(const Loader &loader, double prior) {
+    CV_Assert(prior >= 0);
+    lock_guard<mutex> lock(_mutex);
+    _images.push_back(Image{loader, prior});
+    return static_cast<unsigned int>(_images.size() - 1);
+}
+
+unsigned int SourceLibrary::addFile(const string &filename, double prior) {
+    return add([filename]() {
+        Mat img = imread(filename);
+        CV_Assert(img.data);
+        convert_for_computation(img, 1.f);
+        return img;
+    }, prior);
+}
+
+unsigned int SourceLibrary::size() const {
+    lock_guard<mutex> lock(_mutex);
+    return static_cast<unsigned int>(_images.size());
+}
+
+double SourceLibrary::prior(unsigned int idx) const {
+    lock_guard<mutex> lock(_mutex);
+    return _images[idx].prior;
+}
+
+shared_ptr<const TransformedSources> SourceLibrary::sources(unsigned int idx, int scale) {
+    const pair<unsigned int, int> key(idx, scale);
+    {
+        lock_guard<mutex> lock(_mutex);
+        auto cached = _cache.find(key);
+        if (cached != _cache.end()) {
+            _lru.splice(_lru.begin(), _lru, cached->second);
+            return cached->second->sources;
+        }
+    }
+
+    // Loading is slow, so it is done without holding the lock. Concurrent misses might load twice.
+    shared_ptr<const TransformedSources> loaded = load(idx, scale);
+
+    lock_guard<mutex> lock(_mutex);
+    _nr_loads++;
+    auto cached = _cache.find(key);
+    if (cached != _cache.end())
+        return cached->second->sources;
+    const size_t bytes = loaded->maxMemoryUsage();
+    _lru.push_front(CachedSources{key, loaded, bytes});
+    _cache[key] = _lru.begin();
+    _resident_bytes += bytes;
+    // Never drop the sources just loaded, even if they alone exceed the limit.
+    while (_resident_bytes > _max_bytes && _lru.size() > 1) {
+        _resident_bytes -= _lru.back().bytes;
+        _cache.erase(_lru.back().key);
+        _lru.pop_back();
+    }
+    return loaded;
+}
+
+size_t SourceLibrary::residentBytes() const {
+    lock_guard<mutex> lock(_mutex);
+    return _resident_bytes;
+}
+
+size_t SourceLibrary::nrLoads() const {
+    lock_guard<mutex> lock(_mutex);
+    return _nr_loads;
+}
+
+shared_ptr<const TransformedSources> SourceLibrary::load(unsigned int idx, int scale) const {
+    Loader loader;
+    {
+        lock_guard<mutex> lock(_mutex);
+        CV_Assert(idx < _images.size());
+        loader = _images[idx].loader;
+    }
+    Mat img = loader();
+    for (int i = 0; i < scale; i++)
+        pyrDown(img, img);
+    return make_shared<TransformedSources>(img, _transformations, _patch_size, 0, MAX_CACHED_TILES,
+                                           _gradient_weight);
+}
@@ -0,0 +1,99 @@
+#ifndef PATCHMATCH_SOURCELIBRARY_H
+#define PATCHMATCH_SOURCELIBRARY_H
+
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "TransformedSources.h"
+
+/**
+ * A library of additional source images (e.g. other photos of the same site) patches can be taken from.
+ *
+ * Images are only described by a loader and a prior up front. They are loaded and preprocessed (downscaled and
+ * wrapped into TransformedSources) on their first request, and kept in an LRU cache limited to 'max_bytes'. The least
+ * recently used images are dropped once the limit is exceeded, so the memory stays bounded no matter how many images
+ * the library has. Sources still in use when dropped stay valid until released.
+ * All methods are thread safe.
+ */
+class SourceLibrary {
+
+public:
+    typedef std::function<cv::Mat()> Loader;
+    static constexpr size_t DEFAULT_MAX_BYTES = 512 * 1024 * 1024;
+    // Library images are searched less intensively than the primary source, so their tile caches are kept small.
+    static constexpr size_t MAX_CACHED_TILES = 64;
+
+    /**
+     * @param transformations the transformations searched for every library image.
+     * @param patch_size the patch size used for matching.
+     * @param gradient_weight see TransformedSources.
+     * @param max_bytes the memory the cached sources may take, see TransformedSources::maxMemoryUsage.
+     */
+    SourceLibrary(const SourceTransformations &transformations, int patch_size, float gradient_weight = 0,
+                  size_t max_bytes = DEFAULT_MAX_BYTES);
+
+    /**
+     * Adds an image returned by 'loader' (float, same color space as the target) and returns its index. Random
+     * search samples the images in proportion to their prior.
+     */
+    unsigned int add(const Loader &loader, double prior = 1);
+
+    /**
+     * Adds the image file 'filename', converted as by pmutil::convert_for_computation.
+     */
+    unsigned int addFile(const std::string &filename, double prior = 1);
+
+    unsigned int size() const;
+    int patchSize() const { return _patch_size; }
+    float gradientWeight() const { return _gradient_weight; }
+    unsigned int nrTransformations() const { return _transformations.count(); }
+    double prior(unsigned int idx) const;
+
+    /**
+     * The transformed sources of image 'idx', downscaled 'scale' times (as by cv::buildPyramid). Loads the image if it
+     * is not cached.
+     */
+    std::shared_ptr<const TransformedSources> sources(unsigned int idx, int scale = 0);
+
+    /**
+     * Memory held by the cached sources (estimated by TransformedSources::maxMemoryUsage).
+     */
+    size_t residentBytes() const;
+
+    /**
+     * Number of times an image was loaded, i. e. cache misses.
+     */
+    size_t nrLoads() const;
+
+private:
+    struct Image {
+        Loader loader;
+        double prior;
+    };
+    struct CachedSources {
+        std::pair<unsigned int, int> key;
+        std::shared_ptr<const TransformedSources> sources;
+        size_t bytes;
+    };
+
+    const SourceTransformations _transformations;
+    const int _patch_size;
+    const float _gradient_weight;
+    const size_t _max_bytes;
+
+    mutable std::mutex _mutex;
+    std::vector<Image> _images;
+    std::list<CachedSources> _lru;
+    std::map<std::pair<unsigned int, int>, std::list<CachedSources>::iterator> _cache;
+    size_t _resident_bytes = 0;
+    size_t _nr_loads = 0;
+
+    std::shared_ptr<const TransformedSources> load(unsigned int idx, int scale) const;
+};
+
+#endif //PATCHMATCH_SOURCELIBRARY_H
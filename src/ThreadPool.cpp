@@ -0,0 +1,220 @@
+#include "ThreadPool.h"
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using cv::ParallelLoopBody;
+using cv::Range;
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::mutex;
+using std::unique_lock;
+using std::vector;
+
+namespace {
+    // Pool the calling thread works for, and its index in there. Null for threads outside of any pool.
+    thread_local ThreadPool *worker_pool = nullptr;
+    thread_local int worker_index = -1;
+    // Pool installed by the innermost ThreadPool::Scope.
+    thread_local ThreadPool *scoped_pool = nullptr;
+
+    int hardwareThreads() {
+        return max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    }
+
+    void pinToCore(int core) {
+#ifdef __linux__
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(core, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#else
+        (void) core;
+#endif
+    }
+
+    // Cores reserved by the pinned pools of the process, indexed by core.
+    mutex reserved_cores_mutex;
+    vector<bool> reserved_cores;
+
+    /**
+     * Reserves up to 'count' cores no other pool has reserved, lowest first so a pool's workers are close together.
+     * Fewer cores are returned if not enough are free.
+     */
+    vector<int> reserveCores(int count) {
+        vector<int> cores;
+#ifdef __linux__
+        lock_guard<mutex> lock(reserved_cores_mutex);
+        reserved_cores.resize(static_cast<size_t>(hardwareThreads()), false);
+        for (size_t core = 0; core < reserved_cores.size() && static_cast<int>(cores.size()) < count; core++) {
+            if (reserved_cores[core])
+                continue;
+            reserved_cores[core] = true;
+            cores.push_back(static_cast<int>(core));
+        }
+#else
+        (void) count;
+#endif
+        return cores;
+    }
+
+    void releaseCores(const vector<int> &cores) {
+        lock_guard<mutex> lock(reserved_cores_mutex);
+        for (int core: cores)
+            reserved_cores[static_cast<size_t>(core)] = false;
+    }
+}
+
+ThreadPool::ThreadPool(int nr_threads, bool pin_threads) : _nr_queued(0), _stopping(false) {
+    if (nr_threads <= 0)
+        nr_threads = hardwareThreads();
+    for (int i = 0; i < nr_threads; i++)
+        _queues.emplace_back(new Queue());
+    if (pin_threads)
+        _pinned_cores = reserveCores(nr_threads - 1);
+    for (int i = 0; i < nr_threads - 1; i++) {
+        const int core = i < static_cast<int>(_pinned_cores.size()) ? _pinned_cores[i] : -1;
+        _workers.emplace_back(&ThreadPool::work, this, i, core);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> lock(_sleep_mutex);
+        _stopping = true;
+    }
+    _wake.notify_all();
+    for (std::thread &worker: _workers)
+        worker.join();
+    releaseCores(_pinned_cores);
+}
+
+void ThreadPool::parallelFor(const Range &range, const ParallelLoopBody &body, int min_chunk) {
+    const int size = range.end - range.start;
+    if (size <= 0)
+        return;
+    const int nr_chunks = min(min(size, nrThreads() * CHUNKS_PER_THREAD), max(size / max(min_chunk, 1), 1));
+    if (nr_chunks == 1 || nrThreads() == 1) {
+        body(range);
+        return;
+    }
+
+    Loop loop;
+    loop.body = &body;
+    loop.pending = nr_chunks;
+    const size_t own = ownQueue();
+    {
+        lock_guard<mutex> lock(_queues[own]->mutex);
+        // The owner takes from the back, so the first chunks are run first.
+        for (int i = nr_chunks - 1; i >= 0; i--) {
+            const Range chunk_range(range.start + static_cast<int>(static_cast<long>(size) * i / nr_chunks),
+                                    range.start + static_cast<int>(static_cast<long>(size) * (i + 1) / nr_chunks));
+            _queues[own]->chunks.push_back(Chunk{&loop, chunk_range});
+        }
+    }
+    {
+        lock_guard<mutex> lock(_sleep_mutex);
+        _nr_queued += nr_chunks;
+    }
+    _wake.notify_all();
+
+    // Helps out until the loop is done. Chunks of other loops might be run meanwhile, which is what makes nesting work.
+    Chunk chunk;
+    while (loop.pending > 0) {
+        if (take(own, &chunk)) {
+            execute(chunk);
+            continue;
+        }
+        unique_lock<mutex> lock(_sleep_mutex);
+        _wake.wait(lock, [&] { return loop.pending == 0 || _nr_queued > 0; });
+    }
+    if (loop.error)
+        std::rethrow_exception(loop.error);
+}
+
+ThreadPool &ThreadPool::current() {
+    if (scoped_pool != nullptr)
+        return *scoped_pool;
+    if (worker_pool != nullptr)
+        return *worker_pool;
+    return global();
+}
+
+ThreadPool &ThreadPool::global() {
+    static ThreadPool pool;
+    return pool;
+}
+
+ThreadPool::Scope::Scope(ThreadPool &pool) : _previous(scoped_pool) {
+    scoped_pool = &pool;
+}
+
+ThreadPool::Scope::~Scope() {
+    scoped_pool = _previous;
+}
+
+void ThreadPool::work(int worker, int core) {
+    worker_pool = this;
+    worker_index = worker;
+    if (core >= 0)
+        pinToCore(core);
+    Chunk chunk;
+    while (true) {
+        if (take(static_cast<size_t>(worker), &chunk)) {
+            execute(chunk);
+            continue;
+        }
+        unique_lock<mutex> lock(_sleep_mutex);
+        _wake.wait(lock, [this] { return _stopping || _nr_queued > 0; });
+        if (_stopping)
+            return;
+    }
+}
+
+bool ThreadPool::take(size_t own, Chunk *chunk) {
+    {
+        lock_guard<mutex> lock(_queues[own]->mutex);
+        if (!_queues[own]->chunks.empty()) {
+            *chunk = _queues[own]->chunks.back();
+            _queues[own]->chunks.pop_back();
+            _nr_queued--;
+            return true;
+        }
+    }
+    // Steals starting with the next queue, so thieves spread over the victims.
+    for (size_t i = 1; i < _queues.size(); i++) {
+        Queue &victim = *_queues[(own + i) % _queues.size()];
+        lock_guard<mutex> lock(victim.mutex);
+        if (!victim.chunks.empty()) {
+            *chunk = victim.chunks.front();
+            victim.chunks.pop_front();
+            _nr_queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::execute(const Chunk &chunk) {
+    Loop &loop = *chunk.loop;
+    try {
+        (*loop.body)(chunk.range);
+    } catch (...) {
+        lock_guard<mutex> lock(loop.error_mutex);
+        if (!loop.error)
+            loop.error = std::current_exception();
+    }
+    // The caller might be waiting for the last chunk. Taking the lock avoids missing its wait.
+    lock_guard<mutex> lock(_sleep_mutex);
+    if (--loop.pending == 0)
+        _wake.notify_all();
+}
+
+size_t ThreadPool::ownQueue() const {
+    if (worker_pool == this)
+        return static_cast<size_t>(worker_index);
+    return _queues.size() - 1;
+}
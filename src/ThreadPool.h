@@ -0,0 +1,131 @@
+#ifndef PATCHMATCH_THREADPOOL_H
+#define PATCHMATCH_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+/**
+ * Work stealing scheduler all parallel loops of the project run on, instead of cv::parallel_for_.
+ *
+ * A loop is split into chunks, which are pushed to the queue of the calling worker (or a shared queue for threads not
+ * belonging to the pool). Workers take chunks from the back of their own queue and steal from the front of the others.
+ * The calling thread works on chunks until its loop is done, so loops can be nested without deadlocks and without
+ * starting more threads than the pool has: an inner loop's chunks are stolen by idle workers or run by the caller.
+ *
+ * Code finds its pool through ThreadPool::current(), which is the pool of the worker it runs on, the pool installed
+ * by the innermost ThreadPool::Scope of the thread, or the global pool. This way, e.g. every HoleFilling can run with
+ * its own number of threads and several jobs in one process do not oversubscribe the cores.
+ */
+class ThreadPool {
+
+public:
+    /**
+     * Target number of chunks per thread of a loop, so threads finishing early find chunks to steal. Default: 4.
+     */
+    static constexpr int CHUNKS_PER_THREAD = 4;
+
+    /**
+     * @param nr_threads number of threads working on a loop, including the calling thread. 0 for the number of
+     * hardware threads.
+     * @param pin_threads if true, every worker is pinned to a core of its own. Cores are reserved process wide, so
+     * pools existing at the same time get disjoint cores. Workers for which no free core is left are not pinned, see
+     * pinnedCores(). Only supported on Linux, ignored elsewhere.
+     */
+    explicit ThreadPool(int nr_threads = 0, bool pin_threads = false);
+
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    int nrThreads() const { return static_cast<int>(_workers.size()) + 1; }
+
+    /**
+     * The cores reserved for the workers of this pool, one per pinned worker. Empty if the pool is not pinned.
+     */
+    const std::vector<int> &pinnedCores() const { return _pinned_cores; }
+
+    /**
+     * Calls 'body' on disjoint subranges covering 'range', in parallel, and returns once all of them are done.
+     * Subranges have at least 'min_chunk' elements (except the last one), so cheap bodies are not split into chunks
+     * costing more to schedule than to run. Loops too small to split run on the calling thread.
+     * The first exception thrown by 'body' is rethrown after all chunks are done.
+     */
+    void parallelFor(const cv::Range &range, const cv::ParallelLoopBody &body, int min_chunk = 1);
+
+    /**
+     * The pool parallel loops of the calling thread should run on.
+     */
+    static ThreadPool &current();
+
+    /**
+     * Pool with one thread per hardware thread, used where no other pool is installed.
+     */
+    static ThreadPool &global();
+
+    /**
+     * Installs 'pool' as ThreadPool::current() of the calling thread for its lifetime.
+     */
+    class Scope {
+    public:
+        explicit Scope(ThreadPool &pool);
+        ~Scope();
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        ThreadPool *_previous;
+    };
+
+private:
+    struct Loop {
+        const cv::ParallelLoopBody *body;
+        std::atomic<int> pending;
+        std::mutex error_mutex;
+        std::exception_ptr error;
+    };
+
+    struct Chunk {
+        Loop *loop;
+        cv::Range range;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Chunk> chunks;
+    };
+
+    std::vector<std::thread> _workers;
+    // Released when the pool is destroyed, so later pools can use them.
+    std::vector<int> _pinned_cores;
+    // One queue per worker, the last one is shared by all threads outside of the pool.
+    std::vector<std::unique_ptr<Queue>> _queues;
+    std::atomic<int> _nr_queued;
+    std::atomic<bool> _stopping;
+    std::mutex _sleep_mutex;
+    std::condition_variable _wake;
+
+    /**
+     * @param core the core to pin the worker to, negative for none.
+     */
+    void work(int worker, int core);
+
+    /**
+     * Takes a chunk from the back of queue 'own' or steals one from the front of another queue.
+     */
+    bool take(size_t own, Chunk *chunk);
+
+    void execute(const Chunk &chunk);
+
+    size_t ownQueue() const;
+};
+
+#endif //PATCHMATCH_THREADPOOL_H
@@ -0,0 +1,344 @@
+#include "TransformedSources.h"
+#include "util.h"
+
+using cv::copyMakeBorder;
+using cv::getRotationMatrix2D;
+using cv::integral;
+using cv::invertAffineTransform;
+using cv::Mat;
+using cv::mixChannels;
+using cv::Point;
+using cv::Point2f;
+using cv::Rect;
+using cv::Size;
+using cv::warpAffine;
+using pmutil::interleaveWithGradients;
+using std::lock_guard;
+using std::max;
+using std::call_once;
+using std::min;
+using std::mutex;
+using std::shared_ptr;
+using std::vector;
+
+constexpr int TransformedSources::TILE_SIZE;
+constexpr size_t TransformedSources::DEFAULT_MAX_CACHED_TILES;
+
+namespace {
+    uint64_t tileKey(unsigned int idx, int tile_x, int tile_y) {
+        return (static_cast<uint64_t>(idx) << 40) | (static_cast<uint64_t>(tile_y) << 20) |
+                static_cast<uint64_t>(tile_x);
+    }
+}
+
+TransformedSources::TransformedSources(const Mat &source, float min_rotation, float max_rotation,
+                                       float rotation_step, int max_patch_size, int border,
+                                       size_t max_cached_tiles, float gradient_weight) :
+        TransformedSources(source, SourceTransformations::rotationsOnly(min_rotation, max_rotation, rotation_step),
+                           max_patch_size, border, max_cached_tiles, gradient_weight) { }
+
+TransformedSources::TransformedSources(const Mat &source, const SourceTransformations &transformations,
+                                       int max_patch_size, int border, size_t max_cached_tiles,
+                                       float gradient_weight) :
+        TransformedSources(source, createTransforms(source, transformations), max_patch_size, border,
+                           max_cached_tiles, gradient_weight) { }
+
+TransformedSources::TransformedSources(const Mat &source, const vector<Transform> &transforms, int max_patch_size,
+                                       int border, size_t max_cached_tiles, float gradient_weight) :
+        _source(source), _transforms(transforms), _max_patch_size(max_patch_size),
+        _max_cached_tiles(max_cached_tiles), _image_size(source.cols + border, source.rows + border),
+        _gradient_weight(gradient_weight) {
+    if (border > 0)
+        copyMakeBorder(source, _bordered_source, 0, border, 0, border, cv::BORDER_REFLECT);
+    else
+        _bordered_source = source;
+    if (_gradient_weight > 0)
+        interleaveWithGradients(_bordered_source, _gradient_weight, _bordered_features);
+    else
+        _bordered_features = _bordered_source;
+}
+
+PatchMoments PatchMoments::fromIntegrals(const Mat &sum, const Mat &sqsum, const Rect &roi) {
+    PatchMoments moments;
+    const int cn = min(sum.channels(), 4);
+    const int left = roi.x * sum.channels();
+    const int right = (roi.x + roi.width) * sum.channels();
+    const double *sum_top = sum.ptr<double>(roi.y);
+    const double *sum_bottom = sum.ptr<double>(roi.y + roi.height);
+    const double *sqsum_top = sqsum.ptr<double>(roi.y);
+    const double *sqsum_bottom = sqsum.ptr<double>(roi.y + roi.height);
+    for (int c = 0; c < cn; c++) {
+        moments.sum[c] = sum_bottom[right + c] - sum_bottom[left + c] - sum_top[right + c] + sum_top[left + c];
+        moments.sqsum[c] = sqsum_bottom[right + c] - sqsum_bottom[left + c] -
+                           sqsum_top[right + c] + sqsum_top[left + c];
+    }
+    moments.count = roi.area();
+    return moments;
+}
+
+PatchMoments PatchMoments::fromPatch(const Mat &patch, int channels) {
+    PatchMoments moments;
+    const int cn = patch.channels();
+    const int used_channels = min(min(cn, channels), 4);
+    for (int y = 0; y < patch.rows; y++) {
+        const float *p = patch.ptr<const float>(y);
+        for (int x = 0; x < patch.cols; x++) {
+            for (int c = 0; c < used_channels; c++) {
+                const double value = p[x * cn + c];
+                moments.sum[c] += value;
+                moments.sqsum[c] += value * value;
+            }
+        }
+    }
+    moments.count = patch.rows * patch.cols;
+    return moments;
+}
+
+SourceTransformations SourceTransformations::rotationsOnly(float min_rotation, float max_rotation,
+                                                           float rotation_step) {
+    SourceTransformations transformations;
+    transformations.min_rotation = min_rotation;
+    transformations.max_rotation = max_rotation;
+    transformations.rotation_step = rotation_step;
+    return transformations;
+}
+
+vector<TransformParameters> SourceTransformations::enumerate() const {
+    vector<TransformParameters> parameters;
+    for (int mirrored = 0; mirrored <= (mirror ? 1 : 0); mirrored++) {
+        for (float scale = min_scale; scale <= max_scale + 1e-4f; scale += scale_step) {
+            for (float rot = min_rotation; rot <= max_rotation; rot += rotation_step) {
+                TransformParameters transform;
+                transform.rotation = rot;
+                transform.scale = scale;
+                transform.mirrored = mirrored != 0;
+                parameters.push_back(transform);
+                if (rotation_step <= 0)
+                    break;
+            }
+            if (scale_step <= 0)
+                break;
+        }
+    }
+    return parameters;
+}
+
+vector<TransformedSources::Transform> TransformedSources::createTransforms(
+        const Mat &source, const SourceTransformations &transformations) {
+    const Point2f center(source.cols / 2.f, source.rows / 2.f);
+    vector<Transform> transforms;
+    for (const TransformParameters &parameters: transformations.enumerate()) {
+        Transform transform;
+        transform.rotation = parameters.rotation;
+        transform.scale = parameters.scale;
+        transform.mirrored = parameters.mirrored;
+        transform.matrix = getRotationMatrix2D(center, parameters.rotation, parameters.scale);
+        if (transform.mirrored) {
+            // Flip horizontally before rotating, i. e. substitute x by cols - 1 - x.
+            Mat &m = transform.matrix;
+            for (int row = 0; row < 2; row++) {
+                m.at<double>(row, 2) += m.at<double>(row, 0) * (source.cols - 1);
+                m.at<double>(row, 0) = -m.at<double>(row, 0);
+            }
+        }
+        invertAffineTransform(transform.matrix, transform.inverse);
+        // Parameters are accumulated in floating point, so they might not be hit exactly.
+        transform.identity = std::abs(parameters.rotation) < 1e-4f && std::abs(parameters.scale - 1) < 1e-4f &&
+                             !transform.mirrored;
+        transforms.push_back(transform);
+    }
+    return transforms;
+}
+
+Mat TransformedSources::patch(unsigned int idx, const Rect &roi, PatchMoments *moments) const {
+    if (roi.x < 0 || roi.y < 0 || roi.x + roi.width > _image_size.width || roi.y + roi.height > _image_size.height)
+        return Mat();
+    if (moments != nullptr)
+        _moments_requested = true;
+    if (_transforms[idx].identity) {
+        if (moments != nullptr) {
+            call_once(_source_integrals_once, [this] {
+                integral(_bordered_source, _source_sum, _source_sqsum, CV_64F, CV_64F);
+            });
+            *moments = PatchMoments::fromIntegrals(_source_sum, _source_sqsum, roi);
+        }
+        return _bordered_features(roi);
+    }
+
+    Mat patch;
+    const int tile_x = roi.x / TILE_SIZE;
+    const int tile_y = roi.y / TILE_SIZE;
+    CachedTile cached_tile;
+    if (roi.width <= _max_patch_size && roi.height <= _max_patch_size)
+        cached_tile = tile(idx, tile_x, tile_y);
+    if (cached_tile.pixels.empty()) {
+        patch = warpRegion(idx, roi);
+        if (moments != nullptr)
+            *moments = PatchMoments::fromPatch(patch, colorChannels());
+        return patch;
+    }
+
+    const Rect roi_in_tile(roi.x - tile_x * TILE_SIZE, roi.y - tile_y * TILE_SIZE, roi.width, roi.height);
+    patch = cached_tile.pixels(roi_in_tile);
+    if (moments != nullptr) {
+        // Tiles cached before the first request for moments have no integral images.
+        if (cached_tile.sum.empty())
+            *moments = PatchMoments::fromPatch(patch, colorChannels());
+        else
+            *moments = PatchMoments::fromIntegrals(cached_tile.sum, cached_tile.sqsum, roi_in_tile);
+    }
+    return patch;
+}
+
+void TransformedSources::prefetch(unsigned int idx, const Rect &roi) const {
+#if defined(__GNUC__)
+    constexpr int CACHE_LINE_BYTES = 64;
+    if (!_transforms[idx].identity || roi.x < 0 || roi.y < 0 || roi.x + roi.width > _image_size.width ||
+            roi.y + roi.height > _image_size.height)
+        return;
+    const size_t row_bytes = roi.width * _bordered_features.elemSize();
+    for (int y = roi.y; y < roi.y + roi.height; y++) {
+        const char *row = _bordered_features.ptr<char>(y) + roi.x * _bordered_features.elemSize();
+        // Rows do not start at line boundaries, so the steps may miss the line of the last byte.
+        for (size_t offset = 0; offset < row_bytes; offset += CACHE_LINE_BYTES)
+            __builtin_prefetch(row + offset);
+        __builtin_prefetch(row + row_bytes - 1);
+    }
+#endif
+}
+
+TransformedSources::CachedTile TransformedSources::tile(unsigned int idx, int tile_x, int tile_y) const {
+    const uint64_t key = tileKey(idx, tile_x, tile_y);
+    {
+        lock_guard<mutex> lock(_cache_mutex);
+        auto cached = _cache.find(key);
+        if (cached != _cache.end()) {
+            // Mark as most recently used.
+            _lru.splice(_lru.begin(), _lru, cached->second);
+            return *cached->second;
+        }
+        // Only cache tiles that are requested more than once, random search would otherwise flush the cache.
+        auto requested = _requested_once.find(key);
+        if (requested == _requested_once.end()) {
+            if (_requested_once.size() > 4 * _max_cached_tiles)
+                _requested_once.clear();
+            _requested_once[key] = 1;
+            return CachedTile();
+        }
+        _requested_once.erase(requested);
+    }
+
+    // Warp outside of the lock, so other threads can keep using the cache.
+    Rect tile_rect = Rect(tile_x * TILE_SIZE, tile_y * TILE_SIZE,
+                          TILE_SIZE + _max_patch_size - 1, TILE_SIZE + _max_patch_size - 1) &
+                     Rect(Point(0, 0), _image_size);
+    CachedTile warped;
+    warped.key = key;
+    warped.pixels = warpRegion(idx, tile_rect);
+    if (_moments_requested)
+        integral(colors(warped.pixels), warped.sum, warped.sqsum, CV_64F, CV_64F);
+
+    lock_guard<mutex> lock(_cache_mutex);
+    if (_cache.find(key) == _cache.end()) {
+        _lru.push_front(warped);
+        _cache[key] = _lru.begin();
+        while (_lru.size() > _max_cached_tiles) {
+            _cache.erase(_lru.back().key);
+            _lru.pop_back();
+        }
+    }
+    return warped;
+}
+
+Mat TransformedSources::warpRegion(unsigned int idx, const Rect &roi) const {
+    if (_gradient_weight <= 0)
+        return warpColorRegion(idx, roi);
+    if (_transforms[idx].identity)
+        return _bordered_features(roi).clone();
+
+    // Gradients are computed on the transformed colors, which needs one pixel of context around roi. Outside of the
+    // image, the context is mirrored like the border handling of the untransformed source.
+    const Rect context = Rect(roi.x - 1, roi.y - 1, roi.width + 2, roi.height + 2) & Rect(Point(0, 0), _image_size);
+    Mat padded;
+    copyMakeBorder(warpColorRegion(idx, context), padded, context.y - roi.y + 1, roi.br().y + 1 - context.br().y,
+                   context.x - roi.x + 1, roi.br().x + 1 - context.br().x, cv::BORDER_REFLECT_101);
+    Mat features;
+    interleaveWithGradients(padded, _gradient_weight, features);
+    return features(Rect(1, 1, roi.width, roi.height));
+}
+
+Mat TransformedSources::transformedMask(unsigned int idx, const Mat &mask, uchar outside_value) const {
+    CV_Assert(mask.size() == _source.size() && mask.type() == CV_8U);
+    Mat warped;
+    if (_transforms[idx].identity)
+        warped = mask;
+    else
+        warpAffine(mask, warped, _transforms[idx].matrix, _source.size(), cv::INTER_LINEAR, cv::BORDER_CONSTANT,
+                   cv::Scalar::all(outside_value));
+    // The border is a reflection, as for the transformed images.
+    Mat bordered;
+    copyMakeBorder(warped, bordered, 0, _image_size.height - _source.rows, 0, _image_size.width - _source.cols,
+                   cv::BORDER_REFLECT);
+    return bordered;
+}
+
+Mat TransformedSources::warpColorRegion(unsigned int idx, const Rect &roi) const {
+    if (_transforms[idx].identity)
+        return _bordered_source(roi).clone();
+
+    // The border is a reflection of the transformed image, so warp enough context to the left and top of it.
+    const int source_right = min(roi.x + roi.width, _source.cols);
+    const int source_bottom = min(roi.y + roi.height, _source.rows);
+    const int pad_right = roi.x + roi.width - source_right;
+    const int pad_bottom = roi.y + roi.height - source_bottom;
+    Rect warped_rect(Point(max(0, min(roi.x, _source.cols) - pad_right),
+                           max(0, min(roi.y, _source.rows) - pad_bottom)),
+                     Point(source_right, source_bottom));
+
+    // Shift the transformation, so the top left of warped_rect ends up at the origin.
+    Mat matrix = _transforms[idx].matrix.clone();
+    matrix.at<double>(0, 2) -= warped_rect.x;
+    matrix.at<double>(1, 2) -= warped_rect.y;
+    Mat warped;
+    warpAffine(_source, warped, matrix, warped_rect.size(), cv::INTER_LINEAR);
+    if (pad_right > 0 || pad_bottom > 0)
+        copyMakeBorder(warped, warped, 0, pad_bottom, 0, pad_right, cv::BORDER_REFLECT);
+    return warped(Rect(roi.tl() - warped_rect.tl(), roi.size()));
+}
+
+Mat TransformedSources::transformed(unsigned int idx) const {
+    return warpRegion(idx, Rect(Point(0, 0), _image_size)).clone();
+}
+
+Mat TransformedSources::colors(const Mat &features) const {
+    if (_gradient_weight <= 0)
+        return features;
+    Mat colors(features.size(), _source.type());
+    vector<int> from_to;
+    for (int c = 0; c < _source.channels(); c++) {
+        from_to.push_back(c);
+        from_to.push_back(c);
+    }
+    mixChannels(&features, 1, &colors, 1, from_to.data(), _source.channels());
+    return colors;
+}
+
+shared_ptr<TransformedSources> TransformedSources::withBorder(int border) const {
+    return shared_ptr<TransformedSources>(new TransformedSources(_source, _transforms, _max_patch_size, border,
+                                                                 _max_cached_tiles, _gradient_weight));
+}
+
+size_t TransformedSources::cachedTileCount() const {
+    lock_guard<mutex> lock(_cache_mutex);
+    return _lru.size();
+}
+
+size_t TransformedSources::maxMemoryUsage() const {
+    size_t bytes = _source.total() * _source.elemSize() + _bordered_source.total() * _bordered_source.elemSize();
+    if (_bordered_features.data != _bordered_source.data)
+        bytes += _bordered_features.total() * _bordered_features.elemSize();
+    // Every tile holds its features and, once moments are requested, two double integral images of its colors.
+    const size_t tile_pixels = static_cast<size_t>((TILE_SIZE + _max_patch_size) * (TILE_SIZE + _max_patch_size));
+    const size_t tile_bytes = tile_pixels * (patchChannels() * sizeof(float) + 2 * colorChannels() * sizeof(double));
+    return bytes + _max_cached_tiles * tile_bytes;
+}
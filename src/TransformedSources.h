@@ -0,0 +1,245 @@
+#ifndef PATCHMATCH_TRANSFORMEDSOURCES_H
+#define PATCHMATCH_TRANSFORMEDSOURCES_H
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+
+/**
+ * Describes which transformations of the source are searched additionally to translation. Every combination of
+ * rotation, scale and (if enabled) horizontal reflection is one transformation.
+ */
+/**
+ * Parameters of one transformation of a source: mirrored horizontally first if 'mirrored', then rotated by 'rotation'
+ * degrees and scaled by 'scale' around the center.
+ */
+struct TransformParameters {
+    float rotation, scale;
+    bool mirrored;
+};
+
+struct SourceTransformations {
+    float min_rotation = -10, max_rotation = 10, rotation_step = 5;
+    float min_scale = 1, max_scale = 1, scale_step = 0.25f;
+    bool mirror = false;
+
+    static SourceTransformations rotationsOnly(float min_rotation, float max_rotation, float rotation_step);
+
+    /**
+     * All transformations, in the order of the indices of TransformedSources created with these.
+     */
+    std::vector<TransformParameters> enumerate() const;
+
+    /**
+     * Number of transformations, i. e. TransformedSources::size() of sources created with these.
+     */
+    unsigned int count() const { return static_cast<unsigned int>(enumerate().size()); }
+};
+
+/**
+ * Sum and sum of squares over all pixels of a patch, separately for every channel (at most four).
+ */
+struct PatchMoments {
+    cv::Scalar sum, sqsum;
+    int count = 0;
+
+    /**
+     * Moments of the region 'roi' of the image whose integral images (as computed by cv::integral with depth CV_64F)
+     * are 'sum' and 'sqsum'. Constant time, independent of the size of roi.
+     */
+    static PatchMoments fromIntegrals(const cv::Mat &sum, const cv::Mat &sqsum, const cv::Rect &roi);
+
+    /**
+     * Moments computed directly from the first 'channels' channels of a float patch.
+     */
+    static PatchMoments fromPatch(const cv::Mat &patch, int channels = 4);
+};
+
+/**
+ * Lazily provides patches of transformed (rotated, scaled, mirrored) versions of a source image.
+ *
+ * Instead of warping the full source for every transformation up front, patches are sampled on demand. Regions that
+ * are requested repeatedly (e.g. by propagation) are warped as tiles and kept in a bounded LRU cache, one-off requests
+ * (e.g. by random search) are warped directly. Tiles overlap by the size of the largest expected patch, so a patch can
+ * always be served as a view into a single tile. The untransformed source is served directly without any warping.
+ *
+ * If a gradient weight is given, patches are served as interleaved feature buffers instead: every pixel holds its
+ * colors, followed by the weighted x and y gradients of the transformed image (e.g. 9 channels for Lab). The SSD of two
+ * such buffers is the gradient weighted patch distance, computed in a single pass.
+ */
+class TransformedSources {
+
+public:
+    static constexpr int TILE_SIZE = 64;
+    static constexpr size_t DEFAULT_MAX_CACHED_TILES = 1024;
+
+    /**
+     * @param source the image to be rotated.
+     * @param min_rotation the minimal rotation in degrees.
+     * @param max_rotation the maximal rotation in degrees.
+     * @param rotation_step rotations are min_rotation + i * rotation_step, until max_rotation is exceeded.
+     * @param max_patch_size the size of the largest patch that will usually be requested. Larger patches are still
+     * served, but never cached.
+     * @param border number of pixels added at the right and bottom of every rotated image by reflection.
+     * @param max_cached_tiles the maximum number of tiles held in the cache over all rotations.
+     * @param gradient_weight if larger than 0, patches contain gradients weighted by this factor after the colors.
+     */
+    TransformedSources(const cv::Mat &source, float min_rotation, float max_rotation, float rotation_step,
+                       int max_patch_size, int border = 0, size_t max_cached_tiles = DEFAULT_MAX_CACHED_TILES,
+                       float gradient_weight = 0);
+
+    /**
+     * Same as above, but with all transformations described by 'transformations'.
+     */
+    TransformedSources(const cv::Mat &source, const SourceTransformations &transformations, int max_patch_size,
+                       int border = 0, size_t max_cached_tiles = DEFAULT_MAX_CACHED_TILES,
+                       float gradient_weight = 0);
+
+    /**
+     * Number of transformed versions of the source.
+     */
+    unsigned int size() const { return static_cast<unsigned int>(_transforms.size()); }
+
+    float rotation(unsigned int idx) const { return _transforms[idx].rotation; }
+    float scale(unsigned int idx) const { return _transforms[idx].scale; }
+    bool isMirrored(unsigned int idx) const { return _transforms[idx].mirrored; }
+    bool isIdentity(unsigned int idx) const { return _transforms[idx].identity; }
+
+    /**
+     * Position in the untransformed source of the point 'transformed' of the transformed image with index 'idx'.
+     */
+    cv::Point2f sourcePosition(unsigned int idx, const cv::Point2f &transformed) const {
+        const double *m = _transforms[idx].inverse.ptr<double>(0);
+        return cv::Point2f(static_cast<float>(m[0] * transformed.x + m[1] * transformed.y + m[2]),
+                           static_cast<float>(m[3] * transformed.x + m[4] * transformed.y + m[5]));
+    }
+
+    /**
+     * Size of every transformed image, including the border.
+     */
+    cv::Size imageSize() const { return _image_size; }
+
+    /**
+     * Size of the untransformed source, without the border.
+     */
+    cv::Size sourceSize() const { return _source.size(); }
+
+    int type() const { return _source.type(); }
+
+    /**
+     * Number of color channels, patches start with these at every pixel.
+     */
+    int colorChannels() const { return _source.channels(); }
+
+    /**
+     * Number of channels of the returned patches, colors plus gradients if a gradient weight is set.
+     */
+    int patchChannels() const { return _gradient_weight > 0 ? 3 * _source.channels() : _source.channels(); }
+
+    /**
+     * Returns the region 'roi' of the transformed image with index 'idx'. The returned matrix might share data with
+     * the cache and must not be modified. Returns an empty matrix if roi is not inside the image.
+     * If 'moments' is given, it is set to the moments of the colors of the returned patch. These are looked up in
+     * integral images of
+     * the untransformed source or the cached tile where possible, so they cost constant time per patch.
+     */
+    cv::Mat patch(unsigned int idx, const cv::Rect &roi, PatchMoments *moments = nullptr) const;
+
+    /**
+     * Hints the CPU to load the region 'roi' of the transformed image with index 'idx' into the cache, so a later
+     * patch() of it does not wait for memory. Only done for the identity transform, whose pixels are at a known
+     * address; finding a cached tile costs about as much as the miss. Does nothing for regions not inside the image.
+     */
+    void prefetch(unsigned int idx, const cv::Rect &roi) const;
+
+    /**
+     * Warps the CV_8U 'mask' (of the size of the source) like the image with index 'idx', including the border.
+     * Pixels of the transformed image outside of the source take 'outside_value'. Interpolation is linear as for the
+     * images, so a transformed pixel is non-zero if any mask pixel (or the outside) it depends on is.
+     */
+    cv::Mat transformedMask(unsigned int idx, const cv::Mat &mask, uchar outside_value) const;
+
+    /**
+     * Warps the complete image with index 'idx'. This is expensive and mainly meant for debugging.
+     */
+    cv::Mat transformed(unsigned int idx) const;
+
+    /**
+     * Returns new sources with the same transformations and gradient weight but a different border and an empty cache.
+     */
+    std::shared_ptr<TransformedSources> withBorder(int border) const;
+
+    size_t cachedTileCount() const;
+
+    /**
+     * Upper bound of the memory in bytes held by these sources, i. e. the images plus a full tile cache.
+     */
+    size_t maxMemoryUsage() const;
+
+private:
+    struct Transform {
+        float rotation, scale;
+        bool mirrored;
+        cv::Mat matrix;
+        // Maps the transformed image back to the source.
+        cv::Mat inverse;
+        bool identity;
+    };
+    struct CachedTile {
+        uint64_t key;
+        cv::Mat pixels;
+        // Integral images of the colors of pixels, only computed once moments have been requested.
+        cv::Mat sum, sqsum;
+    };
+
+    const cv::Mat _source;
+    // Source with border applied, used for serving the identity transform without warping.
+    cv::Mat _bordered_source;
+    // Same as _bordered_source, but interleaved with its gradients if a gradient weight is set.
+    cv::Mat _bordered_features;
+    std::vector<Transform> _transforms;
+    const int _max_patch_size;
+    const size_t _max_cached_tiles;
+    const cv::Size _image_size;
+    const float _gradient_weight;
+
+    mutable std::mutex _cache_mutex;
+    mutable std::list<CachedTile> _lru;
+    mutable std::unordered_map<uint64_t, std::list<CachedTile>::iterator> _cache;
+    // Tiles are only admitted to the cache on their second request.
+    mutable std::unordered_map<uint64_t, int> _requested_once;
+
+    // Integral images of the bordered source, computed on the first request for moments.
+    mutable std::once_flag _source_integrals_once;
+    mutable cv::Mat _source_sum, _source_sqsum;
+    mutable std::atomic<bool> _moments_requested{false};
+
+    TransformedSources(const cv::Mat &source, const std::vector<Transform> &transforms, int max_patch_size,
+                       int border, size_t max_cached_tiles, float gradient_weight);
+
+    static std::vector<Transform> createTransforms(const cv::Mat &source,
+                                                   const SourceTransformations &transformations);
+
+    /**
+     * Warps the given region of the transformed image with index 'idx', roi must be inside the image.
+     * Returns the interleaved features of the region if a gradient weight is set.
+     */
+    cv::Mat warpRegion(unsigned int idx, const cv::Rect &roi) const;
+    cv::Mat warpColorRegion(unsigned int idx, const cv::Rect &roi) const;
+
+    /**
+     * The color channels of a patch or tile returned by warpRegion.
+     */
+    cv::Mat colors(const cv::Mat &features) const;
+    /**
+     * Returns the cached tile, or a tile with empty pixels if it is not (yet) cached.
+     */
+    CachedTile tile(unsigned int idx, int tile_x, int tile_y) const;
+};
+
+#endif //PATCHMATCH_TRANSFORMEDSOURCES_H
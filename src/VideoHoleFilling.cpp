@@ -0,0 +1,157 @@
+#include "VideoHoleFilling.h"
+#include "BoundedQueue.h"
+#include "LabPyramid.h"
+#include <exception>
+#include <thread>
+
+using cv::countNonZero;
+using cv::createHanningWindow;
+using cv::getTickCount;
+using cv::getTickFrequency;
+using cv::Mat;
+using cv::mean;
+using cv::norm;
+using cv::phaseCorrelate;
+using cv::Point;
+using cv::Point2d;
+using pmutil::buildLabPyramid;
+using std::exception_ptr;
+using std::pair;
+using std::thread;
+
+/**
+ * Number of EM steps per scale for frames seeded with the solution of the previous frame. Default: 5.
+ */
+constexpr int SEEDED_EM_STEPS = 5;
+/**
+ * Frames none of whose pixels differs by more than this (in 8 bit levels, in any channel) from the previous frame, and
+ * that have the same hole, reuse the preprocessing of the previous frame and are treated as not moving. A maximum, not
+ * a mean, so local changes (e.g. a small moving object) are never replaced by stale content. Default: 1.
+ */
+constexpr double REUSE_MAX_DIFFERENCE = 1;
+
+VideoHoleFilling::VideoHoleFilling(int patch_size, const SourceTransformations &transformations,
+                                   int frames_in_flight) :
+        _patch_size(patch_size), _transformations(transformations), _frames_in_flight(frames_in_flight) {
+    CV_Assert(frames_in_flight > 0);
+}
+
+Mat VideoHoleFilling::fillNext(const Mat &frame, const Mat &hole) {
+    const double tic = static_cast<double>(getTickCount());
+    Mat filled = fill(prepare(frame, hole));
+    _statistics.seconds += (getTickCount() - tic) / getTickFrequency();
+    return filled;
+}
+
+void VideoHoleFilling::run(const std::function<bool(Mat &, Mat &)> &next_frame,
+                           const std::function<void(int, const Mat &)> &consume) {
+    const double tic = static_cast<double>(getTickCount());
+    BoundedQueue<PreparedFrame> prepared(static_cast<size_t>(_frames_in_flight));
+    BoundedQueue<pair<int, Mat>> filled(static_cast<size_t>(_frames_in_flight));
+    exception_ptr reader_error, writer_error, filler_error;
+
+    thread reader([&] {
+        try {
+            Mat frame, hole;
+            while (next_frame(frame, hole)) {
+                if (!prepared.push(prepare(frame, hole)))
+                    break;
+            }
+        } catch (...) {
+            reader_error = std::current_exception();
+        }
+        prepared.close();
+    });
+    thread writer([&] {
+        try {
+            pair<int, Mat> result;
+            while (filled.pop(&result))
+                consume(result.first, result.second);
+        } catch (...) {
+            writer_error = std::current_exception();
+        }
+        // Makes the hole filling stop, too.
+        filled.close();
+    });
+
+    try {
+        PreparedFrame current;
+        while (prepared.pop(&current)) {
+            if (!filled.push(pair<int, Mat>(current.index, fill(current))))
+                break;
+        }
+    } catch (...) {
+        filler_error = std::current_exception();
+    }
+    // Stops the reader if the hole filling stopped early.
+    prepared.close();
+    filled.close();
+    reader.join();
+    writer.join();
+    _statistics.seconds += (getTickCount() - tic) / getTickFrequency();
+
+    for (const exception_ptr &error: {filler_error, reader_error, writer_error}) {
+        if (error)
+            std::rethrow_exception(error);
+    }
+}
+
+VideoHoleFilling::PreparedFrame VideoHoleFilling::prepare(const Mat &frame, const Mat &hole) {
+    PreparedFrame prepared;
+    prepared.index = _nr_prepared++;
+    prepared.hole = hole.clone();
+    prepared.motion = Point(0, 0);
+
+    const bool comparable = !_previous_frame.empty() && _previous_frame.size() == frame.size() &&
+                            _previous_frame.type() == frame.type();
+    if (comparable && countNonZero(hole != _previous_hole) == 0 &&
+            norm(frame, _previous_frame, cv::NORM_INF) <= REUSE_MAX_DIFFERENCE) {
+        // Keeps comparing against the frame that was preprocessed, so slow drifts are not missed. HoleFilling never
+        // modifies the pyramid it is given, so it can be shared.
+        prepared.lab_pyr = _previous_lab_pyr;
+        _statistics.reused_preprocessing++;
+        return prepared;
+    }
+
+    // The pyramid is built here already, so reading and preprocessing overlaps with the hole filling in run().
+    buildLabPyramid(frame, prepared.lab_pyr, std::max(HoleFilling::nrScales(frame.size(), _patch_size), 0));
+
+    // Global motion by phase correlation of the lightness. The hole is set to the mean, so it does not dominate.
+    Mat gray;
+    cv::extractChannel(prepared.lab_pyr[0], gray, 0);
+    gray = gray.clone();
+    Mat inverted_hole = hole == 0;
+    gray.setTo(mean(gray, inverted_hole), hole);
+    if (comparable && !_previous_gray.empty()) {
+        Mat window;
+        createHanningWindow(window, gray.size(), CV_32F);
+        const Point2d shift = phaseCorrelate(_previous_gray, gray, window);
+        prepared.motion = Point(cvRound(shift.x), cvRound(shift.y));
+    }
+
+    _previous_frame = frame.clone();
+    _previous_gray = gray;
+    _previous_lab_pyr = prepared.lab_pyr;
+    _previous_hole = prepared.hole;
+    return prepared;
+}
+
+Mat VideoHoleFilling::fill(const PreparedFrame &prepared) {
+    _statistics.frames++;
+    if (countNonZero(prepared.hole) == 0) {
+        // Nothing to fill, the next frame can not be seeded either.
+        _previous.reset();
+        return prepared.lab_pyr[0].clone();
+    }
+
+    std::unique_ptr<HoleFilling> hole_filling(new HoleFilling(prepared.lab_pyr, prepared.hole, _patch_size,
+                                                              _transformations));
+    if (_previous) {
+        hole_filling->seedFrom(*_previous, prepared.motion);
+        hole_filling->setEmSteps(SEEDED_EM_STEPS);
+        _statistics.seeded++;
+    }
+    Mat filled = hole_filling->run();
+    _previous = std::move(hole_filling);
+    return filled;
+}
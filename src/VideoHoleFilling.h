@@ -0,0 +1,86 @@
+#ifndef PATCHMATCH_VIDEOHOLEFILLING_H
+#define PATCHMATCH_VIDEOHOLEFILLING_H
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "HoleFilling.h"
+
+struct VideoStatistics {
+    int frames = 0;
+    // Frames whose preprocessing was taken over from the previous frame, as no pixel changed noticeably.
+    int reused_preprocessing = 0;
+    // Frames whose nearest neighbor fields were seeded with the ones of the previous frame.
+    int seeded = 0;
+    double seconds = 0;
+
+    double framesPerSecond() const { return seconds > 0 ? frames / seconds : 0; }
+};
+
+/**
+ * Fills the hole of every frame of a video. Consecutive frames are assumed to be similar: The nearest neighbor fields
+ * of a frame are seeded with the ones of the previous frame, shifted by the global motion between both frames (found
+ * by phase correlation). Seeded frames need fewer EM steps. Frames none of whose pixels noticeably differ from the
+ * previous frame reuse its preprocessing, i. e. its L*a*b* pyramid.
+ */
+class VideoHoleFilling {
+public:
+    static constexpr int DEFAULT_FRAMES_IN_FLIGHT = 4;
+
+    /**
+     * @param patch_size see HoleFilling.
+     * @param transformations see HoleFilling.
+     * @param frames_in_flight maximum number of frames buffered between the stages of run().
+     */
+    VideoHoleFilling(int patch_size, const SourceTransformations &transformations = SourceTransformations(),
+                     int frames_in_flight = DEFAULT_FRAMES_IN_FLIGHT);
+
+    /**
+     * Fills the hole of the next frame.
+     * @param frame the frame as read, BGR with 8 bit per channel.
+     * @param hole a bitmask of the hole, non-zero where the hole is (one channel uint8).
+     * @return the filled frame in L*a*b* color space.
+     */
+    cv::Mat fillNext(const cv::Mat &frame, const cv::Mat &hole);
+
+    /**
+     * Streams a whole video through a pipeline of three stages running concurrently: Reading and preprocessing,
+     * hole filling and consuming the results. At most frames_in_flight frames are buffered between two stages.
+     * @param next_frame called on a separate thread to get the next frame and hole (as for fillNext), returns false
+     * at the end of the video.
+     * @param consume called on a separate thread with the index and the filled frame (L*a*b*), in order.
+     */
+    void run(const std::function<bool(cv::Mat &, cv::Mat &)> &next_frame,
+             const std::function<void(int, const cv::Mat &)> &consume);
+
+    const VideoStatistics &statistics() const { return _statistics; }
+
+private:
+    struct PreparedFrame {
+        int index;
+        // Level 0 is the frame in L*a*b*.
+        std::vector<cv::Mat> lab_pyr;
+        cv::Mat hole;
+        // Translation of the content since the previous frame.
+        cv::Point motion;
+    };
+
+    const int _patch_size;
+    const SourceTransformations _transformations;
+    const int _frames_in_flight;
+    VideoStatistics _statistics;
+
+    // State of the preprocessing stage.
+    int _nr_prepared = 0;
+    cv::Mat _previous_frame, _previous_gray, _previous_hole;
+    std::vector<cv::Mat> _previous_lab_pyr;
+
+    // State of the hole filling stage.
+    std::unique_ptr<HoleFilling> _previous;
+
+    PreparedFrame prepare(const cv::Mat &frame, const cv::Mat &hole);
+    cv::Mat fill(const PreparedFrame &prepared);
+};
+
+#endif //PATCHMATCH_VIDEOHOLEFILLING_H
@@ -1,15 +1,21 @@
 #include "VotedReconstruction.h"
 #include "PoissonSolver.h"
+#include "ThreadPool.h"
 #include "util.h"
+#include <map>
 
 using cv::COLOR_GRAY2BGR;
 using cv::divide;
 using cv::Mat;
 using cv::meanStdDev;
+using cv::Point;
 using cv::Rect;
+using cv::Scalar;
 using cv::Size;
 using cv::Vec3f;
+using std::map;
 using pmutil::naiveMeanShift;
+using std::make_shared;
 using std::shared_ptr;
 using std::vector;
 
@@ -19,22 +25,27 @@ using std::vector;
 const bool WEIGHTED_BY_SIMILARITY = true;
 
 namespace {
+    /**
+     * Reconstructs the hole pixels in 'r', i. e. the pixels hole_pixels[i] from the votes colors[i] and weights[i].
+     */
     class ParallelModeAwareReconstruction : public cv::ParallelLoopBody {
     private:
-        const vector<vector<Vec3f>> _colors;
-        const vector<vector<float>> _weights;
+        const vector<vector<Vec3f>> &_colors;
+        const vector<vector<float>> &_weights;
+        const vector<int> &_hole_pixels;
         const float _mean_shift_bandwith_scale;
         Mat &_reconstructed_flat;
 
     public:
         ParallelModeAwareReconstruction(const vector<vector<Vec3f>> &colors, const vector<vector<float>> &weights,
-                                        const float mean_shift_bandwith_scale, Mat &reconstructed_flat)
-                : _colors(colors), _weights(weights), _mean_shift_bandwith_scale(mean_shift_bandwith_scale),
-                  _reconstructed_flat(reconstructed_flat) { }
+                                        const vector<int> &hole_pixels, const float mean_shift_bandwith_scale,
+                                        Mat &reconstructed_flat)
+                : _colors(colors), _weights(weights), _hole_pixels(hole_pixels),
+                  _mean_shift_bandwith_scale(mean_shift_bandwith_scale), _reconstructed_flat(reconstructed_flat) { }
 
         virtual void operator()(const cv::Range &r) const {
             for (int i = r.start; i < r.end; i++) {
-                const vector<Vec3f> one_pixel_colors = _colors[i];
+                const vector<Vec3f> &one_pixel_colors = _colors[i];
                 // If no colors are present, this pixel does not need reconstruction, so skip it here.
                 if (one_pixel_colors.empty())
                     continue;
@@ -53,7 +64,7 @@ namespace {
                     }
                     auto max_occurrences_iter = std::max_element(occurrences.begin(), occurrences.end());
                     long max_mode = std::distance(occurrences.begin(), max_occurrences_iter);
-                    const vector<float> one_pixel_weights = _weights[i];
+                    const vector<float> &one_pixel_weights = _weights[i];
                     Vec3f final_color(0, 0, 0);
                     double total_weight = 0;
                     for (int color_idx = 0; color_idx < one_pixel_colors.size(); color_idx++) {
@@ -63,68 +74,126 @@ namespace {
                             total_weight += weight;
                         }
                     }
-                    _reconstructed_flat.at<Vec3f>(i) = final_color / total_weight;
+                    _reconstructed_flat.at<Vec3f>(_hole_pixels[i]) = final_color / total_weight;
                 } else {
                     // If there is not much variance, there is no need to do voting, simply take first color.
-                    _reconstructed_flat.at<Vec3f>(i) = one_pixel_colors[0];
+                    _reconstructed_flat.at<Vec3f>(_hole_pixels[i]) = one_pixel_colors[0];
                 }
             }
         }
     };
 }
 
-VotedReconstruction::VotedReconstruction(const shared_ptr<OffsetMap> offset_map, const vector<Mat> &sources,
+VotedReconstruction::VotedReconstruction(const shared_ptr<OffsetMap> offset_map,
+                                         const shared_ptr<const TransformedSources> sources,
                                          const Mat &hole, int patch_size, int scale_change) :
         _offset_map(offset_map), _sources(sources), _hole(hole), _patch_size(patch_size), _scale_change(scale_change),
         _reconstructed_size((_offset_map->_width - 1 + _patch_size) * _scale_change,
                             (_offset_map->_height - 1 + _patch_size) * _scale_change) {
     if (scale_change != 1) {
         // Source images need some border for reconstruction if we're using bigger patches.
-        for (Mat &source: _sources)
-            copyMakeBorder(source, source, 0, 1, 0, 1, cv::BORDER_REFLECT);
+        _sources = sources->withBorder(scale_change - 1);
     }
 }
 
-void VotedReconstruction::reconstruct(Mat &reconstructed, float mean_shift_bandwith_scale) const {
-    reconstructed = Mat::zeros(_reconstructed_size, CV_32FC3);
-    // Wexler et al suggest using the 75 percentile of the distances as sigma.
-    const float sigma = _offset_map->get75PercentileDistance();
-    const float two_sigma_sqr = sigma * sigma * 2;
-    vector<vector<Vec3f>> colors(_reconstructed_size.width * _reconstructed_size.height);
-    vector<vector<float>> weights(_reconstructed_size.width * _reconstructed_size.height);
-    for (int x = 0; x < _offset_map->_width; x++) {
-        for (int y = 0; y < _offset_map->_height; y++) {
-            OffsetMapEntry offset_map_entry = _offset_map->at(y, x);
-            const cv::Mat matching_patch = offset_map_entry.extractFrom(_sources, x, y,
-                                                                        _patch_size, _scale_change);
+void VotedReconstruction::setVotingIndex(const shared_ptr<const VotingIndex> &voting_index) {
+    CV_Assert(voting_index->fits(Size(_offset_map->_width, _offset_map->_height), _patch_size, _scale_change));
+    _voting_index = voting_index;
+}
+
+/**
+ * Collects the votes of all patches covering the hole, with the patch layout chosen by pmutil::dispatchPatchLayout().
+ */
+class VotedReconstruction::VoteCollection {
+public:
+    VoteCollection(const VotedReconstruction &reconstruction, const VotingIndex &voting_index,
+                   const float two_sigma_sqr, vector<vector<Vec3f>> &colors, vector<vector<float>> &weights)
+            : _reconstruction(reconstruction), _voting_index(voting_index), _two_sigma_sqr(two_sigma_sqr),
+              _colors(colors), _weights(weights) { }
+
+    template<int SIZE, int CHANNELS>
+    void run() {
+        const VotedReconstruction &r = _reconstruction;
+        const int scale_change = r._scale_change;
+        const int side = SIZE > 0 ? SIZE : r._patch_size * scale_change;
+        // Library sources used so far, with the border needed for the scale change.
+        map<unsigned int, shared_ptr<const TransformedSources>> library_sources;
+        // Only the patches covering the hole vote, in the order of the offset map.
+        for (const Point &voting_entry : _voting_index.votingEntries()) {
+            const int x = voting_entry.x, y = voting_entry.y;
+            OffsetMapEntry offset_map_entry = r._offset_map->at(y, x);
+            const TransformedSources *sources = r._sources.get();
+            if (offset_map_entry.source_idx > 0 && r._library != nullptr) {
+                shared_ptr<const TransformedSources> &entry_sources = library_sources[offset_map_entry.source_idx];
+                if (entry_sources == nullptr) {
+                    entry_sources = r._library->sources(offset_map_entry.source_idx - 1, r._library_scale);
+                    if (scale_change != 1)
+                        entry_sources = entry_sources->withBorder(scale_change - 1);
+                }
+                sources = entry_sources.get();
+            }
+            const cv::Mat matching_patch = offset_map_entry.extractFrom(*sources, x, y, r._patch_size, scale_change);
+            // Library images have the layout of the primary source, see RandomizedPatchMatch::setSourceLibrary().
+            CV_Assert(CHANNELS == 0 || matching_patch.channels() == CHANNELS);
+            const int channels = CHANNELS > 0 ? CHANNELS : matching_patch.channels();
 
             float weight;
             if (WEIGHTED_BY_SIMILARITY) {
                 float normalized_dist = sqrtf(offset_map_entry.distance);
-                weight = expf(-normalized_dist / two_sigma_sqr);
+                weight = expf(-normalized_dist / _two_sigma_sqr);
             }
             else {
                 weight = 1;
             }
 
-            for (int x_patch = 0; x_patch < _patch_size * _scale_change; x_patch++) {
-                for (int y_patch = 0; y_patch < _patch_size * _scale_change; y_patch++) {
-                    int curr_x = x * _scale_change + x_patch;
-                    int curr_y = y * _scale_change + y_patch;
-                    if (_hole.at<uchar>(curr_y, curr_x) > 0) {
-                        int idx = curr_x + _reconstructed_size.width * curr_y;
-                        colors[idx].push_back(matching_patch.at<Vec3f>(y_patch, x_patch));
-                        weights[idx].push_back(weight);
+            for (int x_patch = 0; x_patch < side; x_patch++) {
+                for (int y_patch = 0; y_patch < side; y_patch++) {
+                    int curr_x = x * scale_change + x_patch;
+                    int curr_y = y * scale_change + y_patch;
+                    const int slot = _voting_index.slot(curr_x + r._reconstructed_size.width * curr_y);
+                    if (slot >= 0) {
+                        // Patches might be interleaved with gradients, the colors come first at every pixel.
+                        const Vec3f &color = *reinterpret_cast<const Vec3f *>(
+                                matching_patch.ptr<float>(y_patch) + x_patch * channels);
+                        _colors[slot].push_back(color.mul(offset_map_entry.gain) + offset_map_entry.bias);
+                        _weights[slot].push_back(weight);
                     }
                 }
             }
         }
     }
+
+private:
+    const VotedReconstruction &_reconstruction;
+    const VotingIndex &_voting_index;
+    const float _two_sigma_sqr;
+    vector<vector<Vec3f>> &_colors;
+    vector<vector<float>> &_weights;
+};
+
+void VotedReconstruction::reconstruct(Mat &reconstructed, float mean_shift_bandwith_scale) const {
+    reconstructed = Mat::zeros(_reconstructed_size, CV_32FC3);
+    shared_ptr<const VotingIndex> voting_index = _voting_index;
+    if (voting_index == nullptr) {
+        voting_index = make_shared<const VotingIndex>(_hole, Size(_offset_map->_width, _offset_map->_height),
+                                                      _patch_size, _scale_change);
+    }
+    const vector<int> &hole_pixels = voting_index->holePixels();
+    if (hole_pixels.empty())
+        return;
+    // Wexler et al suggest using the 75 percentile of the distances as sigma.
+    const float sigma = _offset_map->get75PercentileDistance();
+    const float two_sigma_sqr = sigma * sigma * 2;
+    // Votes by hole pixel, in the order of holePixels().
+    vector<vector<Vec3f>> colors(hole_pixels.size());
+    vector<vector<float>> weights(hole_pixels.size());
+    // The loop over the pixels of the voting patches is compiled for their layout, chosen once per reconstruction.
+    VoteCollection vote_collection(*this, *voting_index, two_sigma_sqr, colors, weights);
+    pmutil::dispatchPatchLayout(_patch_size * _scale_change, _sources->patchChannels(), vote_collection);
     Mat reconstructed_flat = reconstructed.reshape(3, 1);
-    // TODO: only pass range that actually needs pixels reconstructed.
-    cv::Range whole_width(0, reconstructed_flat.cols);
-    ParallelModeAwareReconstruction pmar(colors, weights, mean_shift_bandwith_scale, reconstructed_flat);
-    // pmar(whole_width); // Single thread.
-    parallel_for_(whole_width, pmar);
+    cv::Range all_hole_pixels(0, static_cast<int>(hole_pixels.size()));
+    ParallelModeAwareReconstruction pmar(colors, weights, hole_pixels, mean_shift_bandwith_scale, reconstructed_flat);
+    // pmar(all_hole_pixels); // Single thread.
+    ThreadPool::current().parallelFor(all_hole_pixels, pmar);
 }
 
@@ -4,6 +4,9 @@
 #include <memory>
 #include <opencv2/imgproc/imgproc.hpp>
 #include "OffsetMap.h"
+#include "SourceLibrary.h"
+#include "TransformedSources.h"
+#include "VotingIndex.h"
 
 class VotedReconstruction {
 
@@ -13,17 +16,41 @@ public:
      * the y-channel being the y-offset.
      * The patch image is assumed to be the one referenced in offset_map.
      */
-    VotedReconstruction(const std::shared_ptr<OffsetMap> offset_map, const std::vector<cv::Mat> &source,
+    VotedReconstruction(const std::shared_ptr<OffsetMap> offset_map,
+                        const std::shared_ptr<const TransformedSources> sources,
                         const cv::Mat &hole, int patch_size, int scale_change = 1);
 
+    /**
+     * Entries with a source_idx i > 0 take their colors from image i - 1 of 'library', downscaled 'library_scale'
+     * times. This has to be the scale of the sources given in construction.
+     */
+    void setSourceLibrary(const std::shared_ptr<SourceLibrary> &library, int library_scale) {
+        _library = library;
+        _library_scale = library_scale;
+    }
+
+    /**
+     * Index of the hole pixels and the entries voting for them, to be reused by all reconstructions of a scale. Built
+     * by every reconstruction if not given.
+     */
+    void setVotingIndex(const std::shared_ptr<const VotingIndex> &voting_index);
+
+    /**
+     * Only the pixels in the hole are reconstructed, from the votes of the patches covering them, the others are 0.
+     */
     void reconstruct(cv::Mat &reconstructed, float mean_shift_bandwith_scale) const;
 
 private:
-    std::vector<cv::Mat> _sources;
+    class VoteCollection;
+
+    std::shared_ptr<SourceLibrary> _library;
+    int _library_scale = 0;
+    std::shared_ptr<const TransformedSources> _sources;
     const cv::Mat _hole;
     const std::shared_ptr<OffsetMap> _offset_map;
     const int _patch_size, _scale_change;
     const cv::Size _reconstructed_size;
+    std::shared_ptr<const VotingIndex> _voting_index;
 };
 
 
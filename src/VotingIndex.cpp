@@ -0,0 +1,41 @@
+#include "VotingIndex.h"
+
+using cv::Mat;
+using cv::Point;
+using cv::Size;
+using std::min;
+
+VotingIndex::VotingIndex(const Mat &hole, const Size &offset_map_size, int patch_size, int scale_change) :
+        _offset_map_size(offset_map_size), _patch_size(patch_size), _scale_change(scale_change),
+        _reconstructed_size((offset_map_size.width - 1 + patch_size) * scale_change,
+                            (offset_map_size.height - 1 + patch_size) * scale_change),
+        _slots(static_cast<size_t>(_reconstructed_size.area()), -1) {
+    CV_Assert(hole.type() == CV_8U);
+    Mat in_hole = Mat::zeros(_reconstructed_size, CV_8U);
+    const int rows = min(hole.rows, _reconstructed_size.height), cols = min(hole.cols, _reconstructed_size.width);
+    for (int y = 0; y < rows; y++) {
+        const uchar *hole_row = hole.ptr<uchar>(y);
+        for (int x = 0; x < cols; x++) {
+            if (hole_row[x] > 0) {
+                const int idx = x + _reconstructed_size.width * y;
+                _slots[idx] = static_cast<int>(_hole_pixels.size());
+                _hole_pixels.push_back(idx);
+                in_hole.at<uchar>(y, x) = 1;
+            }
+        }
+    }
+
+    // Hole pixels covered by every patch from the sums over all rectangles from the top left.
+    Mat sums;
+    integral(in_hole, sums, CV_32S);
+    const int extent = patch_size * scale_change;
+    for (int x = 0; x < offset_map_size.width; x++) {
+        for (int y = 0; y < offset_map_size.height; y++) {
+            const int x0 = x * scale_change, y0 = y * scale_change;
+            const int covered = sums.at<int>(y0 + extent, x0 + extent) - sums.at<int>(y0, x0 + extent) -
+                                sums.at<int>(y0 + extent, x0) + sums.at<int>(y0, x0);
+            if (covered > 0)
+                _voting_entries.push_back(Point(x, y));
+        }
+    }
+}
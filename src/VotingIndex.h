@@ -0,0 +1,47 @@
+#ifndef PATCHMATCH_VOTINGINDEX_H
+#define PATCHMATCH_VOTINGINDEX_H
+
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+
+/**
+ * What VotedReconstruction has to do for a hole: the pixels of the hole, and the entries of the offset map whose
+ * (upscaled) patches cover at least one of them, the only ones voting. Depends only on the hole and the sizes, not on
+ * the offsets, so one index serves all EM steps of a scale.
+ */
+class VotingIndex {
+
+public:
+    /**
+     * 'hole' is non-zero in the hole, pixels of the reconstruction outside of it are not in the hole.
+     */
+    VotingIndex(const cv::Mat &hole, const cv::Size &offset_map_size, int patch_size, int scale_change = 1);
+
+    /**
+     * Hole pixels, as index into the reconstructed image (by rows).
+     */
+    const std::vector<int> &holePixels() const { return _hole_pixels; }
+
+    /**
+     * Position of pixel 'idx' of the reconstructed image in holePixels(), -1 if it is not in the hole.
+     */
+    int slot(int idx) const { return _slots[idx]; }
+
+    /**
+     * Entries (x, y) of the offset map whose patches cover the hole, by columns as the offset map is stored.
+     */
+    const std::vector<cv::Point> &votingEntries() const { return _voting_entries; }
+
+    bool fits(const cv::Size &offset_map_size, int patch_size, int scale_change) const {
+        return offset_map_size == _offset_map_size && patch_size == _patch_size && scale_change == _scale_change;
+    }
+
+private:
+    const cv::Size _offset_map_size;
+    const int _patch_size, _scale_change;
+    const cv::Size _reconstructed_size;
+    std::vector<int> _hole_pixels, _slots;
+    std::vector<cv::Point> _voting_entries;
+};
+
+#endif //PATCHMATCH_VOTINGINDEX_H
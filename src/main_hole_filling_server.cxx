@@ -0,0 +1,39 @@
+#include "HoleFillingServer.h"
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+
+using std::cout;
+using std::endl;
+
+/**
+ * Runs the hole filling service on localhost until SIGINT or SIGTERM, see HoleFillingServer.
+ * Arguments (all optional): port, number of workers, queue capacity.
+ */
+int main(int argc, char **argv)
+{
+    ServerOptions options;
+    options.port = 8080;
+    if (argc > 1)
+        options.port = std::atoi(argv[1]);
+    if (argc > 2)
+        options.nr_workers = std::atoi(argv[2]);
+    if (argc > 3)
+        options.queue_capacity = static_cast<size_t>(std::atoi(argv[3]));
+
+    // Block the signals in all threads, so they can be waited for here.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    HoleFillingServer server(options);
+    server.start();
+    cout << "Listening on 127.0.0.1:" << server.port() << " with " << options.nr_workers << " workers" << endl;
+    int signal;
+    sigwait(&signals, &signal);
+    cout << "Stopping, finishing queued jobs" << endl;
+    server.stop();
+    return 0;
+}
@@ -59,7 +59,7 @@ int main( int argc, char** argv )
     imwrite("reconstructed.exr", reconstructed);
 
     Mat empty_mask = Mat::zeros(source.size(), CV_8U);
-    VotedReconstruction vr(offset_map, source, empty_mask, PATCH_SIZE);
+    VotedReconstruction vr(offset_map, rpm.getTransformedSources(), empty_mask, PATCH_SIZE);
     Mat reconstructed2;
     vr.reconstruct(reconstructed2, 3);
     cvtColor(reconstructed2, reconstructed2, CV_Lab2BGR);
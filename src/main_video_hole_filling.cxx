@@ -0,0 +1,54 @@
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/videoio/videoio.hpp>
+#include "VideoHoleFilling.h"
+#include <boost/format.hpp>
+#include <iostream>
+
+using boost::format;
+using cv::inRange;
+using cv::Mat;
+using cv::Scalar;
+using cv::VideoCapture;
+using std::cout;
+using std::endl;
+
+const int PATCH_SIZE = 7;
+
+/**
+ * Takes a video (or an image sequence pattern like frame_%04d.png) with a 'hole region' (pixels in magenta) in every
+ * frame as input. The hole region of every frame will then be inpainted, the results are written as
+ * result_<frame>.exr.
+ */
+int main( int argc, char** argv )
+{
+    if (argc < 2) {
+        printf("Need a video with a magenta region as argument.\n");
+        return -1;
+    }
+    VideoCapture capture(argv[1]);
+    if (!capture.isOpened()) {
+        printf("Failed to open video.\n");
+        return -1;
+    }
+
+    // Pixels of the color magenta are treated as hole.
+    Scalar hole_color = Scalar(255, 0, 255);
+    VideoHoleFilling vhf(PATCH_SIZE);
+    vhf.run([&](Mat &frame, Mat &hole) {
+        if (!capture.read(frame))
+            return false;
+        inRange(frame, hole_color, hole_color, hole);
+        return true;
+    }, [](int index, const Mat &filled) {
+        Mat bgr;
+        cvtColor(filled, bgr, CV_Lab2BGR);
+        imwrite((format("result_%04d.exr") % index).str(), bgr);
+    });
+
+    const VideoStatistics &statistics = vhf.statistics();
+    cout << "Frames: " << statistics.frames << " (" << statistics.seeded << " seeded, "
+         << statistics.reused_preprocessing << " reused preprocessing)" << endl;
+    cout << "Time: " << statistics.seconds << "s, " << statistics.framesPerSecond() << " fps" << endl;
+    return 0;
+}
@@ -0,0 +1,290 @@
+#ifndef PATCHMATCH_CANDIDATEEVALUATOR_H
+#define PATCHMATCH_CANDIDATEEVALUATOR_H
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include "../OffsetMap.h"
+#include "../SourceLibrary.h"
+#include "SearchSpace.h"
+#include "../TransformedSources.h"
+#include "../util.h"
+
+/**
+ * Settings of gain/bias compensation. If enabled, a source patch s is compared to a target patch t as gain * s + bias,
+ * with gain and bias chosen per channel to match mean and standard deviation of t, but limited to the given ranges.
+ */
+struct GainBiasCompensation {
+    bool enabled = false;
+    // Gain is limited to [1 / max_gain, max_gain], bias to [-max_bias, max_bias].
+    float max_gain = 2, max_bias = 20;
+};
+
+/**
+ * Number of candidates a CandidateEvaluator was asked for, and how many of these were rejected without computing a
+ * distance (not allowed by the search space or not inside the source).
+ */
+struct EvaluationCounts {
+    uint64_t evaluated = 0, rejected = 0;
+
+    EvaluationCounts &operator+=(const EvaluationCounts &other) {
+        evaluated += other.evaluated;
+        rejected += other.rejected;
+        return *this;
+    }
+};
+
+/**
+ * Scores candidate patches of the transformed sources against patches of the target. The target has to have the same
+ * layout as the patches of the sources, i. e. be interleaved with its gradients if the sources are.
+ * Initialization, propagation, random search and merging of offset maps all evaluate candidates through this class,
+ * so every search dimension (translation, rotation, scale, reflection) costs the same per candidate: a lookup in the
+ * transformed source cache followed by one distance computation.
+ *
+ * PATCH_SIZE and CHANNELS fix the layout of the patches at compile time (see pmutil::dispatchPatchLayout()), so the
+ * distance computations are inlined into the loops evaluating candidates. 0 for both accepts any layout, see
+ * CandidateEvaluator.
+ */
+template<int PATCH_SIZE, int CHANNELS>
+class BasicCandidateEvaluator {
+
+public:
+    /**
+     * Maximum number of candidates evaluated together by the batched updateIfBetter.
+     */
+    static constexpr int MAX_BATCH_SIZE = 16;
+
+    BasicCandidateEvaluator(const TransformedSources &sources, const cv::Mat &target, int patch_size)
+            : _sources(sources), _target(target), _patch_size(patch_size) {
+        CV_Assert(PATCH_SIZE == 0 || (patch_size == PATCH_SIZE && target.channels() == CHANNELS));
+    }
+
+    /**
+     * Evaluates candidates with gain/bias compensation. 'target_sum' and 'target_sqsum' are the integral images of
+     * the colors of 'target' (see cv::integral, depth CV_64F), they are only used if compensation is enabled.
+     */
+    BasicCandidateEvaluator(const TransformedSources &sources, const cv::Mat &target, int patch_size,
+                            const GainBiasCompensation &compensation, const cv::Mat &target_sum,
+                            const cv::Mat &target_sqsum)
+            : _sources(sources), _target(target), _patch_size(patch_size), _compensation(compensation),
+              _target_sum(target_sum), _target_sqsum(target_sqsum) {
+        CV_Assert(PATCH_SIZE == 0 || (patch_size == PATCH_SIZE && target.channels() == CHANNELS));
+    }
+
+    /**
+     * Candidates with a source_idx i > 0 are evaluated against the image i - 1 of 'library', downscaled
+     * 'library_scale' times.
+     */
+    void setSourceLibrary(SourceLibrary *library, int library_scale) {
+        _library = library;
+        _library_scale = library_scale;
+    }
+
+    /**
+     * Candidates not allowed by 'search_space' are rejected without computing their distance.
+     */
+    void setSearchSpace(const SearchSpace *search_space) { _search_space = search_space; }
+
+    /**
+     * Distance between the target patch with top left (x, y) and the patch 'candidate' points to.
+     * Returns infinity if the candidate patch is not inside the source or not allowed by the search space. Stops early
+     * once 'limit' is exceeded.
+     * If gain/bias compensation is enabled, the gain and bias of 'candidate' are set to the ones used for the distance.
+     */
+    float distance(OffsetMapEntry *candidate, const int x, const int y, const float limit = INFINITY) const {
+        _counts.evaluated++;
+        if (_search_space != nullptr && !_search_space->allows(*candidate, x, y)) {
+            _counts.rejected++;
+            return INFINITY;
+        }
+        const cv::Rect target_rect(x, y, patchSize(), patchSize());
+        // Keeps library sources alive while their patch is used.
+        std::shared_ptr<const TransformedSources> library_sources;
+        const TransformedSources &sources = sourcesFor(*candidate, &library_sources);
+        if (!_compensation.enabled) {
+            const cv::Mat candidate_patch = candidate->extractFrom(sources, x, y, patchSize());
+            if (candidate_patch.empty()) {
+                _counts.rejected++;
+                return INFINITY;
+            }
+            return static_cast<float>(Ssd::ssd(candidate_patch, _target(target_rect), limit));
+        }
+
+        PatchMoments source_moments;
+        const cv::Rect source_rect(candidate->offset.x + x, candidate->offset.y + y, patchSize(), patchSize());
+        const cv::Mat candidate_patch = sources.patch(candidate->transform_idx, source_rect, &source_moments);
+        if (candidate_patch.empty()) {
+            _counts.rejected++;
+            return INFINITY;
+        }
+        const PatchMoments target_moments = PatchMoments::fromIntegrals(_target_sum, _target_sqsum, target_rect);
+        fitGainBias(source_moments, target_moments, candidate);
+        return static_cast<float>(pmutil::ssd_gain_bias_unsafe(candidate_patch, _target(target_rect), candidate->gain,
+                                                               candidate->bias, _sources.colorChannels(), limit));
+    }
+
+    /**
+     * Replaces 'entry' with 'candidate' if the candidate is a better match for the target patch at (x, y).
+     * Returns true if 'entry' was updated.
+     */
+    bool updateIfBetter(const OffsetMapEntry &candidate, const int x, const int y, OffsetMapEntry *entry) const {
+        OffsetMapEntry evaluated = candidate;
+        const float candidate_distance = distance(&evaluated, x, y, entry->distance);
+        if (candidate_distance < entry->distance) {
+            entry->merge(evaluated, candidate_distance);
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Same as calling updateIfBetter for every one of the 'count' 'candidates', but they are evaluated in batches (see
+     * setBatchSize()): the patches of a batch are gathered first and their distances to the target patch computed in
+     * one pass over it. Candidates of a batch are only cut off by the distance of 'entry' before the batch, not by
+     * better ones within, so large batches compute more of the distances that turn out too large.
+     * With gain/bias compensation, candidates are evaluated one by one.
+     */
+    bool updateIfBetter(const OffsetMapEntry *candidates, const int count, const int x, const int y,
+                        OffsetMapEntry *entry) const {
+        bool updated = false;
+        if (_compensation.enabled || _batch_size == 1) {
+            for (int i = 0; i < count; i++)
+                updated |= updateIfBetter(candidates[i], x, y, entry);
+            return updated;
+        }
+        const cv::Mat target_patch = _target(cv::Rect(x, y, patchSize(), patchSize()));
+        cv::Mat patches[MAX_BATCH_SIZE];
+        std::shared_ptr<const TransformedSources> library_sources[MAX_BATCH_SIZE];
+        int indices[MAX_BATCH_SIZE];
+        double distances[MAX_BATCH_SIZE];
+        prefetch(candidates, std::min(_batch_size, count), x, y);
+        for (int begin = 0; begin < count; begin += _batch_size) {
+            const int end = std::min(begin + _batch_size, count);
+            // The next batch is loaded while this one is scored.
+            prefetch(candidates + end, std::min(_batch_size, count - end), x, y);
+            int nr_patches = 0;
+            for (int i = begin; i < end; i++) {
+                _counts.evaluated++;
+                if (_search_space != nullptr && !_search_space->allows(candidates[i], x, y)) {
+                    _counts.rejected++;
+                    continue;
+                }
+                const TransformedSources &sources = sourcesFor(candidates[i], &library_sources[nr_patches]);
+                patches[nr_patches] = candidates[i].extractFrom(sources, x, y, patchSize());
+                if (patches[nr_patches].empty()) {
+                    _counts.rejected++;
+                    continue;
+                }
+                indices[nr_patches++] = i;
+            }
+            Ssd::batch(target_patch, patches, nr_patches, entry->distance, distances);
+            // Same as one by one: the first of the smallest distances wins, if it is smaller than the current one.
+            int best = -1;
+            float best_distance = entry->distance;
+            for (int k = 0; k < nr_patches; k++) {
+                const float distance = static_cast<float>(distances[k]);
+                if (distance < best_distance) {
+                    best = k;
+                    best_distance = distance;
+                }
+            }
+            if (best >= 0) {
+                entry->merge(candidates[indices[best]], best_distance);
+                updated = true;
+            }
+        }
+        return updated;
+    }
+
+    /**
+     * Hints the CPU to load the patches of the 'count' 'candidates' for the target patch at (x, y), e.g. the ones
+     * evaluated next. Only patches of the primary source are prefetched, see TransformedSources::prefetch().
+     */
+    void prefetch(const OffsetMapEntry *candidates, const int count, const int x, const int y) const {
+        if (!_prefetching)
+            return;
+        for (int i = 0; i < count; i++) {
+            if (candidates[i].source_idx == 0) {
+                _sources.prefetch(candidates[i].transform_idx, cv::Rect(candidates[i].offset.x + x,
+                                                                        candidates[i].offset.y + y, patchSize(),
+                                                                        patchSize()));
+            }
+        }
+    }
+
+    /**
+     * Enables or disables prefetch() (and with it prefetching by the batched updateIfBetter). Default: enabled.
+     */
+    void setPrefetching(bool prefetching) { _prefetching = prefetching; }
+
+    /**
+     * Number of candidates the batched updateIfBetter evaluates together, in [1, MAX_BATCH_SIZE]. Default: 1.
+     */
+    void setBatchSize(int batch_size) {
+        CV_Assert(batch_size >= 1 && batch_size <= MAX_BATCH_SIZE);
+        _batch_size = batch_size;
+    }
+
+    unsigned int nrTransformations() const { return _sources.size(); }
+
+    int patchSize() const { return PATCH_SIZE > 0 ? PATCH_SIZE : _patch_size; }
+
+    /**
+     * Candidates evaluated by this evaluator so far. Not synchronized, every thread should use its own evaluator.
+     */
+    const EvaluationCounts &counts() const { return _counts; }
+
+private:
+    typedef pmutil::PatchSsd<PATCH_SIZE, CHANNELS> Ssd;
+
+    const TransformedSources &_sources;
+    const cv::Mat _target;
+    const int _patch_size;
+    const GainBiasCompensation _compensation;
+    const cv::Mat _target_sum, _target_sqsum;
+    SourceLibrary *_library = nullptr;
+    const SearchSpace *_search_space = nullptr;
+    int _library_scale = 0;
+    int _batch_size = 1;
+    bool _prefetching = true;
+    mutable EvaluationCounts _counts;
+
+    const TransformedSources &sourcesFor(const OffsetMapEntry &candidate,
+                                         std::shared_ptr<const TransformedSources> *library_sources) const {
+        if (candidate.source_idx == 0 || _library == nullptr)
+            return _sources;
+        *library_sources = _library->sources(candidate.source_idx - 1, _library_scale);
+        return **library_sources;
+    }
+
+    /**
+     * Chooses gain and bias of 'candidate', so the compensated source patch has the mean and standard deviation of
+     * the target patch (as far as the limits allow).
+     */
+    void fitGainBias(const PatchMoments &source, const PatchMoments &target, OffsetMapEntry *candidate) const {
+        const int cn = std::min(_sources.colorChannels(), 3);
+        for (int c = 0; c < cn; c++) {
+            const double source_mean = source.sum[c] / source.count;
+            const double target_mean = target.sum[c] / target.count;
+            const double source_var = source.sqsum[c] / source.count - source_mean * source_mean;
+            const double target_var = target.sqsum[c] / target.count - target_mean * target_mean;
+            double gain = 1;
+            if (source_var > 1e-8)
+                gain = std::sqrt(std::max(target_var, 0.) / source_var);
+            gain = std::min(std::max(gain, 1. / _compensation.max_gain), static_cast<double>(_compensation.max_gain));
+            const double bias = std::min(std::max(target_mean - gain * source_mean,
+                                                  static_cast<double>(-_compensation.max_bias)),
+                                         static_cast<double>(_compensation.max_bias));
+            candidate->gain[c] = static_cast<float>(gain);
+            candidate->bias[c] = static_cast<float>(bias);
+        }
+    }
+};
+
+template<int PATCH_SIZE, int CHANNELS>
+constexpr int BasicCandidateEvaluator<PATCH_SIZE, CHANNELS>::MAX_BATCH_SIZE;
+
+/**
+ * Evaluator for patches of any size and number of channels.
+ */
+typedef BasicCandidateEvaluator<0, 0> CandidateEvaluator;
+
+#endif //PATCHMATCH_CANDIDATEEVALUATOR_H
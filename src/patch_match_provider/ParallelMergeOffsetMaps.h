@@ -1,44 +1,119 @@
 #ifndef PATCHMATCH_PARALLELMERGEOFFSETMAPS_H
 #define PATCHMATCH_PARALLELMERGEOFFSETMAPS_H
 
+#include <algorithm>
+#include <mutex>
 #include <opencv2/imgproc/imgproc.hpp>
 #include "../OffsetMap.h"
-#include "RandomizedPatchMatch.h"
-
-using cv::Rect;
-using cv::Point;
-using cv::Size;
+#include "CandidateEvaluator.h"
 
+/**
+ * Merges the offsets of 'other_offset_map', found for a target 'scale_difference' times smaller, into 'offset_map'
+ * where they are better. Every entry is offered the upscaled offset of the entry of the other map covering it (its
+ * parent), i. e. all 'scale_difference' x 'scale_difference' children of a parent get its offset. If
+ * 'scale_difference' > 1, the two neighbors of the parent on the side of the child are offered as well, which helps
+ * children of parents lying on the border between two regions.
+ * Runs in parallel over square tiles of 'offset_map' (see nrTiles()), every task with its own copy of 'evaluator'.
+ * 'Evaluator' is the BasicCandidateEvaluator of the patch layout, so the merge is specialized like the sweep.
+ */
+template<typename Evaluator = CandidateEvaluator>
 class ParallelMergeOffsetMaps : public cv::ParallelLoopBody {
-private:
-    const OffsetMap &_other_offset_map;
-    const int _scale_difference, _patch_size, _current_scale;
-    OffsetMap &_offset_map;
-    RandomizedPatchMatch &_rmp;
 
 public:
+    /**
+     * Side length of the tiles in entries, so a task merges enough entries to be worth scheduling. Default: 32.
+     */
+    static constexpr int TILE_SIZE = 32;
+    /**
+     * If true, children are also offered the neighbors of their parent. Default: true.
+     */
+    static constexpr bool OFFER_PARENT_NEIGHBORS = true;
+
     ParallelMergeOffsetMaps(const OffsetMap &other_offset_map, const int scale_difference,
-                            const int patch_size, const int current_scale,
-                            RandomizedPatchMatch &rmp, OffsetMap &offset_map)
-            : _other_offset_map(other_offset_map), _current_scale(current_scale),
-              _scale_difference(scale_difference), _patch_size(patch_size),
-              _rmp(rmp), _offset_map(offset_map) { }
-
-    virtual void operator()(const cv::Range &r) const {
-        Size sz(_patch_size, _patch_size);
-        for (int x = r.start; x < r.end; x++) {
-            for (int y = 0; y < _other_offset_map._height; y++) {
-                OffsetMapEntry other_offset = _other_offset_map.at(y, x);
-                other_offset.offset *= _scale_difference;
-
-                Point offset_map_at(x * _scale_difference, y * _scale_difference);
-                Rect target_patch_rect(offset_map_at, sz);
-
-                OffsetMapEntry *current_offset = _offset_map.ptr(y * _scale_difference,
-                                                                 x * _scale_difference);
-                _rmp.updateOffsetMapEntryIfBetter(target_patch_rect, other_offset, _current_scale, current_offset);
+                            const Evaluator &evaluator, OffsetMap &offset_map)
+            : _other_offset_map(other_offset_map), _scale_difference(scale_difference), _evaluator(evaluator),
+              _offset_map(offset_map), _tiles_x((offset_map._width + TILE_SIZE - 1) / TILE_SIZE) {
+        CV_Assert(!offset_map.isFlipped() && !other_offset_map.isFlipped() && scale_difference > 0);
+    }
+
+    int nrTiles() const {
+        return _tiles_x * ((_offset_map._height + TILE_SIZE - 1) / TILE_SIZE);
+    }
+
+    /**
+     * Candidates evaluated by all tasks so far.
+     */
+    EvaluationCounts counts() const {
+        std::lock_guard<std::mutex> lock(_counts_mutex);
+        return _counts;
+    }
+
+    virtual void operator()(const cv::Range &r) const override {
+        Evaluator evaluator = _evaluator;
+        const EvaluationCounts counts_before = evaluator.counts();
+        const int tile_size = TILE_SIZE;
+        for (int tile = r.start; tile < r.end; tile++) {
+            const int x_begin = (tile % _tiles_x) * tile_size;
+            const int y_begin = (tile / _tiles_x) * tile_size;
+            const int x_end = std::min(x_begin + tile_size, _offset_map._width);
+            const int y_end = std::min(y_begin + tile_size, _offset_map._height);
+            // Offset maps are stored by columns.
+            for (int x = x_begin; x < x_end; x++) {
+                for (int y = y_begin; y < y_end; y++)
+                    mergeInto(evaluator, x, y);
             }
         }
+        EvaluationCounts counts = evaluator.counts();
+        counts.evaluated -= counts_before.evaluated;
+        counts.rejected -= counts_before.rejected;
+        std::lock_guard<std::mutex> lock(_counts_mutex);
+        _counts += counts;
+    }
+
+private:
+    const OffsetMap &_other_offset_map;
+    const int _scale_difference;
+    const Evaluator &_evaluator;
+    OffsetMap &_offset_map;
+    const int _tiles_x;
+    mutable std::mutex _counts_mutex;
+    mutable EvaluationCounts _counts;
+
+    void mergeInto(const Evaluator &evaluator, int x, int y) const {
+        const int parent_x = x / _scale_difference, parent_y = y / _scale_difference;
+        if (parent_x >= _other_offset_map._width || parent_y >= _other_offset_map._height)
+            return;
+        OffsetMapEntry *entry = _offset_map.ptr(y, x);
+        const OffsetMapEntry parent = _other_offset_map.at(parent_y, parent_x);
+        offer(evaluator, parent, x, y, entry);
+        if (!OFFER_PARENT_NEIGHBORS || _scale_difference == 1)
+            return;
+
+        // The neighbors of the parent closest to the child, horizontally and vertically.
+        const int neighbor_x = parent_x + (2 * (x % _scale_difference) >= _scale_difference ? 1 : -1);
+        const int neighbor_y = parent_y + (2 * (y % _scale_difference) >= _scale_difference ? 1 : -1);
+        if (neighbor_x >= 0 && neighbor_x < _other_offset_map._width) {
+            const OffsetMapEntry neighbor = _other_offset_map.at(parent_y, neighbor_x);
+            if (!sameCandidate(neighbor, parent))
+                offer(evaluator, neighbor, x, y, entry);
+        }
+        if (neighbor_y >= 0 && neighbor_y < _other_offset_map._height) {
+            const OffsetMapEntry neighbor = _other_offset_map.at(neighbor_y, parent_x);
+            if (!sameCandidate(neighbor, parent))
+                offer(evaluator, neighbor, x, y, entry);
+        }
+    }
+
+    void offer(const Evaluator &evaluator, OffsetMapEntry candidate, int x, int y,
+               OffsetMapEntry *entry) const {
+        candidate.offset *= _scale_difference;
+        // Coherent maps often already hold the candidate, no need to compute its distance again.
+        if (!sameCandidate(candidate, *entry))
+            evaluator.updateIfBetter(candidate, x, y, entry);
+    }
+
+    static bool sameCandidate(const OffsetMapEntry &a, const OffsetMapEntry &b) {
+        return a.offset == b.offset && a.transform_idx == b.transform_idx && a.source_idx == b.source_idx;
     }
 };
 
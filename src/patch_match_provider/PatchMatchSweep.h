@@ -0,0 +1,63 @@
+#ifndef PATCHMATCH_PATCHMATCHSWEEP_H
+#define PATCHMATCH_PATCHMATCHSWEEP_H
+
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+
+/**
+ * Propagation and random search for the entries in 'entries' of an offset map, column by column. Shared by
+ * RandomizedPatchMatch and SpaceTimePatchMatch, which only differ in the policy. Entries are addressed as stored in
+ * the (possibly flipped) map, the policy additionally gets the unflipped position of the target patch.
+ *
+ * Every entry is first offered its left neighbor (if x > 'propagation_x_begin'), its upper neighbor and the further
+ * propagated candidates of the policy, e.g. the entries of the neighboring frames. Then it is offered the random
+ * candidates of the policy, drawn around the offset it has after propagation. 'Policy' provides:
+ * - Entry, the type of the candidates, and MAX_FURTHER_PROPAGATED, the maximum number of further propagated ones.
+ * - int width() const, int height() const and bool isFlipped() const of the offset map.
+ * - Entry at(int y, int x) const.
+ * - int furtherPropagated(int y, int x, Entry *candidates) const, which returns their number.
+ * - void randomCandidates(int y, int x, const cv::Point &target, cv::RNG &rng, std::vector<Entry> *candidates).
+ * - void updateIfBetter(const Entry *candidates, int count, int y, int x, const cv::Point &target), which replaces
+ *   the entry with the best candidate, if it is better.
+ * - void prefetch(int y, int x, const cv::Point &target) const, a hint that the entry (y, x) will be a candidate
+ *   for 'target'.
+ * 'random_candidates' is only used as buffer, so it does not need to be allocated for every call.
+ */
+template<typename Policy>
+void sweepEntries(Policy &policy, const cv::Rect &entries, const int propagation_x_begin, cv::RNG &rng,
+                  std::vector<typename Policy::Entry> *random_candidates) {
+    typedef typename Policy::Entry Entry;
+    const bool flipped = policy.isFlipped();
+    const int x_end = entries.x + entries.width;
+    const int y_end = entries.y + entries.height;
+    for (int x = entries.x; x < x_end; x++) {
+        for (int y = entries.y; y < y_end; y++) {
+            // If the map is flipped, we need the unflipped coordinates of the target patch for the right offset.
+            const cv::Point target = flipped ? cv::Point(policy.width() - 1 - x, policy.height() - 1 - y) :
+                                     cv::Point(x, y);
+
+            // The left neighbor of the next entry is known already, so its patch can be on the way while this entry
+            // is done.
+            if (x > propagation_x_begin && y + 1 < y_end)
+                policy.prefetch(y + 1, x - 1, cv::Point(target.x, flipped ? target.y - 1 : target.y + 1));
+
+            // Propagate step, try offsets of neighboring entries for this one, apply if better.
+            Entry propagated[2 + Policy::MAX_FURTHER_PROPAGATED];
+            int nr_propagated = 0;
+            if (x > propagation_x_begin)
+                propagated[nr_propagated++] = policy.at(y, x - 1);
+            if (y > 0)
+                propagated[nr_propagated++] = policy.at(y - 1, x);
+            nr_propagated += policy.furtherPropagated(y, x, propagated + nr_propagated);
+            policy.updateIfBetter(propagated, nr_propagated, y, x, target);
+
+            // Random search step, try out various locations all over the image that could be better.
+            random_candidates->clear();
+            policy.randomCandidates(y, x, target, rng, random_candidates);
+            policy.updateIfBetter(random_candidates->data(), static_cast<int>(random_candidates->size()), y, x,
+                                  target);
+        }
+    }
+}
+
+#endif //PATCHMATCH_PATCHMATCHSWEEP_H
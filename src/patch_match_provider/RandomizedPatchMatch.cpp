@@ -1,13 +1,18 @@
 #include "RandomizedPatchMatch.h"
 #include <opencv2/highgui/highgui.hpp>
 #include "../util.h"
+#include "../LabPyramid.h"
 #include "ParallelMergeOffsetMaps.h"
+#include "PatchMatchSweep.h"
+#include "../ThreadPool.h"
+#include <functional>
 #include <iostream>
 
 using cv::addWeighted;
 using cv::buildPyramid;
 using cv::flip;
 using cv::getRotationMatrix2D;
+using cv::integral;
 using cv::Mat;
 using cv::Point;
 using cv::Range;
@@ -17,10 +22,9 @@ using cv::Scalar;
 using cv::Size;
 using cv::String;
 using cv::Vec3f;
-using pmutil::createRotatedImages;
-using pmutil::computeGradientX;
-using pmutil::computeGradientY;
-using pmutil::ssd_unsafe;
+using pmutil::buildPyramidParallel;
+using pmutil::interleaveWithGradients;
+using std::make_shared;
 using std::max;
 using std::shared_ptr;
 using std::vector;
@@ -35,28 +39,192 @@ constexpr int ITERATIONS_PER_SCALE = 5;
 constexpr bool RANDOM_SEARCH = true;
 constexpr bool MULTIPLE_SCALES = false;
 constexpr bool MERGE_UPSAMPLED_OFFSETS = true;
+/**
+ * Maximum number of library images random search draws from during one match. Drawing from all images of a large
+ * library would load (and evict) them over and over. Default: 8.
+ */
+constexpr size_t MAX_ACTIVE_LIBRARY_IMAGES = 8;
+/**
+ * With search constraints, number of random offsets drawn per entry during initialization to find an allowed one.
+ */
+constexpr int MAX_INITIALIZATION_ATTEMPTS = 8;
+/**
+ * Number of candidates of a target patch evaluated together (see CandidateEvaluator::setBatchSize()): the two
+ * propagated ones, and the random samples of one random search. Default: 8.
+ */
+constexpr int CANDIDATE_BATCH_SIZE = 8;
+/**
+ * Side length in entries of the tiles the offset map is swept in (see setSweepTileSize()). The target patches of a
+ * tile (with gradients, about 50 KB for 3 channels) and its entries fit into the L2 cache together with the source
+ * patches they point to, which are close to each other once the offsets are coherent. Default: 32.
+ */
+constexpr int SWEEP_TILE_SIZE = 32;
 constexpr float ALPHA = 0.5; // Used to modify random search radius. Higher alpha means more random searches.
 
+namespace {
+    /**
+     * Prefetches the rows of 'target' covered by the patches of the entries in 'tile' (in sweep coordinates, i. e.
+     * flipped if 'flipped', of an offset map of width x height), so the first patches of a tile do not wait for memory.
+     */
+    void prefetchTargetTile(const Mat &target, int patch_size, bool flipped, Rect tile, int width, int height) {
+#if defined(__GNUC__)
+        constexpr int CACHE_LINE_BYTES = 64;
+        if (flipped)
+            tile = Rect(width - tile.x - tile.width, height - tile.y - tile.height, tile.width, tile.height);
+        const int row_bytes = static_cast<int>((tile.width + patch_size - 1) * target.elemSize());
+        for (int y = tile.y; y < tile.y + tile.height + patch_size - 1; y++) {
+            const char *row = target.ptr<char>(y) + tile.x * target.elemSize();
+            for (int offset = 0; offset < row_bytes; offset += CACHE_LINE_BYTES)
+                __builtin_prefetch(row + offset);
+        }
+#endif
+    }
+}
+
 RandomizedPatchMatch::RandomizedPatchMatch(const cv::Mat &source, const cv::Size &target_size, int patch_size,
                                            float lambda, float min_rotation, float max_rotation, float rotation_step) :
+        RandomizedPatchMatch(source, target_size, patch_size,
+                             SourceTransformations::rotationsOnly(min_rotation, max_rotation, rotation_step),
+                             lambda) { }
+
+RandomizedPatchMatch::RandomizedPatchMatch(const cv::Mat &source, const cv::Size &target_size, int patch_size,
+                                           const SourceTransformations &transformations, float lambda) :
         _patch_size(patch_size), _max_search_radius(max(source.cols, source.rows)),
-        _nr_scales(findNumberScales(source.size(), target_size, patch_size)), _lambda(lambda) {
+        _nr_scales(findNumberScales(source.size(), target_size, patch_size)), _lambda(lambda),
+        _candidate_batch_size(CANDIDATE_BATCH_SIZE), _sweep_tile_size(SWEEP_TILE_SIZE) {
     vector<Mat> source_pyr;
-    buildPyramid(source, source_pyr, _nr_scales);
+    // The sources keep the levels, so the first one is a copy.
+    buildPyramidParallel(source.clone(), source_pyr, _nr_scales);
     for (int i = 0; i <= _nr_scales; i++) {
-        Mat scaled_source = source_pyr[i];
-        _source_rotations_pyr.push_back(createRotatedImages(scaled_source, min_rotation, max_rotation, rotation_step));
-        Mat gx;
-        computeGradientX(scaled_source, gx);
-        _source_grad_x_pyr.push_back(gx);
-        Mat gy;
-        computeGradientY(scaled_source, gy);
-        _source_grad_y_pyr.push_back(gy);
+        // Gradients are interleaved with the colors, so the weighted distance is computed in a single pass.
+        _transformed_sources_pyr.push_back(make_shared<TransformedSources>(
+                source_pyr[i], transformations, patch_size, 0, TransformedSources::DEFAULT_MAX_CACHED_TILES, _lambda));
     }
+    setSearchConstraints(SearchConstraints());
 }
 
+RandomizedPatchMatch::RandomizedPatchMatch(const vector<shared_ptr<TransformedSources>> &sources_pyr,
+                                           const cv::Size &target_size, int patch_size, float lambda) :
+        _patch_size(patch_size),
+        _max_search_radius(max(sources_pyr[0]->sourceSize().width, sources_pyr[0]->sourceSize().height)),
+        _nr_scales(findNumberScales(sources_pyr[0]->sourceSize(), target_size, patch_size)), _lambda(lambda),
+        _candidate_batch_size(CANDIDATE_BATCH_SIZE), _sweep_tile_size(SWEEP_TILE_SIZE) {
+    CV_Assert(static_cast<int>(sources_pyr.size()) > _nr_scales);
+    _transformed_sources_pyr.assign(sources_pyr.begin(), sources_pyr.begin() + _nr_scales + 1);
+    setSearchConstraints(SearchConstraints());
+}
+
+/**
+ * Runs matchScale() for the patch layout chosen by pmutil::dispatchPatchLayout().
+ */
+class RandomizedPatchMatch::ScaleMatcher {
+public:
+    ScaleMatcher(RandomizedPatchMatch &rmp, const int scale, const OffsetMap &previous_scale_offset_map,
+                 OffsetMap *offset_map, RNG &rng)
+            : _rmp(rmp), _scale(scale), _previous_scale_offset_map(previous_scale_offset_map),
+              _offset_map(offset_map), _rng(rng) { }
+
+    template<int PATCH_SIZE, int CHANNELS>
+    void run() {
+        _rmp.matchScale<PATCH_SIZE, CHANNELS>(_scale, _previous_scale_offset_map, _offset_map, _rng);
+    }
+
+private:
+    RandomizedPatchMatch &_rmp;
+    const int _scale;
+    const OffsetMap &_previous_scale_offset_map;
+    OffsetMap *_offset_map;
+    RNG &_rng;
+};
+
+/**
+ * The offset map of one scale for sweepEntries(), with the candidates evaluated by 'Evaluator'.
+ */
+template<typename Evaluator>
+class RandomizedPatchMatch::SweepPolicy {
+public:
+    typedef OffsetMapEntry Entry;
+    static constexpr int MAX_FURTHER_PROPAGATED = 0;
+
+    SweepPolicy(const RandomizedPatchMatch &rmp, const Evaluator &evaluator, const int scale, OffsetMap *offset_map)
+            : _rmp(rmp), _evaluator(evaluator), _offset_map(offset_map),
+              _search_library(scale == 0 && !rmp._source_cdf.empty()),
+              _constrained(scale == 0 && rmp._search_space->isConstrained()) { }
+
+    int width() const { return _offset_map->_width; }
+    int height() const { return _offset_map->_height; }
+    bool isFlipped() const { return _offset_map->isFlipped(); }
+    Entry at(const int y, const int x) const { return _offset_map->at(y, x); }
+    int furtherPropagated(const int, const int, Entry *) const { return 0; }
+
+    void prefetch(const int y, const int x, const Point &target) const {
+        const Entry entry = at(y, x);
+        _evaluator.prefetch(&entry, 1, target.x, target.y);
+    }
+
+    void updateIfBetter(const Entry *candidates, const int count, const int y, const int x, const Point &target) {
+        _evaluator.updateIfBetter(candidates, count, target.x, target.y, _offset_map->ptr(y, x));
+    }
+
+    void randomCandidates(const int y, const int x, const Point &target, RNG &rng, vector<Entry> *candidates) const {
+        if (!RANDOM_SEARCH)
+            return;
+        const Entry current = at(y, x);
+        float current_search_radius = _rmp._max_search_radius;
+        Rect search_box;
+        if (_constrained) {
+            // Only sample where candidates may lie, so the radius shrinks with the allowed region.
+            search_box = _rmp._search_space->searchBox(target.x, target.y);
+            current_search_radius = std::min(current_search_radius, static_cast<float>(
+                    max(search_box.width, search_box.height)));
+        }
+        // All samples are around the offset before random search, so they are evaluated together.
+        while (current_search_radius > 1) {
+            Entry random;
+            Point random_point = Point(cvRound(rng.uniform(-1.f, 1.f) * current_search_radius),
+                                       cvRound(rng.uniform(-1.f, 1.f) * current_search_radius));
+            random.offset = current.offset + random_point;
+            random.source_idx = current.source_idx;
+            if (_search_library) {
+                random.source_idx = _rmp.sampleSource(rng);
+                if (random.source_idx != current.source_idx) {
+                    // Offsets do not carry over between sources, so look anywhere in the new one.
+                    const Size source_size = random.source_idx == 0 ?
+                            _rmp._transformed_sources_pyr[0]->imageSize() :
+                            _rmp._library->sources(random.source_idx - 1, _rmp._library_scale)->imageSize();
+                    const int max_x = max(source_size.width - _rmp._patch_size + 1, 1);
+                    const int max_y = max(source_size.height - _rmp._patch_size + 1, 1);
+                    random.offset = Point(rng.uniform(0, max_x) - target.x, rng.uniform(0, max_y) - target.y);
+                }
+            }
+            if (_constrained && random.source_idx == 0) {
+                const int radius = cvRound(current_search_radius);
+                Rect window = Rect(current.offset + target - Point(radius, radius),
+                                   Size(2 * radius + 1, 2 * radius + 1)) & search_box;
+                if (random.source_idx != current.source_idx || window.area() == 0)
+                    window = search_box;
+                random.offset = Point(rng.uniform(window.x, window.x + window.width),
+                                      rng.uniform(window.y, window.y + window.height)) - target;
+            }
+            random.transform_idx = static_cast<unsigned int>(
+                    rng.uniform(0, static_cast<int>(_evaluator.nrTransformations())));
+            candidates->push_back(random);
+
+            current_search_radius *= ALPHA;
+        }
+    }
+
+private:
+    const RandomizedPatchMatch &_rmp;
+    const Evaluator &_evaluator;
+    OffsetMap *_offset_map;
+    const bool _search_library, _constrained;
+};
+
 shared_ptr<OffsetMap> RandomizedPatchMatch::match() {
     RNG rng(_target_updated_count);
+    if (_library != nullptr)
+        drawActiveSources(rng);
 
     // Initialize with dummy offset map that will be deleted at the end of first iteration.
     OffsetMap *previous_scale_offset_map = new OffsetMap(0, 0);
@@ -65,87 +233,9 @@ shared_ptr<OffsetMap> RandomizedPatchMatch::match() {
         const int width = target.cols - _patch_size + 1;
         const int height = target.rows - _patch_size + 1;
         OffsetMap *offset_map = new OffsetMap(width, height);
-        unsigned int random_seed = static_cast<unsigned int>(target.rows * target.cols + _target_updated_count);
-        initializeWithRandomOffsets(_source_rotations_pyr[scale][0].size(), scale, offset_map, random_seed);
-
-        for (int i = 0; i < ITERATIONS_PER_SCALE; i++) {
-            // After half the iterations, merge the lower resolution offset where they're better.
-            // This has to be done in an 'even' iteration because of the flipping.
-            if (i == ITERATIONS_PER_SCALE / 2) {
-                constexpr int PARALLEL_MERGING_THRESHOLD = 500;
-                assert(!offset_map->isFlipped());
-                if (MERGE_UPSAMPLED_OFFSETS && scale != _nr_scales) {
-                    ParallelMergeOffsetMaps pmom(*previous_scale_offset_map, 2, _patch_size,
-                                                 scale, *this, *offset_map);
-                    Range whole_width(0, previous_scale_offset_map->_width);
-                    if (previous_scale_offset_map->_width * previous_scale_offset_map->_height >
-                            PARALLEL_MERGING_THRESHOLD)
-                        parallel_for_(whole_width, pmom);
-                    else
-                        pmom(whole_width);
-                }
-                // If we're on full resolution and have a previous solution, try to merge it, too.
-                if (scale == 0 && _previous_solution != nullptr) {
-                    ParallelMergeOffsetMaps pmom(*_previous_solution, 1, _patch_size,
-                                                 scale, *this, *offset_map);
-                    Range whole_width(0, _previous_solution->_width);
-                    if (_previous_solution->_width * _previous_solution->_height > PARALLEL_MERGING_THRESHOLD)
-                        parallel_for_(whole_width, pmom);
-                    else
-                        pmom(whole_width);
-                }
-            }
-
-            for (int x = 0; x < offset_map->_width; x++) {
-                for (int y = 0; y < offset_map->_height; y++) {
-                    OffsetMapEntry *offset_map_entry = offset_map->ptr(y, x);
-
-                    // If image is flipped, we need to get x and y coordinates unflipped for getting the right offset.
-                    int x_unflipped, y_unflipped;
-                    if (offset_map->isFlipped()) {
-                        x_unflipped = offset_map->_width - 1 - x;
-                        y_unflipped = offset_map->_height - 1 - y;
-                    } else {
-                        x_unflipped = x;
-                        y_unflipped = y;
-                    }
-                    Rect target_patch_rect(x_unflipped, y_unflipped, _patch_size, _patch_size);
-
-                    // Propagate step, try offsets of neighboring entries for this one, apply if better.
-                    if (x > 0) {
-                        OffsetMapEntry offsetLeft = offset_map->at(y, x - 1);
-                        updateOffsetMapEntryIfBetter(target_patch_rect, offsetLeft, scale, offset_map_entry);
-                    }
-                    if (y > 0) {
-                        OffsetMapEntry offsetUp = offset_map->at(y - 1, x);
-                        updateOffsetMapEntryIfBetter(target_patch_rect, offsetUp, scale, offset_map_entry);
-                    }
-
-                    // Random search step, try out various locations all over the image that could be better.
-                    if (RANDOM_SEARCH) {
-                        Point current_offset = offset_map_entry->offset;
-                        float current_search_radius = _max_search_radius;
-                        while (current_search_radius > 1) {
-                            OffsetMapEntry random;
-                            Point random_point = Point(cvRound(rng.uniform(-1.f, 1.f) * current_search_radius),
-                                                       cvRound(rng.uniform(-1.f, 1.f) * current_search_radius));
-                            random.offset = current_offset + random_point;
-                            random.rotation_idx = rng.uniform(0, _source_rotations_pyr[0].size());
-                            updateOffsetMapEntryIfBetter(target_patch_rect, random, scale, offset_map_entry);
-
-                            current_search_radius *= ALPHA;
-                        }
-                    }
-                }
-            }
-            // Every second iteration, we go the other way round (start at bottom, propagate from right and down).
-            // This effect can be achieved by flipping the matrix after every iteration.
-            offset_map->flip();
-        }
-        if (offset_map->isFlipped()) {
-            // Correct orientation if we're still in flipped state.
-            offset_map->flip();
-        }
+        // The sweep is compiled for the patch layout of the scale, which is chosen once here instead of per patch.
+        ScaleMatcher scale_matcher(*this, scale, *previous_scale_offset_map, offset_map, rng);
+        pmutil::dispatchPatchLayout(_patch_size, _target_features_pyr[scale].channels(), scale_matcher);
         delete previous_scale_offset_map;
         previous_scale_offset_map = offset_map;
     }
@@ -153,58 +243,192 @@ shared_ptr<OffsetMap> RandomizedPatchMatch::match() {
     return _previous_solution;
 }
 
-void RandomizedPatchMatch::updateOffsetMapEntryIfBetter(const Rect &target_patch_rect,
+template<int PATCH_SIZE, int CHANNELS>
+void RandomizedPatchMatch::matchScale(const int scale, const OffsetMap &previous_scale_offset_map,
+                                      OffsetMap *offset_map, RNG &rng) {
+    typedef BasicCandidateEvaluator<PATCH_SIZE, CHANNELS> Evaluator;
+    const Mat target = _target_pyr[scale];
+    const int width = offset_map->_width;
+    const int height = offset_map->_height;
+    unsigned int random_seed = static_cast<unsigned int>(target.rows * target.cols + _target_updated_count);
+    const Evaluator evaluator = specializedEvaluatorFor<PATCH_SIZE, CHANNELS>(scale);
+    initializeWithRandomOffsets(evaluator, _transformed_sources_pyr[scale]->imageSize(), scale, offset_map,
+                                random_seed);
+    SweepPolicy<Evaluator> policy(*this, evaluator, scale, offset_map);
+    vector<OffsetMapEntry> random_candidates;
+
+    for (int i = 0; i < ITERATIONS_PER_SCALE; i++) {
+        // After half the iterations, merge the lower resolution offset where they're better.
+        // This has to be done in an 'even' iteration because of the flipping.
+        if (i == ITERATIONS_PER_SCALE / 2) {
+            assert(!offset_map->isFlipped());
+            if (MERGE_UPSAMPLED_OFFSETS && scale != _nr_scales) {
+                ParallelMergeOffsetMaps<Evaluator> pmom(previous_scale_offset_map, 2, evaluator, *offset_map);
+                ThreadPool::current().parallelFor(Range(0, pmom.nrTiles()), pmom);
+                if (scale == 0)
+                    _statistics += pmom.counts();
+            }
+            // If we're on full resolution and have a previous solution, try to merge it, too.
+            if (scale == 0 && _previous_solution != nullptr) {
+                ParallelMergeOffsetMaps<Evaluator> pmom(*_previous_solution, 1, evaluator, *offset_map);
+                ThreadPool::current().parallelFor(Range(0, pmom.nrTiles()), pmom);
+                _statistics += pmom.counts();
+            }
+        }
+
+        const int tile_size = _sweep_tile_size > 0 ? _sweep_tile_size : max(max(width, height), 1);
+        const int tiles_x = (width + tile_size - 1) / tile_size;
+        const int nr_tiles = tiles_x * ((height + tile_size - 1) / tile_size);
+        // Tiles in raster order, so the left and upper neighbors of every entry are done before it, as in a sweep
+        // over the whole map.
+        for (int tile = 0; tile < nr_tiles; tile++) {
+            const int x_begin = (tile % tiles_x) * tile_size;
+            const int y_begin = (tile / tiles_x) * tile_size;
+            const Rect entries(x_begin, y_begin, std::min(tile_size, width - x_begin),
+                               std::min(tile_size, height - y_begin));
+            prefetchTargetTile(_target_features_pyr[scale], evaluator.patchSize(), offset_map->isFlipped(), entries,
+                               width, height);
+            sweepEntries(policy, entries, 0, rng, &random_candidates);
+        }
+        // Every second iteration, we go the other way round (start at bottom, propagate from right and down).
+        // This effect can be achieved by flipping the matrix after every iteration.
+        offset_map->flip();
+    }
+    if (offset_map->isFlipped()) {
+        // Correct orientation if we're still in flipped state.
+        offset_map->flip();
+    }
+    if (scale == 0)
+        _statistics += evaluator.counts();
+}
+
+void RandomizedPatchMatch::updateOffsetMapEntryIfBetter(const CandidateEvaluator &evaluator,
+                                                        const Rect &target_patch_rect,
                                                         const OffsetMapEntry &candidate_entry,
-                                                        const int scale, OffsetMapEntry *offset_map_entry) const {
-    const Mat candidate_patch = candidate_entry.extractFrom(_source_rotations_pyr[scale],
-                                                            target_patch_rect.x, target_patch_rect.y, _patch_size);
-    // If candidate patch was not inside image, return immediately.
-    if (candidate_patch.empty())
+                                                        OffsetMapEntry *offset_map_entry) const {
+    evaluator.updateIfBetter(candidate_entry, target_patch_rect.x, target_patch_rect.y, offset_map_entry);
+}
+
+CandidateEvaluator RandomizedPatchMatch::evaluatorFor(const int scale) const {
+    return specializedEvaluatorFor<0, 0>(scale);
+}
+
+template<int PATCH_SIZE, int CHANNELS>
+BasicCandidateEvaluator<PATCH_SIZE, CHANNELS> RandomizedPatchMatch::specializedEvaluatorFor(const int scale) const {
+    typedef BasicCandidateEvaluator<PATCH_SIZE, CHANNELS> Evaluator;
+    Evaluator evaluator = _compensation.enabled ?
+            Evaluator(*_transformed_sources_pyr[scale], _target_features_pyr[scale], _patch_size, _compensation,
+                      _target_sum_pyr[scale], _target_sqsum_pyr[scale]) :
+            Evaluator(*_transformed_sources_pyr[scale], _target_features_pyr[scale], _patch_size);
+    if (_library != nullptr && scale == 0)
+        evaluator.setSourceLibrary(_library.get(), _library_scale);
+    if (scale == 0)
+        evaluator.setSearchSpace(_search_space.get());
+    evaluator.setBatchSize(_candidate_batch_size);
+    return evaluator;
+}
+
+void RandomizedPatchMatch::setSearchConstraints(const SearchConstraints &constraints) {
+    _search_space = make_shared<SearchSpace>(constraints, *_transformed_sources_pyr[0], _patch_size);
+}
+
+void RandomizedPatchMatch::setSourceLibrary(const shared_ptr<SourceLibrary> &library, int library_scale,
+                                            double primary_prior) {
+    CV_Assert(library->patchSize() == _patch_size && library->gradientWeight() == _lambda);
+    // Random search draws the transformation before the source, so all sources need the same transformations.
+    CV_Assert(library->nrTransformations() == _transformed_sources_pyr[0]->size());
+    _library = library;
+    _library_scale = library_scale;
+    _primary_prior = primary_prior;
+}
+
+void RandomizedPatchMatch::drawActiveSources(RNG &rng) {
+    // Weighted sampling without replacement (Efraimidis and Spirakis): keep the images with the largest u^(1 / prior).
+    vector<std::pair<double, unsigned int>> keys;
+    for (unsigned int i = 0; i < _library->size(); i++) {
+        const double prior = _library->prior(i);
+        if (prior > 0)
+            keys.push_back(std::make_pair(std::pow(rng.uniform(0., 1.), 1 / prior), i));
+    }
+    const size_t nr_active = std::min(keys.size(), MAX_ACTIVE_LIBRARY_IMAGES);
+    std::partial_sort(keys.begin(), keys.begin() + nr_active, keys.end(),
+                      std::greater<std::pair<double, unsigned int>>());
+
+    _active_sources.assign(1, 0);
+    _source_cdf.assign(1, _primary_prior);
+    for (size_t i = 0; i < nr_active; i++) {
+        _active_sources.push_back(keys[i].second + 1);
+        _source_cdf.push_back(_source_cdf.back() + _library->prior(keys[i].second));
+    }
+}
+
+unsigned int RandomizedPatchMatch::sampleSource(RNG &rng) const {
+    const double u = rng.uniform(0., _source_cdf.back());
+    auto sampled = std::upper_bound(_source_cdf.begin(), _source_cdf.end(), u);
+    // Guards against rounding at the upper end.
+    const size_t idx = std::min(static_cast<size_t>(sampled - _source_cdf.begin()), _source_cdf.size() - 1);
+    return _active_sources[idx];
+}
+
+void RandomizedPatchMatch::setGainBiasCompensation(const GainBiasCompensation &compensation) {
+    _compensation = compensation;
+    computeTargetIntegrals();
+}
+
+void RandomizedPatchMatch::computeTargetIntegrals() {
+    _target_sum_pyr.resize(0);
+    _target_sqsum_pyr.resize(0);
+    if (!_compensation.enabled)
         return;
-    const Mat target_patch = _target_pyr[scale](target_patch_rect);
-    float previous_distance = offset_map_entry->distance;
-    float ssd_value = static_cast<float>(ssd_unsafe(candidate_patch, target_patch, previous_distance));
-    if (ssd_value < previous_distance) {
-        offset_map_entry->merge(candidate_entry, ssd_value);
+    for (Mat scaled_target: _target_pyr) {
+        Mat sum, sqsum;
+        integral(scaled_target, sum, sqsum, CV_64F, CV_64F);
+        _target_sum_pyr.push_back(sum);
+        _target_sqsum_pyr.push_back(sqsum);
     }
 }
 
 void RandomizedPatchMatch::setTargetArea(const cv::Mat &new_target_area) {
     _target_updated_count++;
     buildPyramid(new_target_area, _target_pyr, _nr_scales);
-    _target_grad_x_pyr.resize(0);
-    _target_grad_y_pyr.resize(0);
+    _target_features_pyr.resize(0);
     for (Mat scaled_target: _target_pyr) {
-        Mat gx;
-        computeGradientX(scaled_target, gx);
-        _target_grad_x_pyr.push_back(gx);
-        Mat gy;
-        computeGradientY(scaled_target, gy);
-        _target_grad_y_pyr.push_back(gy);
+        Mat features = scaled_target;
+        if (_lambda > 0)
+            interleaveWithGradients(scaled_target, _lambda, features);
+        _target_features_pyr.push_back(features);
     }
+    computeTargetIntegrals();
 }
 
 
-void RandomizedPatchMatch::initializeWithRandomOffsets(const Size &source_size, const int scale,
-                                                       OffsetMap *offset_map, unsigned int random_seed) const {
+template<typename Evaluator>
+void RandomizedPatchMatch::initializeWithRandomOffsets(const Evaluator &evaluator, const Size &source_size,
+                                                       const int scale, OffsetMap *offset_map,
+                                                       unsigned int random_seed) {
     // Seed random generator to have reproducable results.
-    const Mat &target = _target_pyr[scale];
+    const bool constrained = scale == 0 && _search_space->isConstrained();
     srand(random_seed);
     for (int x = 0; x < offset_map->_width; x++) {
         for (int y = 0; y < offset_map->_height; y++) {
-            // Choose offset carefully, so resulting point (when added to current coordinate), is not outside image.
-            int randomX = (rand() % (source_size.width - _patch_size)) - x;
-            int randomY = (rand() % (source_size.height - _patch_size)) - y;
-
             auto entry = offset_map->ptr(y, x);
-            entry->offset = Point(randomX, randomY);
-            entry->rotation_idx = static_cast<unsigned int>(rand() % _source_rotations_pyr[scale].size());
-
-            Rect current_patch_rect(x, y, _patch_size, _patch_size);
-            const Mat target_patch = target(current_patch_rect);
-            const Mat initial_patch = entry->extractFrom(_source_rotations_pyr[scale], x, y, _patch_size);
-            // TODO: use helper for this.
-            entry->distance = static_cast<float>(ssd_unsafe(target_patch, initial_patch));
+            Rect search_box(0, 0, source_size.width - _patch_size, source_size.height - _patch_size);
+            if (constrained) {
+                const Rect allowed_box = _search_space->searchBox(x, y);
+                if (allowed_box.area() > 0)
+                    search_box = allowed_box;
+            }
+            for (int attempt = 0; attempt < MAX_INITIALIZATION_ATTEMPTS; attempt++) {
+                // Choose offset carefully, so resulting point (when added to current coordinate), is not outside
+                // image.
+                int randomX = search_box.x + (rand() % search_box.width) - x;
+                int randomY = search_box.y + (rand() % search_box.height) - y;
+                entry->offset = Point(randomX, randomY);
+                entry->transform_idx = static_cast<unsigned int>(rand() % evaluator.nrTransformations());
+                if (!constrained || _search_space->allows(*entry, x, y))
+                    break;
+            }
+            entry->distance = evaluator.distance(entry, x, y);
         }
     }
 }
@@ -217,33 +441,3 @@ int RandomizedPatchMatch::findNumberScales(const Size &source_size, const Size &
     } else
         return 0;
 }
-
-float RandomizedPatchMatch::patchDistance(const Rect &source_rect, const Rect &target_rect, const int scale,
-                                          const float previous_dist) const {
-    // TODO: reintroduce this helper.
-    /*
-    Mat source_patch = _source_pyr[scale](source_rect);
-    Mat target_patch = _target_pyr[scale](target_rect);
-    double ssd = ssd_unsafe(source_patch, target_patch, previous_dist);
-
-    // Computation can be canceled early if distance is higher than previous distance (or gradients are not used).
-    if (ssd > previous_dist || _lambda == 0)
-        return static_cast<float>(ssd);
-
-    Mat source_grad_x_patch = _source_grad_x_pyr[scale](source_rect);
-    Mat target_grad_x_patch = _target_grad_x_pyr[scale](target_rect);
-    double ssd_grad_x = ssd_unsafe(source_grad_x_patch, target_grad_x_patch);
-    ssd += ssd_grad_x * _lambda;
-
-    if (ssd > previous_dist)
-        return static_cast<float>(ssd);
-
-    Mat source_grad_y_patch = _source_grad_y_pyr[scale](source_rect);
-    Mat target_grad_y_patch = _target_grad_y_pyr[scale](target_rect);
-    double ssd_grad_y = ssd_unsafe(source_grad_y_patch, target_grad_y_patch);
-    ssd += ssd_grad_y * _lambda;
-
-    return static_cast<float>(ssd);
-     */
-    return 0;
-}
@@ -7,6 +7,8 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include "PatchMatchProvider.h"
 #include "../OffsetMap.h"
+#include "../TransformedSources.h"
+#include "CandidateEvaluator.h"
 
 class RandomizedPatchMatch : public PatchMatchProvider {
 
@@ -14,17 +16,33 @@ public:
     /**
      * Constructs all things necessary to execute randomized patch match on the given source image. The target image
      * has to be set via setTargetArea before calling the match() which does the actual patch matching.
-     * Additional to translation, also rotated versions of the image will be inspected.
+     * Additional to translation, also rotated versions of the image will be inspected. Rotated patches are sampled
+     * lazily, so fine rotation steps do not need memory for a full copy of the image per rotation.
+     * Equivalent to the constructor taking SourceTransformations with only rotations set.
      *
      * @param min_rotation the minimal rotation inspected
      * @param max_rotation the maximal rotation inspected
-     * @param rotation_step decides the number of rotations considered. Will construct rotated versions of the image
+     * @param rotation_step decides the number of rotations considered. Will consider rotated versions of the image
      * until min_rotation + i*rotation_step > max_rotation.
      * You are advised to choose min_rotation and rotation_step so that the rotation by 0 degrees is also included.
      */
     RandomizedPatchMatch(const cv::Mat &source, const cv::Size &target_size, int patch_size,
                          float lambda = 0.5f, float min_rotation = -10, float max_rotation = 10,
                          float rotation_step = 5);
+
+    /**
+     * Same as above, but searches all transformations (rotations, scales, reflection) given in 'transformations'.
+     */
+    RandomizedPatchMatch(const cv::Mat &source, const cv::Size &target_size, int patch_size,
+                         const SourceTransformations &transformations, float lambda = 0.5f);
+
+    /**
+     * Same as above, with the transformed sources of every scale given, e.g. shared by several hole fillings of the
+     * same image (see PreparedSource). 'sources_pyr' needs findNumberScales() + 1 levels, further ones are ignored. They
+     * have to be built for 'patch_size' with 'lambda' as gradient weight.
+     */
+    RandomizedPatchMatch(const std::vector<std::shared_ptr<TransformedSources>> &sources_pyr,
+                         const cv::Size &target_size, int patch_size, float lambda = 0.5f);
     std::shared_ptr<OffsetMap> match() override;
 
     /* Finds number of scales. At minimum scale, both source & target should still be larger than 2 * patch_size in
@@ -33,34 +51,113 @@ public:
     int findNumberScales(const cv::Size &source_size, const cv::Size &target_size, int patch_size) const;
 
     void setTargetArea(const cv::Mat &new_target_area);
-    const std::vector<cv::Mat> getSourcesRotated() const { return _source_rotations_pyr[0]; };
-    const cv::Mat &getSourceGradientX() const { return _source_grad_x_pyr[0]; };
-    const cv::Mat &getSourceGradientY() const { return _source_grad_y_pyr[0]; };
+
+    /**
+     * Offsets of 'solution' are tried during the next match() for every target patch, as if it was the result of a
+     * previous match. Useful for seeding with a solution of a similar problem, e.g. the previous frame of a video.
+     * 'solution' must not be larger than the offset map of the target area.
+     */
+    void setInitialSolution(const std::shared_ptr<OffsetMap> &solution) { _previous_solution = solution; }
+
+    /**
+     * Enables or disables gain/bias compensated patch distances, which allow matching across lighting changes.
+     * Disabled by default. The chosen gain and bias are stored in every entry of the resulting offset map.
+     */
+    void setGainBiasCompensation(const GainBiasCompensation &compensation);
+
+    /**
+     * Restricts the candidates on the finest scale, see SearchConstraints. Random search and initialization only sample
+     * where candidates are allowed, all other candidates are rejected without computing their distance.
+     * Without constraints, candidates outside of the (transformed) source are still rejected this way.
+     */
+    void setSearchConstraints(const SearchConstraints &constraints);
+
+    /**
+     * Same as setSearchConstraints(), with a search space built for the transformed sources of the finest scale
+     * already, so its validity bitmaps are shared with other patch matches on the same source.
+     */
+    void setSearchSpace(const std::shared_ptr<const SearchSpace> &search_space) { _search_space = search_space; }
+
+    /**
+     * Additionally searches the images of 'library', downscaled 'library_scale' times, on the finest scale. Every
+     * match draws a few library images in proportion to their priors, random search then picks the source of every
+     * sample among these and the primary source, again in proportion to the priors ('primary_prior' being the one of
+     * the source given in construction). The library has to use the patch size, lambda and number of transformations
+     * of this patch match.
+     */
+    void setSourceLibrary(const std::shared_ptr<SourceLibrary> &library, int library_scale = 0,
+                          double primary_prior = 1);
+    /**
+     * Number of candidates of a target patch evaluated together, see CandidateEvaluator::setBatchSize(). 1 evaluates
+     * them one by one.
+     */
+    void setCandidateBatchSize(int batch_size) {
+        CV_Assert(batch_size >= 1 && batch_size <= CandidateEvaluator::MAX_BATCH_SIZE);
+        _candidate_batch_size = batch_size;
+    }
+
+    /**
+     * The offset map is swept in square tiles of 'tile_size' entries in raster order, column by column within a tile,
+     * so the target and source patches used stay in the cache. 0 sweeps the whole map column by column.
+     */
+    void setSweepTileSize(int tile_size) {
+        CV_Assert(tile_size >= 0);
+        _sweep_tile_size = tile_size;
+    }
+
+    /**
+     * Candidates evaluated by initialization, propagation, random search and the merges of the coarser and the
+     * previous solution on the finest scale of all matches so far.
+     */
+    const EvaluationCounts &statistics() const { return _statistics; }
+
+    std::shared_ptr<const TransformedSources> getTransformedSources() const {
+        return _transformed_sources_pyr[0];
+    };
+
+    /**
+     * Evaluates candidates for target patches at the given scale. Setting it up has a cost, so build it once per scale
+     * and reuse it for all candidates.
+     */
+    CandidateEvaluator evaluatorFor(const int scale) const;
 
     /**
     * Updates 'offset_map_entry' with the given 'candidate_offset' if the patch corresponding to 'candidate_rect' on
-    * 'source_img' is a better match than for the given 'patch'.
+    * 'source_img' is a better match than for the given 'patch'. 'evaluator' is the one of the scale, see evaluatorFor().
     */
-    void updateOffsetMapEntryIfBetter(const cv::Rect &target_patch_rect, const OffsetMapEntry &candidate,
-                                      const int scale, OffsetMapEntry *offset_map_entry) const;
+    void updateOffsetMapEntryIfBetter(const CandidateEvaluator &evaluator, const cv::Rect &target_patch_rect,
+                                      const OffsetMapEntry &candidate, OffsetMapEntry *offset_map_entry) const;
 
 
 private:
+    class ScaleMatcher;
+    template<typename Evaluator> class SweepPolicy;
+
     std::vector<cv::Mat> _target_pyr;
 
     /**
-     * Gradients
+     * Target interleaved with its gradients weighted by '_lambda', same layout as the patches of the sources.
+     * Equal to _target_pyr if '_lambda' is 0.
+     */
+    std::vector<cv::Mat> _target_features_pyr;
+    std::vector<std::shared_ptr<TransformedSources>> _transformed_sources_pyr;
+
+    GainBiasCompensation _compensation;
+    /**
+     * Integral images of the target (sum and squared sum), only computed if gain/bias compensation is enabled.
      */
-    std::vector<cv::Mat> _source_grad_x_pyr, _source_grad_y_pyr, _target_grad_x_pyr, _target_grad_y_pyr;
-    std::vector<std::vector<cv::Mat>> _source_rotations_pyr;
+    std::vector<cv::Mat> _target_sum_pyr, _target_sqsum_pyr;
     const int _patch_size, _max_search_radius;
     // Minimum size image in pyramid is 2x patchSize of lower dimension (or larger).
     const int _nr_scales;
 
     /**
      * Weight of gradient in distance measure, should be in [0, 1]. Default is 0.5.
+     * The distance of two patches is SSD(colors) + lambda * (SSD(gradients x) + SSD(gradients y)).
      */
     const float _lambda;
+    int _candidate_batch_size;
+    int _sweep_tile_size;
 
     /**
      * Used for initializing RNG independently over multiple EM runs.
@@ -68,25 +165,57 @@ private:
     int _target_updated_count = 0;
     std::shared_ptr<OffsetMap> _previous_solution = nullptr;
 
+    /**
+     * Rejects candidates on the finest scale. Its validity bitmaps are built on first use and shared by all matches.
+     */
+    std::shared_ptr<const SearchSpace> _search_space;
+    EvaluationCounts _statistics;
+    std::shared_ptr<SourceLibrary> _library;
+    int _library_scale = 0;
+    double _primary_prior = 1;
+    /**
+     * Sources random search draws from during the current match (see OffsetMapEntry::source_idx), the primary source
+     * first, and their cumulative priors. Empty without library.
+     */
+    std::vector<unsigned int> _active_sources;
+    std::vector<double> _source_cdf;
+
     /* Mainly for debugging, dumps offset map to file. */
     void dumpOffsetMapToFile(cv::Mat &offset_map, cv::String filename_modifier) const;
 
     /*
      * Every entry at offset_map is set to a random & valid (i. e. patch it's pointing to is inside image) offset.
-     * Also the corresponding SSD is computed.
+     * Also the corresponding SSD is computed, by 'evaluator', the one of 'scale'.
+     */
+    template<typename Evaluator>
+    void initializeWithRandomOffsets(const Evaluator &evaluator, const cv::Size &source_size, const int scale,
+                                     OffsetMap *offset_map, unsigned int random_seed = 42);
+
+    /**
+     * Initialization, propagation, random search and merges of one scale into 'offset_map', with all distances
+     * computed for patches of PATCH_SIZE x PATCH_SIZE pixels of CHANNELS floats (see pmutil::dispatchPatchLayout()).
+     */
+    template<int PATCH_SIZE, int CHANNELS>
+    void matchScale(const int scale, const OffsetMap &previous_scale_offset_map, OffsetMap *offset_map,
+                    cv::RNG &rng);
+
+    /**
+     * evaluatorFor() with the patch layout fixed at compile time.
+     */
+    template<int PATCH_SIZE, int CHANNELS>
+    BasicCandidateEvaluator<PATCH_SIZE, CHANNELS> specializedEvaluatorFor(const int scale) const;
+
+    void computeTargetIntegrals();
+
+    /**
+     * Draws the library images random search samples from during one match, in proportion to their priors.
      */
-    void initializeWithRandomOffsets(const cv::Size &source_size, const int scale,
-                                     OffsetMap *offset_map, unsigned int random_seed = 42) const;
+    void drawActiveSources(cv::RNG &rng);
 
     /**
-     * Computes the distance of two patches. Patches have to be the same size on both images.
-     * Uses internally the parameter '_lambda' to weight distance of gradients.
-     * @param source_rect the position of the patch on the source image.
-     * @param target_rect the position of the patch on the target image.
-     * @param scale the scale that the rectangles reference to.
+     * Draws one of the active sources in proportion to its prior.
      */
-    float patchDistance(const cv::Rect &source_rect, const cv::Rect &target_rect, const int scale,
-                        const float previous_dist = INFINITY) const;
+    unsigned int sampleSource(cv::RNG &rng) const;
 };
 
 #endif //PATCHMATCH_RANDOMIZEDPATCHMATCH_H
@@ -0,0 +1,52 @@
+#include "SearchSpace.h"
+
+using cv::Mat;
+using cv::Point;
+using cv::Rect;
+using cv::Size;
+
+SearchSpace::SearchSpace(const SearchConstraints &constraints, const TransformedSources &sources, int patch_size) :
+        _sources(sources), _patch_size(patch_size), _max_distance(constraints.max_distance),
+        _target_origin(constraints.target_origin), _allowed_rects(constraints.allowed_rects),
+        _allowed_labels(constraints.allowed_labels), _constrained(!constraints.empty()),
+        _restricts_box(constraints.max_distance > 0 || !constraints.allowed_labels.empty()),
+        _validity(sources.size()), _validity_once(new std::once_flag[sources.size()]) {
+    const Size size = sources.imageSize();
+    _positions = Rect(0, 0, std::max(size.width - patch_size + 1, 0), std::max(size.height - patch_size + 1, 0));
+
+    // Blocked pixels are the excluded ones and the ones outside of the allowed mask. The border of the transformed
+    // images is added when they are warped.
+    const Rect source_rect(Point(0, 0), sources.sourceSize());
+    _blocked_pixels = Mat::zeros(source_rect.size(), CV_8U);
+    if (!constraints.excluded.empty()) {
+        const Rect region = source_rect & Rect(Point(0, 0), constraints.excluded.size());
+        _blocked_pixels(region).setTo(255, constraints.excluded(region) != 0);
+    }
+    if (!constraints.allowed.empty()) {
+        const Rect region = source_rect & Rect(Point(0, 0), constraints.allowed.size());
+        _blocked_pixels(region).setTo(255, constraints.allowed(region) == 0);
+    }
+}
+
+void SearchSpace::buildValidity(unsigned int idx) const {
+    // Pixels outside of the rotated or scaled source are blocked, too.
+    _validity[idx].reset(new ValidityBitmap(_sources.transformedMask(idx, _blocked_pixels, 255), _patch_size));
+}
+
+Rect SearchSpace::searchBox(const int x, const int y) const {
+    Rect box = _positions;
+    if (_max_distance > 0) {
+        const Point target_in_source(x + _target_origin.x, y + _target_origin.y);
+        box &= Rect(target_in_source - Point(_max_distance, _max_distance),
+                    Size(2 * _max_distance + 1, 2 * _max_distance + 1));
+    }
+    if (!_allowed_labels.empty()) {
+        const int label = _allowed_labels.at<int>(y, x);
+        if (label >= 0) {
+            const Rect &rect = _allowed_rects[label];
+            box &= Rect(rect.x, rect.y, std::max(rect.width - _patch_size + 1, 0),
+                        std::max(rect.height - _patch_size + 1, 0));
+        }
+    }
+    return box;
+}
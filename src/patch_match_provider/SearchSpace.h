@@ -0,0 +1,123 @@
+#ifndef PATCHMATCH_SEARCHSPACE_H
+#define PATCHMATCH_SEARCHSPACE_H
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "../OffsetMap.h"
+#include "../TransformedSources.h"
+#include "ValidityBitmap.h"
+
+/**
+ * Restricts which source patches a target patch may be matched to. All members are optional, default constructed
+ * constraints allow everything. Only apply to the primary source (source_idx 0), not to library images.
+ */
+struct SearchConstraints {
+    // Source pixels (CV_8U, non-zero) no candidate patch may overlap, e.g. the hole.
+    cv::Mat excluded;
+    // Source pixels (CV_8U, non-zero) candidate patches have to lie in. Empty allows the whole source.
+    cv::Mat allowed;
+    // Per target patch allowed source regions: the target patch with top left (x, y) may only match source patches
+    // inside allowed_rects[allowed_labels(y, x)]. allowed_labels is CV_32S with the size of the offset map, negative
+    // labels (or empty labels) allow the whole source.
+    std::vector<cv::Rect> allowed_rects;
+    cv::Mat allowed_labels;
+    // Source patches have to lie within this distance (in both x and y) of the position of the target patch in the
+    // source. 0 for no limit.
+    int max_distance = 0;
+    // Position of the target area in the source, only needed for max_distance.
+    cv::Point target_origin;
+
+    bool empty() const {
+        return excluded.empty() && allowed.empty() && allowed_labels.empty() && max_distance <= 0;
+    }
+};
+
+/**
+ * SearchConstraints prepared for rejecting candidates in constant time, before any pixel is touched, and for
+ * sampling candidates only where they are allowed.
+ *
+ * For every transformation, a ValidityBitmap tells which patches of the transformed image are fully inside of it,
+ * only consist of pixels warped from inside the source (no corners of rotated images) and do not overlap a blocked
+ * (excluded or not allowed) pixel. Bitmaps are built on the first request for a transformation and shared by all
+ * users of the search space. The allowed rects and the maximum distance are checked at the top left of untransformed
+ * patches, or at the center of transformed patches mapped back to the source.
+ */
+class SearchSpace {
+
+public:
+    SearchSpace(const SearchConstraints &constraints, const TransformedSources &sources, int patch_size);
+
+    /**
+     * False if 'candidate' must not be used for the target patch with top left (x, y).
+     */
+    bool allows(const OffsetMapEntry &candidate, const int x, const int y) const {
+        if (candidate.source_idx != 0)
+            return true;
+        const cv::Point top_left(x + candidate.offset.x, y + candidate.offset.y);
+        if (!validity(candidate.transform_idx).isValid(top_left.x, top_left.y))
+            return false;
+        if (!_restricts_box)
+            return true;
+        if (_sources.isIdentity(candidate.transform_idx))
+            return inBox(top_left, x, y);
+        const float half = (_patch_size - 1) / 2.f;
+        const cv::Point2f center = _sources.sourcePosition(candidate.transform_idx,
+                                                           cv::Point2f(top_left.x + half, top_left.y + half));
+        return inBox(cv::Point(cvRound(center.x - half), cvRound(center.y - half)), x, y);
+    }
+
+    /**
+     * Top left positions of source patches that may be matched to the target patch with top left (x, y), as far as
+     * the allowed rect and the maximum distance restrict them. Might be empty.
+     */
+    cv::Rect searchBox(const int x, const int y) const;
+
+    /**
+     * False if the constraints were empty, i. e. only patches outside of the transformed images are rejected.
+     */
+    bool isConstrained() const { return _constrained; }
+
+    /**
+     * The validity of all patches of the transformed image with index 'idx'.
+     */
+    const ValidityBitmap &validity(unsigned int idx) const {
+        std::call_once(_validity_once[idx], [this, idx] { buildValidity(idx); });
+        return *_validity[idx];
+    }
+
+private:
+    const TransformedSources &_sources;
+    const int _patch_size;
+    const int _max_distance;
+    const cv::Point _target_origin;
+    const std::vector<cv::Rect> _allowed_rects;
+    const cv::Mat _allowed_labels;
+    const bool _constrained, _restricts_box;
+    // Top left positions of all patches inside the source.
+    cv::Rect _positions;
+    // Non-zero at source pixels no patch may overlap.
+    cv::Mat _blocked_pixels;
+
+    mutable std::vector<std::unique_ptr<const ValidityBitmap>> _validity;
+    mutable std::unique_ptr<std::once_flag[]> _validity_once;
+
+    void buildValidity(unsigned int idx) const;
+
+    bool inBox(const cv::Point &top_left, const int x, const int y) const {
+        if (_max_distance > 0 && (std::abs(top_left.x - x - _target_origin.x) > _max_distance ||
+                                  std::abs(top_left.y - y - _target_origin.y) > _max_distance))
+            return false;
+        if (_allowed_labels.empty())
+            return true;
+        const int label = _allowed_labels.at<int>(y, x);
+        if (label < 0)
+            return true;
+        const cv::Rect &rect = _allowed_rects[label];
+        return top_left.x >= rect.x && top_left.y >= rect.y && top_left.x + _patch_size <= rect.x + rect.width &&
+               top_left.y + _patch_size <= rect.y + rect.height;
+    }
+};
+
+#endif //PATCHMATCH_SEARCHSPACE_H
@@ -0,0 +1,333 @@
+#include "SpaceTimePatchMatch.h"
+#include "CandidateEvaluator.h"
+#include "PatchMatchSweep.h"
+#include "../ThreadPool.h"
+#include "../util.h"
+
+using cv::Mat;
+using cv::Point;
+using cv::Range;
+using cv::Rect;
+using cv::RNG;
+using cv::Size;
+using pmutil::interleaveWithGradients;
+using std::make_shared;
+using std::max;
+using std::min;
+using std::vector;
+
+/**
+ * Strips are at least this many columns wide, narrower ones would lose too much spatial propagation.
+ */
+constexpr int MIN_STRIP_WIDTH = 16;
+/**
+ * Number of tasks (strips over all frames of a phase) aimed for per thread, for load balancing. Default: 4.
+ */
+constexpr int TASKS_PER_THREAD = 4;
+/**
+ * If true, offsets are propagated from the previous and next frame. Else, frames are only coupled through the
+ * temporal extent of the patches. Default: true.
+ */
+constexpr bool TEMPORAL_PROPAGATION = true;
+constexpr float ALPHA = 0.5; // Used to modify random search radius. Higher alpha means more random searches.
+
+/**
+ * The offset map of frame t for sweepEntries(), with the entries of the neighboring frames as further propagated
+ * candidates. All maps are flipped alike, so (x, y) is the same position in them.
+ */
+template<typename Evaluator>
+class SpaceTimePatchMatch::SweepPolicy {
+public:
+    typedef SpaceTimeEntry Entry;
+    static constexpr int MAX_FURTHER_PROPAGATED = 2;
+
+    SweepPolicy(SpaceTimePatchMatch &stpm, const vector<Evaluator> &evaluators, const long t)
+            : _stpm(stpm), _evaluators(evaluators), _t(t), _offset_map(stpm._offsets.frame(t)) { }
+
+    int width() const { return _offset_map._width; }
+    int height() const { return _offset_map._height; }
+    bool isFlipped() const { return _offset_map.isFlipped(); }
+    Entry at(const int y, const int x) const { return _stpm._offsets.at(_t, y, x); }
+    void prefetch(const int, const int, const Point &) const { }
+
+    int furtherPropagated(const int y, const int x, Entry *candidates) const {
+        int count = 0;
+        if (TEMPORAL_PROPAGATION) {
+            // The matches of the neighboring frames, moved along in time.
+            if (_stpm._offsets.contains(_t - 1))
+                candidates[count++] = _stpm._offsets.at(_t - 1, y, x);
+            if (_stpm._offsets.contains(_t + 1))
+                candidates[count++] = _stpm._offsets.at(_t + 1, y, x);
+        }
+        return count;
+    }
+
+    void updateIfBetter(const Entry *candidates, const int count, const int y, const int x, const Point &target) {
+        Entry entry = at(y, x);
+        bool updated = false;
+        for (int i = 0; i < count; i++) {
+            Entry evaluated = candidates[i];
+            const float candidate_distance = _stpm.distance(_evaluators, &evaluated, target.x, target.y, _t,
+                                                            entry.distance);
+            if (candidate_distance < entry.distance) {
+                entry = evaluated;
+                entry.distance = candidate_distance;
+                updated = true;
+            }
+        }
+        if (updated)
+            _stpm._offsets.set(_t, y, x, entry);
+    }
+
+    void randomCandidates(const int y, const int x, const Point &, RNG &rng, vector<Entry> *candidates) const {
+        // Random search around the current match, in space and time.
+        const Entry current = at(y, x);
+        const long first = _stpm._offsets.firstFrame();
+        const long last = _stpm._offsets.endFrame() - 1;
+        const int nr_transformations = static_cast<int>(_stpm.frameAt(_t).sources->size());
+        float search_radius = max(_stpm._source_size.width, _stpm._source_size.height);
+        float temporal_search_radius = static_cast<float>(_stpm._offsets.nrFrames());
+        while (search_radius > 1) {
+            Entry random;
+            random.offset = current.offset + Point(cvRound(rng.uniform(-1.f, 1.f) * search_radius),
+                                                   cvRound(rng.uniform(-1.f, 1.f) * search_radius));
+            const int frame_offset = current.frame_offset + cvRound(rng.uniform(-1.f, 1.f) * temporal_search_radius);
+            random.frame_offset = static_cast<int>(min(max(_t + frame_offset, first), last) - _t);
+            random.transform_idx = static_cast<unsigned int>(rng.uniform(0, nr_transformations));
+            candidates->push_back(random);
+
+            search_radius *= ALPHA;
+            temporal_search_radius *= ALPHA;
+        }
+    }
+
+private:
+    SpaceTimePatchMatch &_stpm;
+    const vector<Evaluator> &_evaluators;
+    const long _t;
+    const OffsetMap &_offset_map;
+};
+
+template<typename Evaluator>
+class SpaceTimePatchMatch::ParallelSweep : public cv::ParallelLoopBody {
+
+private:
+    SpaceTimePatchMatch &_stpm;
+    const vector<Evaluator> &_evaluators;
+    const vector<long> &_frames;
+    const int _nr_strips;
+    const uint64_t _seed;
+
+public:
+    ParallelSweep(SpaceTimePatchMatch &stpm, const vector<Evaluator> &evaluators, const vector<long> &frames,
+                  int nr_strips, uint64_t seed) :
+            _stpm(stpm), _evaluators(evaluators), _frames(frames), _nr_strips(nr_strips), _seed(seed) { }
+
+    virtual void operator()(const Range &range) const override {
+        const int width = _stpm._offsets._width;
+        // Evaluators count their evaluations, so every thread needs its own copies.
+        const vector<Evaluator> evaluators = _evaluators;
+        vector<SpaceTimeEntry> random_candidates;
+        for (int task = range.start; task < range.end; task++) {
+            const long t = _frames[task / _nr_strips];
+            const int strip = task % _nr_strips;
+            const int x_begin = strip * width / _nr_strips;
+            const int x_end = (strip + 1) * width / _nr_strips;
+            // Every task has its own generator, so results do not depend on the scheduling.
+            RNG rng(_seed * 7919 + static_cast<uint64_t>(task) + 1);
+            // Spatial propagation only within the strip, as the neighboring strips are swept concurrently.
+            SweepPolicy<Evaluator> policy(_stpm, evaluators, t);
+            sweepEntries(policy, Rect(x_begin, 0, x_end - x_begin, policy.height()), x_begin, rng,
+                         &random_candidates);
+        }
+    }
+};
+
+/**
+ * Recomputes the distances of all entries of the given frames.
+ */
+template<typename Evaluator>
+class SpaceTimePatchMatch::ParallelDistanceUpdate : public cv::ParallelLoopBody {
+
+private:
+    SpaceTimePatchMatch &_stpm;
+    const vector<Evaluator> &_evaluators;
+
+public:
+    ParallelDistanceUpdate(SpaceTimePatchMatch &stpm, const vector<Evaluator> &evaluators) :
+            _stpm(stpm), _evaluators(evaluators) { }
+
+    virtual void operator()(const Range &range) const override {
+        const vector<Evaluator> evaluators = _evaluators;
+        for (long t = range.start; t < range.end; t++) {
+            OffsetVolume &offsets = _stpm._offsets;
+            for (int x = 0; x < offsets._width; x++) {
+                for (int y = 0; y < offsets._height; y++) {
+                    SpaceTimeEntry entry = offsets.at(t, y, x);
+                    entry.distance = _stpm.distance(evaluators, &entry, x, y, t);
+                    offsets.set(t, y, x, entry);
+                }
+            }
+        }
+    }
+};
+
+/**
+ * Runs matchLayout() for the patch layout chosen by pmutil::dispatchPatchLayout().
+ */
+class SpaceTimePatchMatch::LayoutMatcher {
+public:
+    explicit LayoutMatcher(SpaceTimePatchMatch &stpm) : _stpm(stpm) { }
+
+    template<int PATCH_SIZE, int CHANNELS>
+    void run() {
+        _stpm.matchLayout<PATCH_SIZE, CHANNELS>();
+    }
+
+private:
+    SpaceTimePatchMatch &_stpm;
+};
+
+SpaceTimePatchMatch::SpaceTimePatchMatch(const Size &source_size, const Size &target_size, int patch_size,
+                                         int temporal_radius, size_t window_size,
+                                         const SourceTransformations &transformations, float lambda,
+                                         int iterations) :
+        _source_size(source_size), _target_size(target_size), _patch_size(patch_size),
+        _temporal_radius(temporal_radius), _iterations(iterations), _transformations(transformations),
+        _lambda(lambda),
+        _offsets(target_size.width - patch_size + 1, target_size.height - patch_size + 1, window_size) {
+    CV_Assert(temporal_radius >= 0 && window_size >= static_cast<size_t>(2 * temporal_radius + 1));
+}
+
+void SpaceTimePatchMatch::pushFrame(const Mat &source, const Mat &target_area) {
+    CV_Assert(source.size() == _source_size && target_area.size() == _target_size);
+    if (_frames.size() == _offsets.maxFrames())
+        _frames.pop_front();
+    ResidentFrame frame;
+    frame.sources = make_shared<TransformedSources>(source, _transformations, _patch_size, 0,
+                                                    TransformedSources::DEFAULT_MAX_CACHED_TILES, _lambda);
+    frame.target_features = features(target_area);
+    _frames.push_back(frame);
+
+    const long t = _offsets.endFrame();
+    const bool has_previous = _offsets.nrFrames() > 0;
+    _offsets.push();
+    if (has_previous) {
+        // Temporal coherence: start with the matches of the previous frame, moved along in time.
+        for (int x = 0; x < _offsets._width; x++) {
+            for (int y = 0; y < _offsets._height; y++)
+                _offsets.set(t, y, x, _offsets.at(t - 1, y, x));
+        }
+    } else {
+        initializeWithRandomOffsets(t, static_cast<unsigned int>(42 + t));
+    }
+}
+
+void SpaceTimePatchMatch::setTargetArea(const long frame, const Mat &target_area) {
+    CV_Assert(_offsets.contains(frame) && target_area.size() == _target_size);
+    _frames[frame - _offsets.firstFrame()].target_features = features(target_area);
+}
+
+const OffsetVolume &SpaceTimePatchMatch::match() {
+    _match_count++;
+    if (_frames.empty())
+        return _offsets;
+    // The distances are compiled for the patch layout, which is chosen once here instead of per patch.
+    LayoutMatcher layout_matcher(*this);
+    pmutil::dispatchPatchLayout(_patch_size, _frames.front().target_features.channels(), layout_matcher);
+    return _offsets;
+}
+
+template<int PATCH_SIZE, int CHANNELS>
+void SpaceTimePatchMatch::matchLayout() {
+    typedef BasicCandidateEvaluator<PATCH_SIZE, CHANNELS> Evaluator;
+    const long first = _offsets.firstFrame();
+    const long end = _offsets.endFrame();
+    const vector<Evaluator> evaluators = sliceEvaluators<Evaluator>();
+
+    // Distances depend on the neighboring frames, which might have changed since the last match.
+    ParallelDistanceUpdate<Evaluator> pdu(*this, evaluators);
+    ThreadPool::current().parallelFor(Range(static_cast<int>(first), static_cast<int>(end)), pdu);
+
+    for (int i = 0; i < _iterations; i++) {
+        // Frames of one parity only read the offset maps of the other one.
+        for (int parity = 0; parity < 2; parity++) {
+            vector<long> phase_frames;
+            for (long t = first + parity; t < end; t += 2)
+                phase_frames.push_back(t);
+            if (phase_frames.empty())
+                continue;
+            const int nr_strips = computeNrStrips(phase_frames.size());
+            const uint64_t seed = static_cast<uint64_t>((_match_count * _iterations + i) * 2 + parity);
+            ParallelSweep<Evaluator> sweep(*this, evaluators, phase_frames, nr_strips, seed);
+            ThreadPool::current().parallelFor(Range(0, static_cast<int>(phase_frames.size()) * nr_strips), sweep);
+        }
+        // Every second iteration, we go the other way round (start at bottom, propagate from right and down).
+        for (long t = first; t < end; t++)
+            _offsets.flip(t);
+    }
+    for (long t = first; t < end; t++) {
+        if (_offsets.frame(t).isFlipped())
+            _offsets.flip(t);
+    }
+}
+
+template<typename Evaluator>
+vector<Evaluator> SpaceTimePatchMatch::sliceEvaluators() const {
+    vector<Evaluator> evaluators;
+    for (long target_t = _offsets.firstFrame(); target_t < _offsets.endFrame(); target_t++) {
+        for (long source_t = _offsets.firstFrame(); source_t < _offsets.endFrame(); source_t++)
+            evaluators.push_back(Evaluator(*frameAt(source_t).sources, frameAt(target_t).target_features,
+                                           _patch_size));
+    }
+    return evaluators;
+}
+
+template<typename Evaluator>
+float SpaceTimePatchMatch::distance(const vector<Evaluator> &evaluators, SpaceTimeEntry *candidate, const int x,
+                                    const int y, const long t, const float limit) const {
+    const long first = _offsets.firstFrame();
+    const long nr_frames = static_cast<long>(_offsets.nrFrames());
+    const long source_t = t + candidate->frame_offset;
+    float sum = 0;
+    for (int k = -_temporal_radius; k <= _temporal_radius; k++) {
+        if (!_offsets.contains(t + k))
+            continue;
+        if (!_offsets.contains(source_t + k))
+            return INFINITY;
+        const Evaluator &evaluator = evaluators[(t + k - first) * nr_frames + source_t + k - first];
+        sum += evaluator.distance(candidate, x, y, limit - sum);
+        if (sum > limit)
+            return sum;
+    }
+    return sum;
+}
+
+Mat SpaceTimePatchMatch::features(const Mat &target_area) const {
+    Mat target_features = target_area;
+    if (_lambda > 0)
+        interleaveWithGradients(target_area, _lambda, target_features);
+    return target_features;
+}
+
+void SpaceTimePatchMatch::initializeWithRandomOffsets(const long frame, unsigned int random_seed) {
+    OffsetMap &offset_map = _offsets.frame(frame);
+    const int nr_transformations = static_cast<int>(frameAt(frame).sources->size());
+    RNG rng(random_seed);
+    for (int x = 0; x < offset_map._width; x++) {
+        for (int y = 0; y < offset_map._height; y++) {
+            // Choose offset carefully, so resulting point (when added to current coordinate), is not outside image.
+            OffsetMapEntry *entry = offset_map.ptr(y, x);
+            entry->offset = Point(rng.uniform(0, _source_size.width - _patch_size + 1) - x,
+                                  rng.uniform(0, _source_size.height - _patch_size + 1) - y);
+            entry->transform_idx = static_cast<unsigned int>(rng.uniform(0, nr_transformations));
+            entry->distance = INFINITY;
+        }
+    }
+}
+
+int SpaceTimePatchMatch::computeNrStrips(const size_t nr_frames) const {
+    const int wanted_tasks = TASKS_PER_THREAD * ThreadPool::current().nrThreads();
+    const int wanted_strips = (wanted_tasks + static_cast<int>(nr_frames) - 1) / static_cast<int>(nr_frames);
+    return max(1, min(wanted_strips, _offsets._width / MIN_STRIP_WIDTH));
+}
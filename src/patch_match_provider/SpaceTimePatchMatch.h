@@ -0,0 +1,122 @@
+// Randomized patch match over space-time patches of a video, following
+// Space-Time Video Completion by Wexler et al. and the video extension of
+// PatchMatch: A Randomized Correspondence Algorithm for Structural Image Editing by Barnes et al.
+#ifndef PATCHMATCH_SPACETIMEPATCHMATCH_H
+#define PATCHMATCH_SPACETIMEPATCHMATCH_H
+
+#include <deque>
+#include <memory>
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "../OffsetVolume.h"
+#include "../TransformedSources.h"
+
+/**
+ * Finds nearest neighbors for space-time patches (patch_size x patch_size x (2 * temporal_radius + 1)) of a sliding
+ * window of frames. An entry of frame t with offset o and frame offset dt matches the target patches of the frames
+ * t + k with the source patches of the frames t + dt + k at offset o, for all k in [-temporal_radius, temporal_radius]
+ * whose target frame is resident.
+ *
+ * Additionally to spatial propagation and random search, offsets are propagated in time from the previous and the
+ * next frame. Only 'window_size' frames (sources, targets and offset maps) are resident at once: Frames are appended
+ * with pushFrame and the oldest one is dropped when the window is full. The offset maps of the frames still resident
+ * are kept, so every match() continues from the previous solution.
+ *
+ * Frames of even and odd index are swept alternately, so temporal propagation never reads an offset map that is
+ * written concurrently. Within one phase, every frame is split into strips of columns, which are swept in parallel
+ * with the sweep of RandomizedPatchMatch (see sweepEntries()).
+ * With temporal_radius 0 and a window of one frame this is the 2D randomized patch match.
+ */
+class SpaceTimePatchMatch {
+
+public:
+    static constexpr int DEFAULT_ITERATIONS = 5;
+
+    /**
+     * @param source_size size of the source of every frame.
+     * @param target_size size of the target area of every frame.
+     * @param patch_size spatial size of the patches.
+     * @param temporal_radius patches of frame t span the frames t - temporal_radius to t + temporal_radius.
+     * @param window_size maximum number of resident frames, at least 2 * temporal_radius + 1.
+     * @param transformations transformations of the sources searched additionally to translation.
+     * @param lambda weight of the gradients in the patch distance, see RandomizedPatchMatch.
+     * @param iterations number of sweeps over all resident frames per match().
+     */
+    SpaceTimePatchMatch(const cv::Size &source_size, const cv::Size &target_size, int patch_size,
+                        int temporal_radius, size_t window_size,
+                        const SourceTransformations &transformations = SourceTransformations::rotationsOnly(0, 0, 1),
+                        float lambda = 0.5f, int iterations = DEFAULT_ITERATIONS);
+
+    /**
+     * Appends the next frame, dropping the oldest one if the window is full. The offsets of the new frame start as
+     * the ones of the previous frame, or random ones for the first frame.
+     */
+    void pushFrame(const cv::Mat &source, const cv::Mat &target_area);
+
+    /**
+     * Replaces the target area of a resident frame, e.g. after a reconstruction step.
+     */
+    void setTargetArea(const long frame, const cv::Mat &target_area);
+
+    /**
+     * Improves the offsets of all resident frames.
+     */
+    const OffsetVolume &match();
+
+    const OffsetVolume &offsets() const { return _offsets; }
+
+    std::shared_ptr<const TransformedSources> getTransformedSources(const long frame) const {
+        return _frames[frame - _offsets.firstFrame()].sources;
+    }
+
+private:
+    class LayoutMatcher;
+    template<typename Evaluator> class SweepPolicy;
+    template<typename Evaluator> class ParallelSweep;
+    template<typename Evaluator> class ParallelDistanceUpdate;
+
+    struct ResidentFrame {
+        std::shared_ptr<TransformedSources> sources;
+        // Target interleaved with its weighted gradients, same layout as the patches of the sources.
+        cv::Mat target_features;
+    };
+
+    const cv::Size _source_size, _target_size;
+    const int _patch_size, _temporal_radius, _iterations;
+    const SourceTransformations _transformations;
+    const float _lambda;
+    std::deque<ResidentFrame> _frames;
+    OffsetVolume _offsets;
+    int _match_count = 0;
+
+    const ResidentFrame &frameAt(const long frame) const { return _frames[frame - _offsets.firstFrame()]; }
+    cv::Mat features(const cv::Mat &target_area) const;
+    void initializeWithRandomOffsets(const long frame, unsigned int random_seed);
+    int computeNrStrips(const size_t nr_frames) const;
+
+    /**
+     * match() with all distances computed for patches of PATCH_SIZE x PATCH_SIZE pixels of CHANNELS floats (see
+     * pmutil::dispatchPatchLayout()).
+     */
+    template<int PATCH_SIZE, int CHANNELS>
+    void matchLayout();
+
+    /**
+     * Evaluators of the resident frames, the one comparing the target of frame u with the sources of frame v at
+     * (u - firstFrame()) * nrFrames() + v - firstFrame(). They only change with the resident frames, so they are built
+     * once per match().
+     */
+    template<typename Evaluator>
+    std::vector<Evaluator> sliceEvaluators() const;
+
+    /**
+     * Space-time distance of 'candidate' for the target patch with top left (x, y) in frame t, summed over the
+     * slices by 'evaluators' (see sliceEvaluators()). Infinity if a source frame needed is not resident or the
+     * candidate patch is not inside the source. Stops early once 'limit' is exceeded.
+     */
+    template<typename Evaluator>
+    float distance(const std::vector<Evaluator> &evaluators, SpaceTimeEntry *candidate, const int x, const int y,
+                   const long t, const float limit = INFINITY) const;
+};
+
+#endif //PATCHMATCH_SPACETIMEPATCHMATCH_H
@@ -0,0 +1,31 @@
+#include "ValidityBitmap.h"
+
+using cv::integral;
+using cv::Mat;
+
+ValidityBitmap::ValidityBitmap(const Mat &blocked, int patch_size) :
+        _width(std::max(blocked.cols - patch_size + 1, 0)), _height(std::max(blocked.rows - patch_size + 1, 0)),
+        _words_per_row((_width + 63) / 64), _words(static_cast<size_t>(_words_per_row) * _height, 0) {
+    CV_Assert(blocked.type() == CV_8U);
+    // A patch is valid if the number of blocked pixels below it is zero.
+    Mat nonzero;
+    cv::min(blocked, 1, nonzero);
+    Mat sum;
+    integral(nonzero, sum, CV_32S);
+    for (int y = 0; y < _height; y++) {
+        const int *top = sum.ptr<int>(y);
+        const int *bottom = sum.ptr<int>(y + patch_size);
+        uint64_t *row = &_words[static_cast<size_t>(y) * _words_per_row];
+        for (int x = 0; x < _width; x++) {
+            if (bottom[x + patch_size] - bottom[x] - top[x + patch_size] + top[x] == 0)
+                row[x >> 6] |= uint64_t(1) << (x & 63);
+        }
+    }
+}
+
+size_t ValidityBitmap::count() const {
+    size_t valid = 0;
+    for (uint64_t word: _words)
+        valid += static_cast<size_t>(__builtin_popcountll(word));
+    return valid;
+}
@@ -0,0 +1,42 @@
+#ifndef PATCHMATCH_VALIDITYBITMAP_H
+#define PATCHMATCH_VALIDITYBITMAP_H
+
+#include <cstdint>
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+
+/**
+ * One bit per top left position of a patch in an image, set if the patch is fully inside the image and does not
+ * overlap any blocked pixel. Positions outside of the bitmap are invalid, so a single lookup replaces bounds checks.
+ * Rows are padded to full 64 bit words, a 1000 x 1000 image takes about 125 KB.
+ */
+class ValidityBitmap {
+
+public:
+    /**
+     * @param blocked CV_8U, non-zero for pixels no patch may overlap.
+     * @param patch_size the size of the patches.
+     */
+    ValidityBitmap(const cv::Mat &blocked, int patch_size);
+
+    bool isValid(const int x, const int y) const {
+        if (static_cast<unsigned int>(x) >= static_cast<unsigned int>(_width) ||
+                static_cast<unsigned int>(y) >= static_cast<unsigned int>(_height))
+            return false;
+        return (_words[y * _words_per_row + (x >> 6)] >> (x & 63)) & 1;
+    }
+
+    int width() const { return _width; }
+    int height() const { return _height; }
+
+    /**
+     * Number of valid positions.
+     */
+    size_t count() const;
+
+private:
+    int _width, _height, _words_per_row;
+    std::vector<uint64_t> _words;
+};
+
+#endif //PATCHMATCH_VALIDITYBITMAP_H
@@ -9,6 +9,7 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <vector>
+#include "LabPyramid.h"
 
 namespace pmutil {
 
@@ -68,6 +69,187 @@ namespace pmutil {
 		return ssd;
 	}
 
+    /**
+     * Same as ssd_unsafe for 'count' patches against one 'target' (all float and of the same size), but the patches are
+     * processed together row by row, so every row of the target is loaded once for all of them. A patch is dropped
+     * once its sum reaches 'limit', its result is then at least 'limit'. The sums are the ones ssd_unsafe computes.
+     */
+    static void ssd_batch_unsafe(const Mat &target, const Mat *patches, int count, double limit, double *ssds) {
+        const int length = target.cols * target.channels();
+        int nr_active = count;
+        for (int k = 0; k < count; k++)
+            ssds[k] = 0;
+        for (int i = 0; i < target.rows && nr_active > 0; i++) {
+            const float *t = target.ptr<const float>(i);
+            for (int k = 0; k < count; k++) {
+                double ssd = ssds[k];
+                if (ssd >= limit)
+                    continue;
+                const float *p = patches[k].ptr<const float>(i);
+                for (int j = 0; j < length; j++) {
+                    float diff = p[j] - t[j];
+                    ssd += diff * diff;
+                }
+                ssds[k] = ssd;
+                if (ssd >= limit)
+                    nr_active--;
+            }
+        }
+    }
+
+    /**
+     * Sum of squared differences of LENGTH floats. The sum is split into four independent partial sums, so the loop,
+     * unrolled completely for a compile time LENGTH, maps to vector instructions without reordering a single sum.
+     */
+    template<int LENGTH>
+    static inline float ssd_row_fixed(const float *p, const float *t) {
+        float sums[4] = {0, 0, 0, 0};
+        for (int j = 0; j < LENGTH; j++) {
+            const float diff = p[j] - t[j];
+            sums[j % 4] += diff * diff;
+        }
+        return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+    }
+
+    /**
+     * ssd_unsafe for patches of SIZE x SIZE pixels of CHANNELS floats, with all loop bounds known at compile time.
+     * Rows are summed by ssd_row_fixed, so the result may differ from ssd_unsafe by rounding. Stops after the first row
+     * reaching 'limit'.
+     */
+    template<int SIZE, int CHANNELS>
+    static double ssd_fixed_unsafe(const Mat &img, const Mat &img2, double limit) {
+        double ssd = 0;
+        for (int i = 0; i < SIZE; i++) {
+            ssd += ssd_row_fixed<SIZE * CHANNELS>(img.ptr<const float>(i), img2.ptr<const float>(i));
+            if (ssd >= limit)
+                return ssd;
+        }
+        return ssd;
+    }
+
+    /**
+     * ssd_batch_unsafe for patches of SIZE x SIZE pixels of CHANNELS floats, with the sums of ssd_fixed_unsafe.
+     */
+    template<int SIZE, int CHANNELS>
+    static void ssd_batch_fixed_unsafe(const Mat &target, const Mat *patches, int count, double limit, double *ssds) {
+        int nr_active = count;
+        for (int k = 0; k < count; k++)
+            ssds[k] = 0;
+        for (int i = 0; i < SIZE && nr_active > 0; i++) {
+            const float *t = target.ptr<const float>(i);
+            for (int k = 0; k < count; k++) {
+                if (ssds[k] >= limit)
+                    continue;
+                ssds[k] += ssd_row_fixed<SIZE * CHANNELS>(patches[k].ptr<const float>(i), t);
+                if (ssds[k] >= limit)
+                    nr_active--;
+            }
+        }
+    }
+
+    /**
+     * The distances of float patches of SIZE x SIZE pixels of CHANNELS floats, see ssd_fixed_unsafe. Called as static
+     * members of a template parameter, so they are inlined into the loops scoring patches. PatchSsd<0, 0> is the
+     * generic version for any patch size and number of channels.
+     */
+    template<int SIZE, int CHANNELS>
+    struct PatchSsd {
+        static double ssd(const Mat &img, const Mat &img2, double limit) {
+            return ssd_fixed_unsafe<SIZE, CHANNELS>(img, img2, limit);
+        }
+
+        static void batch(const Mat &target, const Mat *patches, int count, double limit, double *ssds) {
+            ssd_batch_fixed_unsafe<SIZE, CHANNELS>(target, patches, count, limit, ssds);
+        }
+    };
+
+    template<>
+    struct PatchSsd<0, 0> {
+        static double ssd(const Mat &img, const Mat &img2, double limit) {
+            return ssd_unsafe(img, img2, limit);
+        }
+
+        static void batch(const Mat &target, const Mat *patches, int count, double limit, double *ssds) {
+            ssd_batch_unsafe(target, patches, count, limit, ssds);
+        }
+    };
+
+    template<int CHANNELS, typename Functor>
+    static void dispatchPatchSize(int patch_size, Functor &functor) {
+        switch (patch_size) {
+            case 5:
+                functor.template run<5, CHANNELS>();
+                break;
+            case 7:
+                functor.template run<7, CHANNELS>();
+                break;
+            case 9:
+                functor.template run<9, CHANNELS>();
+                break;
+            default:
+                functor.template run<0, 0>();
+                break;
+        }
+    }
+
+    /**
+     * Calls 'functor.template run<SIZE, CHANNELS>()' with the compile time patch layout for 'patch_size' and
+     * 'channels': patch sizes 5, 7 and 9 with 1, 3 (colors) or 9 (colors interleaved with gradients) channels, else
+     * <0, 0> for the generic code. Called once before a loop over many patches, so the loop is compiled for the layout
+     * and its distance computations (see PatchSsd) are inlined, instead of calling through a pointer per patch.
+     */
+    template<typename Functor>
+    static void dispatchPatchLayout(int patch_size, int channels, Functor &functor) {
+        switch (channels) {
+            case 1:
+                dispatchPatchSize<1>(patch_size, functor);
+                break;
+            case 3:
+                dispatchPatchSize<3>(patch_size, functor);
+                break;
+            case 9:
+                dispatchPatchSize<9>(patch_size, functor);
+                break;
+            default:
+                functor.template run<0, 0>();
+                break;
+        }
+    }
+
+    /**
+     * Same as ssd_unsafe, but 'img' is compensated per channel by gain and bias first, i. e. computes the sum of
+     * squared differences of gain * img + bias and img2. Costs one multiply-add more per value than ssd_unsafe.
+     * The first 'color_channels' (at most three) channels are colors, every further channel is assumed to be a
+     * gradient of the color channel (c modulo color_channels), which is only affected by gain.
+     */
+    static double ssd_gain_bias_unsafe(const Mat &img, const Mat &img2, const Vec3f &gain, const Vec3f &bias,
+                                       int color_channels, double limit = INFINITY) {
+        constexpr int MAX_CHANNELS = 9;
+        const int cn = img.channels();
+        CV_Assert(cn <= MAX_CHANNELS && color_channels <= 3);
+        float channel_gain[MAX_CHANNELS], channel_bias[MAX_CHANNELS];
+        for (int c = 0; c < cn; c++) {
+            channel_gain[c] = gain[c % color_channels];
+            channel_bias[c] = c < color_channels ? bias[c] : 0;
+        }
+        const int nCols = img.cols * cn;
+        double ssd = 0.f;
+        for (int i = 0; i < img.rows; i++) {
+            const float *p1 = img.ptr<const float>(i);
+            const float *p2 = img2.ptr<const float>(i);
+            for (int j = 0; j < nCols; j += cn) {
+                for (int c = 0; c < cn; c++) {
+                    float diff = channel_gain[c] * p1[j + c] + channel_bias[c] - p2[j + c];
+                    ssd += diff * diff;
+                }
+            }
+            if (ssd >= limit) {
+                return ssd;
+            }
+        }
+        return ssd;
+    }
+
     /**
      * Convert images to lab retrieved from imread.
      * L*a*b has the following ranges for each channel:
@@ -79,8 +261,10 @@ namespace pmutil {
         if (resize_factor != 1.f) {
             resize(img, img, Size(), resize_factor, resize_factor);
         }
-        img.convertTo(img, CV_32FC3, 1 / 255.f);
-        cvtColor(img, img, CV_BGR2Lab);
+        // Scaling and conversion in a single pass.
+        std::vector<Mat> lab_pyr;
+        buildLabPyramid(img, lab_pyr, 0);
+        img = lab_pyr[0];
     }
 
     /**
@@ -140,6 +324,44 @@ namespace pmutil {
         }
     }
 
+    /**
+     * Divergence of the gradient field (gradient_x, gradient_y), where the gradients are forward differences as given
+     * by computeGradientX/Y. For exact gradients of an image, this is its laplacian (5 point stencil).
+     */
+    static void computeDivergence(const Mat &gradient_x, const Mat &gradient_y, Mat &divergence) {
+        Mat kernel_x = Mat::zeros(1, 3, CV_8S);
+        kernel_x.at<char>(0, 0) = -1;
+        kernel_x.at<char>(0, 1) = 1;
+        filter2D(gradient_x, divergence, CV_32F, kernel_x);
+
+        Mat kernel_y = Mat::zeros(3, 1, CV_8S);
+        kernel_y.at<char>(0, 0) = -1;
+        kernel_y.at<char>(1, 0) = 1;
+        Mat divergence_y;
+        filter2D(gradient_y, divergence_y, CV_32F, kernel_y);
+        divergence += divergence_y;
+    }
+
+    /**
+     * Interleaves the float image 'img' with its x and y gradients, both multiplied by sqrt(gradient_weight).
+     * Every pixel of 'features' holds the channels of img, followed by the x and then the y gradient of every channel,
+     * so the SSD of two feature patches is SSD(colors) + gradient_weight * (SSD(gx) + SSD(gy)).
+     */
+    static void interleaveWithGradients(const Mat &img, float gradient_weight, Mat &features) {
+        Mat kernel_x = Mat::zeros(1, 3, CV_32F);
+        kernel_x.at<float>(0, 2) = 1;
+        kernel_x.at<float>(0, 1) = -1;
+        Mat kernel_y = kernel_x.t();
+        kernel_x *= std::sqrt(gradient_weight);
+        kernel_y *= std::sqrt(gradient_weight);
+
+        Mat planes[3];
+        planes[0] = img;
+        filter2D(img, planes[1], CV_32F, kernel_x);
+        filter2D(img, planes[2], CV_32F, kernel_y);
+        merge(planes, 3, features);
+    }
+
     constexpr double MIN_SHIFT_DISTANCE = 0.01;
     constexpr double MIN_CLUSTER_DISTANCE = 0.1;
     constexpr double EPSILON = 1e-6;
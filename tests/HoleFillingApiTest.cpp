@@ -0,0 +1,70 @@
+#include "gtest/gtest.h"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "../src/HoleFillingApi.h"
+#include <vector>
+
+using cv::Mat;
+using cv::randu;
+using cv::Rect;
+using cv::Scalar;
+using std::vector;
+
+TEST(hole_filling_api_test, should_fill_strided_buffers_without_changing_pixels_outside_of_hole)
+{
+    const int width = 64, height = 48;
+    // Rows padded, as in many image libraries.
+    const size_t stride = width * 3 + 20;
+    vector<uint8_t> pixels(stride * height), filled(stride * height, 0);
+    Mat input(height, width, CV_8UC3, pixels.data(), stride);
+    randu(input, Scalar::all(0), Scalar::all(255));
+    vector<uint8_t> mask_pixels(width * height, 0);
+    Mat mask(height, width, CV_8U, mask_pixels.data());
+    mask(Rect(20, 15, 12, 10)) = 1;
+
+    ImageBuffer input_buffer;
+    input_buffer.data = pixels.data();
+    input_buffer.width = width;
+    input_buffer.height = height;
+    input_buffer.stride = stride;
+    ImageBuffer output_buffer = input_buffer;
+    output_buffer.data = filled.data();
+    MaskBuffer mask_buffer;
+    mask_buffer.data = mask_pixels.data();
+    mask_buffer.width = width;
+    mask_buffer.height = height;
+    ASSERT_TRUE(fillHole(input_buffer, mask_buffer, output_buffer));
+
+    Mat output = asMat(output_buffer);
+    ASSERT_EQ(0, cv::norm(input, output, cv::NORM_INF, mask == 0));
+    // The hole is filled with content of the image, not left black.
+    ASSERT_GT(cv::mean(output, mask)[0], 0);
+    // The mask is only read.
+    ASSERT_EQ(1, mask.at<uchar>(15, 20));
+}
+
+TEST(hole_filling_api_test, in_place_filling_should_keep_alpha)
+{
+    Mat image(40, 40, CV_8UC4);
+    randu(image, Scalar::all(0), Scalar::all(255));
+    const Mat original = image.clone();
+    Mat mask = Mat::zeros(image.size(), CV_8U);
+    mask(Rect(15, 15, 8, 8)) = 255;
+
+    ImageBuffer buffer;
+    buffer.data = image.data;
+    buffer.width = image.cols;
+    buffer.height = image.rows;
+    buffer.stride = image.step;
+    buffer.format = PixelFormat::RGBA8;
+    MaskBuffer mask_buffer;
+    mask_buffer.data = mask.data;
+    mask_buffer.width = mask.cols;
+    mask_buffer.height = mask.rows;
+    fillHole(buffer, mask_buffer, buffer);
+
+    vector<Mat> channels, original_channels;
+    cv::split(image, channels);
+    cv::split(original, original_channels);
+    ASSERT_EQ(0, cv::norm(channels[3], original_channels[3], cv::NORM_INF));
+    ASSERT_EQ(0, cv::norm(image, original, cv::NORM_INF, mask == 0));
+}
@@ -0,0 +1,146 @@
+#include "gtest/gtest.h"
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "../src/HoleFillingServer.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstring>
+#include <string>
+
+using cv::imdecode;
+using cv::imencode;
+using cv::Mat;
+using cv::randu;
+using cv::Rect;
+using cv::Scalar;
+using std::string;
+using std::vector;
+
+namespace {
+    struct Response {
+        int status = 0;
+        string body;
+    };
+
+    /**
+     * Minimal HTTP client, sends one request to localhost and reads the response until the server closes.
+     */
+    Response request(int port, const string &method, const string &path, const string &body = "",
+                     const string &extra_headers = "") {
+        Response response;
+        const int socket = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address;
+        std::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        if (connect(socket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0) {
+            close(socket);
+            return response;
+        }
+        const string message = method + " " + path + " HTTP/1.1\r\nHost: localhost\r\nContent-Length: " +
+                               std::to_string(body.size()) + "\r\n" + extra_headers + "\r\n" + body;
+        send(socket, message.data(), message.size(), 0);
+        string data;
+        char buffer[8192];
+        ssize_t received;
+        while ((received = recv(socket, buffer, sizeof(buffer), 0)) > 0)
+            data.append(buffer, static_cast<size_t>(received));
+        close(socket);
+
+        const size_t header_end = data.find("\r\n\r\n");
+        if (data.compare(0, 9, "HTTP/1.1 ") != 0 || header_end == string::npos)
+            return response;
+        response.status = std::atoi(data.c_str() + 9);
+        response.body = data.substr(header_end + 4);
+        return response;
+    }
+
+    Response fill(int port, const Mat &image, const Mat &mask) {
+        vector<uchar> encoded_image, encoded_mask;
+        imencode(".png", image, encoded_image);
+        imencode(".png", mask, encoded_mask);
+        const string body = string(encoded_image.begin(), encoded_image.end()) +
+                            string(encoded_mask.begin(), encoded_mask.end());
+        return request(port, "POST", "/fill", body,
+                       "X-Image-Length: " + std::to_string(encoded_image.size()) + "\r\n");
+    }
+}
+
+TEST(hole_filling_server_test, fill_request_should_return_filled_image)
+{
+    HoleFillingServer server;
+    server.start();
+    ASSERT_GT(server.port(), 0);
+    ASSERT_EQ(200, request(server.port(), "GET", "/health").status);
+
+    Mat image(60, 60, CV_8UC3);
+    randu(image, Scalar::all(0), Scalar::all(255));
+    Mat mask = Mat::zeros(image.size(), CV_8U);
+    mask(Rect(25, 25, 10, 10)) = 255;
+    // The same image twice, the second one is taken from the source cache.
+    for (int i = 0; i < 2; i++) {
+        Response response = fill(server.port(), image, mask);
+        ASSERT_EQ(200, response.status);
+        Mat filled = imdecode(Mat(1, static_cast<int>(response.body.size()), CV_8U, &response.body[0]),
+                              cv::IMREAD_COLOR);
+        ASSERT_EQ(image.size(), filled.size());
+        // Outside of the hole, only the color space round trip changes the image.
+        Mat outside = mask == 0;
+        ASSERT_LE(cv::norm(image, filled, cv::NORM_INF, outside), 2);
+    }
+
+    Response metrics = request(server.port(), "GET", "/metrics");
+    ASSERT_EQ(200, metrics.status);
+    ASSERT_NE(string::npos, metrics.body.find("hole_filling_requests_total{result=\"filled\"} 2"));
+    ASSERT_NE(string::npos, metrics.body.find("hole_filling_request_seconds_count 2"));
+    ASSERT_NE(string::npos, metrics.body.find("hole_filling_source_cache_hits_total 1"));
+    server.stop();
+}
+
+TEST(hole_filling_server_test, bad_requests_should_be_answered_with_client_errors)
+{
+    HoleFillingServer server;
+    server.start();
+    ASSERT_EQ(404, request(server.port(), "GET", "/unknown").status);
+    ASSERT_EQ(405, request(server.port(), "GET", "/fill").status);
+    ASSERT_EQ(400, request(server.port(), "POST", "/fill", "no images", "X-Image-Length: 3\r\n").status);
+}
+
+TEST(hole_filling_server_test, slow_client_should_not_hold_up_other_requests)
+{
+    HoleFillingServer server;
+    server.start();
+    // Sends only the start of its request and then waits.
+    const int slow_socket = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(static_cast<uint16_t>(server.port()));
+    ASSERT_EQ(0, connect(slow_socket, reinterpret_cast<sockaddr *>(&address), sizeof(address)));
+    const string partial = "POST /fill HTTP/1.1\r\nContent-Length: 1000\r\n";
+    send(slow_socket, partial.data(), partial.size(), 0);
+
+    const int64 tic = cv::getTickCount();
+    ASSERT_EQ(200, request(server.port(), "GET", "/health").status);
+    // Far below the request timeout the slow client has.
+    EXPECT_LT((cv::getTickCount() - tic) / cv::getTickFrequency(), 2);
+    close(slow_socket);
+}
+
+TEST(hole_filling_server_test, full_queue_should_reject_jobs)
+{
+    // Without queue, there is never room for a job.
+    ServerOptions options;
+    options.queue_capacity = 0;
+    HoleFillingServer server(options);
+    server.start();
+    Mat image(30, 30, CV_8UC3, Scalar::all(100));
+    Mat mask = Mat::zeros(image.size(), CV_8U);
+    mask(Rect(10, 10, 5, 5)) = 255;
+    ASSERT_EQ(503, fill(server.port(), image, mask).status);
+    ASSERT_NE(string::npos, server.metrics().find("hole_filling_requests_total{result=\"rejected\"} 1"));
+}
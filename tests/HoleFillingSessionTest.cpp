@@ -0,0 +1,52 @@
+#include "gtest/gtest.h"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "../src/HoleFillingSession.h"
+
+using cv::Mat;
+using cv::randu;
+using cv::Rect;
+using cv::Scalar;
+
+TEST(hole_filling_session_test, small_edits_should_only_change_region_around_them)
+{
+    Mat img = Mat(100, 100, CV_32FC3);
+    randu(img, Scalar::all(0), Scalar::all(100));
+    Mat hole = Mat::zeros(img.size(), CV_8U);
+    hole(Rect(30, 30, 20, 20)) = 255;
+    HoleFillingSession session(img, hole, 7);
+    const Mat initial = session.filled().clone();
+    ASSERT_EQ(img.size(), initial.size());
+
+    // Grow the hole by a small stroke.
+    hole(Rect(50, 40, 4, 4)) = 255;
+    Mat grown = session.setHole(hole).clone();
+    const Rect region = session.lastRefilledRegion();
+    ASSERT_GT(region.area(), 0);
+    ASSERT_LT(region.area(), img.size().area());
+    ASSERT_TRUE(region.contains(cv::Point(50, 40)));
+    Mat outside = Mat::ones(img.size(), CV_8U);
+    outside(region) = 0;
+    ASSERT_EQ(0, cv::norm(initial, grown, cv::NORM_INF, outside));
+    for (int y = 0; y < img.rows; y++) {
+        for (int x = 0; x < img.cols; x++) {
+            if (!hole.at<uchar>(y, x)) {
+                ASSERT_EQ(img.at<cv::Vec3f>(y, x), grown.at<cv::Vec3f>(y, x));
+            }
+        }
+    }
+    for (size_t scale = 0; scale < session._offset_map_pyr.size(); scale++) {
+        if (session._offset_map_pyr[scale] == nullptr)
+            continue;
+        ASSERT_EQ(session._target_rect_pyr[scale].width - 7 + 1, session._offset_map_pyr[scale]->_width);
+        ASSERT_EQ(session._target_rect_pyr[scale].height - 7 + 1, session._offset_map_pyr[scale]->_height);
+    }
+
+    // Shrinking restores the original pixels.
+    hole(Rect(50, 40, 4, 4)) = 0;
+    Mat shrunk = session.setHole(hole);
+    ASSERT_EQ(img.at<cv::Vec3f>(41, 51), shrunk.at<cv::Vec3f>(41, 51));
+
+    // Nothing changed, nothing is refilled.
+    session.setHole(hole);
+    ASSERT_EQ(0, session.lastRefilledRegion().area());
+}
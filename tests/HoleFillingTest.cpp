@@ -133,3 +133,103 @@ TEST(hole_filling_test, elliptical_hole_on_repeated_texture_should_give_good_res
     double ssd = norm(img_bgr, filled, cv::NORM_L2SQR);
     EXPECT_LT(ssd, 0.2);
 }
+
+TEST(hole_filling_test, cancelled_run_should_return_best_solution_so_far)
+{
+    Mat img = Mat(100, 100, CV_32FC3);
+    randu(img, Scalar::all(0), Scalar::all(100));
+    Mat hole = Mat::zeros(img.size(), CV_8U);
+    hole(Rect(40, 40, 20, 20)) = 255;
+    HoleFilling hf(img, hole, 7);
+
+    RunOptions options;
+    options.cancellation.cancel();
+    RunResult result = hf.runAsync(options).get();
+    ASSERT_FALSE(result.completed);
+    ASSERT_EQ(0, result.em_steps);
+    ASSERT_EQ(img.size(), result.image.size());
+    // Outside of the hole, the image is unchanged.
+    Mat outside = hole == 0;
+    ASSERT_EQ(0, cv::norm(img, result.image, cv::NORM_INF, outside));
+}
+
+TEST(hole_filling_test, previews_should_be_published_after_every_scale)
+{
+    Mat img = Mat(100, 100, CV_32FC3);
+    randu(img, Scalar::all(0), Scalar::all(100));
+    Mat hole = Mat::zeros(img.size(), CV_8U);
+    hole(Rect(40, 40, 20, 20)) = 255;
+    HoleFilling hf(img, hole, 7);
+    hf.setEmSteps(2);
+
+    std::vector<int> scales;
+    RunOptions options;
+    options.on_scale_done = [&](int scale, const Mat &preview) {
+        scales.push_back(scale);
+        ASSERT_EQ(img.size(), preview.size());
+    };
+    RunResult result = hf.run(options);
+    ASSERT_TRUE(result.completed);
+    ASSERT_EQ(0, result.scale);
+    ASSERT_EQ(hf._nr_scales + 1, static_cast<int>(scales.size()));
+    for (size_t i = 0; i < scales.size(); i++)
+        ASSERT_EQ(hf._nr_scales - static_cast<int>(i), scales[i]);
+}
+
+TEST(hole_filling_test, full_run_should_continue_after_preview)
+{
+    Mat img = Mat(100, 100, CV_32FC3);
+    randu(img, Scalar::all(0), Scalar::all(100));
+    Mat hole = Mat::zeros(img.size(), CV_8U);
+    hole(Rect(40, 40, 20, 20)) = 255;
+    HoleFilling hf(img, hole, 7);
+    hf.setEmSteps(2);
+    ASSERT_GE(hf._nr_scales, 2);
+
+    const int stop_scale = 2;
+    RunResult preview = hf.runPreview(stop_scale);
+    ASSERT_TRUE(preview.completed);
+    ASSERT_EQ(stop_scale, preview.scale);
+    ASSERT_EQ(2 * (hf._nr_scales - stop_scale + 1), preview.em_steps);
+    ASSERT_EQ(img.size(), preview.image.size());
+    Mat outside = hole == 0;
+    ASSERT_EQ(0, cv::norm(img, preview.image, cv::NORM_INF, outside));
+
+    // Only the scales finer than the preview are left.
+    RunResult result = hf.run(RunOptions());
+    ASSERT_TRUE(result.completed);
+    ASSERT_EQ(0, result.scale);
+    ASSERT_EQ(2 * stop_scale, result.em_steps);
+}
+
+TEST(hole_filling_test, hole_fillings_of_a_prepared_source_should_share_its_preprocessing)
+{
+    Mat img = Mat(100, 100, CV_32FC3);
+    randu(img, Scalar::all(0), Scalar::all(100));
+    Mat hole = Mat::zeros(img.size(), CV_8U);
+    hole(Rect(40, 40, 20, 20)) = 255;
+    std::shared_ptr<PreparedSource> source = PreparedSource::create(img, 7, SourceTransformations(),
+                                                                    HoleFilling::gradientWeight());
+
+    HoleFilling first(source, hole);
+    first.setEmSteps(2);
+    Mat first_filled = first.run();
+    std::shared_ptr<TransformedSources> sources = source->sources(0);
+    SearchConstraints constraints;
+    constraints.excluded = first._hole_pyr[0];
+    constraints.target_origin = first._target_rect_pyr[0].tl();
+    std::shared_ptr<const SearchSpace> search_space = source->searchSpace(0, constraints);
+
+    // A second job on the same image and hole gets the same result, with the same sources and search space.
+    HoleFilling second(source, hole);
+    second.setEmSteps(2);
+    Mat second_filled = second.run();
+    ASSERT_EQ(sources, source->sources(0));
+    ASSERT_EQ(search_space, source->searchSpace(0, constraints));
+    ASSERT_EQ(0, cv::norm(first_filled, second_filled, cv::NORM_INF));
+
+    // The same as without sharing.
+    HoleFilling unshared(img, hole, 7);
+    unshared.setEmSteps(2);
+    ASSERT_EQ(0, cv::norm(first_filled, unshared.run(), cv::NORM_INF));
+}
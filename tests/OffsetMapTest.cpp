@@ -54,3 +54,42 @@ TEST(offset_map_test, percentile_distance_should_be_computed_correctly)
     float gotten_percentile = test.get75PercentileDistance();
     ASSERT_EQ(60, gotten_percentile);
 }
+
+TEST(offset_map_test, percentile_distance_should_match_sorted_distances)
+{
+    OffsetMap test = OffsetMap(13, 7);
+    std::vector<float> distances;
+    for (int x = 0; x < test._width; x++) {
+        for (int y = 0; y < test._height; y++) {
+            test.ptr(y, x)->distance = static_cast<float>((x * 37 + y * 11) % 23);
+            distances.push_back(test.at(y, x).distance);
+        }
+    }
+    std::sort(distances.begin(), distances.end());
+    for (double fraction : {0.0, 0.1, 0.5, 0.75, 1.0}) {
+        EXPECT_EQ(distances[static_cast<int>((distances.size() - 1) * fraction)], test.percentileDistance(fraction));
+    }
+    EXPECT_EQ(test.percentileDistance(0.75), test.get75PercentileDistance());
+}
+
+TEST(offset_map_test, statistics_should_count_updated_entries)
+{
+    OffsetMap test = OffsetMap(4, 1);
+    test.ptr(0, 0)->distance = 10;
+    test.ptr(0, 1)->distance = 40;
+    test.ptr(0, 2)->distance = 60;
+    test.ptr(0, 3)->distance = 1000;
+
+    DistanceStatistics statistics = test.statistics();
+    EXPECT_EQ(1110, statistics.summed_distance);
+    EXPECT_EQ(60, statistics.percentile_75_distance);
+    EXPECT_EQ(4u, statistics.nr_updated);
+
+    test.ptr(0, 3)->distance = 5;
+    test.flip();
+    statistics = test.statistics();
+    EXPECT_EQ(115, statistics.summed_distance);
+    EXPECT_EQ(40, statistics.percentile_75_distance);
+    EXPECT_EQ(1u, statistics.nr_updated);
+    EXPECT_EQ(0u, test.statistics().nr_updated);
+}
@@ -1,12 +1,92 @@
 #include "gtest/gtest.h"
 #include "opencv2/imgproc/imgproc.hpp"
 #include "../src/util.h"
+#include "../src/HoleFilling.h"
+#include "../src/patch_match_provider/RandomizedPatchMatch.h"
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <cstring>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 
 using namespace std;
 using namespace cv;
 using namespace pmutil;
 
+namespace {
+    /**
+     * Hardware counters (cycles, instructions, cache misses) of the calling thread, through perf_event_open on Linux.
+     * Counters that can not be opened, e.g. elsewhere or due to perf_event_paranoid, read -1.
+     */
+    class HardwareCounters {
+
+    public:
+        enum Counter { CYCLES, INSTRUCTIONS, CACHE_MISSES, NR_COUNTERS };
+
+        HardwareCounters() {
+#ifdef __linux__
+            const unsigned long long configs[NR_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                             PERF_COUNT_HW_CACHE_MISSES};
+            for (int i = 0; i < NR_COUNTERS; i++) {
+                perf_event_attr attr;
+                memset(&attr, 0, sizeof(attr));
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.size = sizeof(attr);
+                attr.config = configs[i];
+                attr.disabled = 1;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                _fds[i] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+            }
+#endif
+        }
+
+        ~HardwareCounters() {
+#ifdef __linux__
+            for (int fd: _fds) {
+                if (fd >= 0)
+                    close(fd);
+            }
+#endif
+        }
+
+        void start() {
+#ifdef __linux__
+            for (int fd: _fds) {
+                if (fd >= 0) {
+                    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+                }
+            }
+#endif
+        }
+
+        void stop() {
+#ifdef __linux__
+            for (int fd: _fds) {
+                if (fd >= 0)
+                    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            }
+#endif
+        }
+
+        long long read(Counter counter) const {
+            long long value = -1;
+#ifdef __linux__
+            if (_fds[counter] < 0 || ::read(_fds[counter], &value, sizeof(value)) != sizeof(value))
+                return -1;
+#endif
+            return value;
+        }
+
+    private:
+        int _fds[NR_COUNTERS] = {-1, -1, -1};
+    };
+}
+
 TEST(performance_test, performance_test_division_of_3d_by_1d) {
     vector<Size> sizes{Size(2, 2), Size(10, 10), Size(100, 100), Size(1000, 1000), Size(2000, 2000)};
 
@@ -173,3 +253,221 @@ TEST(performance_test, extract_rectangle_methods) {
         cout << sz << " \t" << toc1 << " \t" << toc2 << endl;
     }
 }
+
+// Compares runtime and quality of hole filling for growing search spaces.
+TEST(performance_test, transformation_search_space_on_brick_pavement) {
+    Mat img = imread("test_images/brick_pavement_with_hole.png");
+    Mat original = imread("test_images/brick_pavement.jpg");
+    if (!img.data || !original.data) {
+        FAIL() << "Could not load images!";
+    }
+    const float resize_factor = 0.5f;
+    Mat hole_mask;
+    inRange(img, Scalar(255, 0, 255), Scalar(255, 0, 255), hole_mask);
+    resize(hole_mask, hole_mask, Size(), resize_factor, resize_factor);
+    convert_for_computation(img, resize_factor);
+    resize(original, original, Size(), resize_factor, resize_factor);
+    original.convertTo(original, CV_32FC3, 1 / 255.f);
+
+    vector<String> names{"rotation", "rotation + scale", "rotation + scale + mirror"};
+    vector<SourceTransformations> search_spaces(3);
+    search_spaces[1].min_scale = 0.75f;
+    search_spaces[1].max_scale = 1.25f;
+    search_spaces[2] = search_spaces[1];
+    search_spaces[2].mirror = true;
+
+    cout << "Search space \t\tTime \tSSD to original" << endl;
+    for (size_t i = 0; i < search_spaces.size(); i++) {
+        HoleFilling hf(img, hole_mask, 7, search_spaces[i]);
+        double tic = double(getTickCount());
+        Mat filled = hf.run();
+        double toc = (double(getTickCount() - tic)) * 1000. / getTickFrequency();
+
+        Mat filled_bgr;
+        cvtColor(filled, filled_bgr, CV_Lab2BGR);
+        cout << names[i] << " \t" << toc << " \t" << norm(filled_bgr, original, NORM_L2SQR) << endl;
+    }
+}
+
+// Compares rejecting source patches that overlap the hole by painting it with hole_color (the distance gets huge) with
+// rejecting them through the validity bitmaps of the search space (no pixel is touched).
+TEST(performance_test, hole_rejection_on_brick_pavement) {
+    Mat img = imread("test_images/brick_pavement_with_hole.png");
+    if (!img.data) {
+        FAIL() << "Could not load image!";
+    }
+    Mat hole_mask;
+    inRange(img, Scalar(255, 0, 255), Scalar(255, 0, 255), hole_mask);
+    convert_for_computation(img, 1.f);
+    const int patch_size = 7;
+    vector<Point> hole_points;
+    findNonZero(hole_mask, hole_points);
+    const Rect hole_rect = boundingRect(hole_points);
+    const Rect target_rect = Rect(hole_rect.x - patch_size, hole_rect.y - patch_size,
+                                  hole_rect.width + 2 * patch_size, hole_rect.height + 2 * patch_size) &
+                             Rect(Point(0, 0), img.size());
+    const SourceTransformations transformations = SourceTransformations::rotationsOnly(-10, 10, 5);
+
+    cout << "Rejection \tTime \tCandidates \tRejected" << endl;
+    for (bool bitmap: {false, true}) {
+        Mat source = img.clone();
+        if (!bitmap)
+            source.setTo(HoleFilling::hole_color, hole_mask);
+        RandomizedPatchMatch rpm(source, target_rect.size(), patch_size, transformations);
+        if (bitmap) {
+            SearchConstraints constraints;
+            constraints.excluded = hole_mask;
+            constraints.target_origin = target_rect.tl();
+            rpm.setSearchConstraints(constraints);
+        }
+        rpm.setTargetArea(img(target_rect).clone());
+        double tic = double(getTickCount());
+        rpm.match();
+        double toc = (double(getTickCount() - tic)) * 1000. / getTickFrequency();
+        const EvaluationCounts &counts = rpm.statistics();
+        cout << (bitmap ? "bitmap" : "hole color") << " \t" << toc << " \t" << counts.evaluated << " \t"
+             << counts.rejected << endl;
+    }
+}
+
+// Compares evaluating the candidates of a target patch one by one with evaluating them in batches.
+TEST(performance_test, candidate_batch_sizes_on_brick_pavement) {
+    Mat img = imread("test_images/brick_pavement.jpg");
+    if (!img.data) {
+        FAIL() << "Could not load image!";
+    }
+    convert_for_computation(img, 0.5f);
+    const Rect target_rect(img.cols / 4, img.rows / 4, img.cols / 2, img.rows / 2);
+    const SourceTransformations transformations = SourceTransformations::rotationsOnly(-10, 10, 5);
+
+    cout << "Batch size \tTime \tSummed distance" << endl;
+    for (int batch_size: {1, 2, 4, 8, 16}) {
+        RandomizedPatchMatch rpm(img, target_rect.size(), 7, transformations);
+        rpm.setCandidateBatchSize(batch_size);
+        rpm.setTargetArea(img(target_rect).clone());
+        double tic = double(getTickCount());
+        shared_ptr<OffsetMap> offset_map = rpm.match();
+        double toc = (double(getTickCount() - tic)) * 1000. / getTickFrequency();
+        cout << batch_size << " \t" << toc << " \t" << offset_map->summedDistance() << endl;
+    }
+}
+
+// Compares sweeping the offset map column by column (tile size 0) with sweeping it in tiles, by hardware counters of
+// the matching thread. Merging offset maps runs on the thread pool and is not counted completely.
+TEST(performance_test, sweep_tile_sizes_on_brick_pavement) {
+    Mat img = imread("test_images/brick_pavement.jpg");
+    if (!img.data) {
+        FAIL() << "Could not load image!";
+    }
+    convert_for_computation(img, 1.f);
+    const Rect target_rect(img.cols / 4, img.rows / 4, img.cols / 2, img.rows / 2);
+
+    HardwareCounters counters;
+    cout << "Tile size \tTime \tCycles \tInstructions \tIPC \tCache misses \tSummed distance" << endl;
+    for (int tile_size: {0, 16, 32, 64}) {
+        RandomizedPatchMatch rpm(img, target_rect.size(), 7, 0.5f);
+        rpm.setSweepTileSize(tile_size);
+        rpm.setTargetArea(img(target_rect).clone());
+        double tic = double(getTickCount());
+        counters.start();
+        shared_ptr<OffsetMap> offset_map = rpm.match();
+        counters.stop();
+        double toc = (double(getTickCount() - tic)) * 1000. / getTickFrequency();
+        const long long cycles = counters.read(HardwareCounters::CYCLES);
+        const long long instructions = counters.read(HardwareCounters::INSTRUCTIONS);
+        cout << tile_size << " \t" << toc << " \t" << cycles << " \t" << instructions << " \t"
+             << (cycles > 0 ? static_cast<double>(instructions) / cycles : 0) << " \t"
+             << counters.read(HardwareCounters::CACHE_MISSES) << " \t" << offset_map->summedDistance() << endl;
+    }
+}
+
+// Compares scoring random candidates on an 8K source, which does not fit into any cache, with and without prefetching
+// the next batch of candidate patches. Disabled by default, since the source takes 400 MB; run with
+// --gtest_also_run_disabled_tests.
+TEST(performance_test, DISABLED_candidate_prefetching_on_8k_source) {
+    Mat source(4320, 7680, CV_32FC3);
+    randu(source, Scalar::all(0), Scalar::all(100));
+    Mat target(256, 256, CV_32FC3);
+    randu(target, Scalar::all(0), Scalar::all(100));
+    const int patch_size = 7;
+    const int nr_candidates = 32;
+    TransformedSources sources(source, SourceTransformations::rotationsOnly(0, 0, 1), patch_size);
+
+    cout << "Prefetching \tTime \tSummed distance" << endl;
+    for (bool prefetching: {false, true}) {
+        CandidateEvaluator evaluator(sources, target, patch_size);
+        evaluator.setBatchSize(8);
+        evaluator.setPrefetching(prefetching);
+        RNG rng(42);
+        vector<OffsetMapEntry> candidates(nr_candidates);
+        double summed_distance = 0;
+        double tic = double(getTickCount());
+        for (int y = 0; y <= target.rows - patch_size; y++) {
+            for (int x = 0; x <= target.cols - patch_size; x++) {
+                OffsetMapEntry entry;
+                entry.offset = Point(0, 0);
+                entry.transform_idx = 0;
+                entry.distance = INFINITY;
+                for (OffsetMapEntry &candidate: candidates) {
+                    candidate.transform_idx = 0;
+                    candidate.offset = Point(rng.uniform(0, source.cols - patch_size + 1) - x,
+                                             rng.uniform(0, source.rows - patch_size + 1) - y);
+                }
+                evaluator.updateIfBetter(candidates.data(), nr_candidates, x, y, &entry);
+                summed_distance += entry.distance;
+            }
+        }
+        double toc = (double(getTickCount() - tic)) * 1000. / getTickFrequency();
+        cout << (prefetching ? "on" : "off") << " \t" << toc << " \t" << summed_distance << endl;
+    }
+}
+
+namespace {
+	/**
+	 * Sums the distances of 'nr_patches' pairs of patches of 'img1' and 'img2' with the distance of the patch layout
+	 * chosen by pmutil::dispatchPatchLayout(), and measures the time taken.
+	 */
+	class SpecializedSsdTiming {
+	public:
+		SpecializedSsdTiming(const Mat &img1, const Mat &img2, int patch_size, int nr_patches)
+				: _img1(img1), _img2(img2), _patch_size(patch_size), _nr_patches(nr_patches) { }
+
+		double sum = 0, milliseconds = 0;
+
+		template<int SIZE, int CHANNELS>
+		void run() {
+			const int range = _img1.cols - _patch_size;
+			double tic = double(getTickCount());
+			for (int i = 0; i < _nr_patches; i++) {
+				const int x = (i * 7) % range, y = (i * 13) % range;
+				sum += PatchSsd<SIZE, CHANNELS>::ssd(_img1(Rect(x, y, _patch_size, _patch_size)),
+				                                     _img2(Rect(y, x, _patch_size, _patch_size)), INFINITY);
+			}
+			milliseconds = (double(getTickCount()) - tic) * 1000. / getTickFrequency();
+		}
+
+	private:
+		const Mat &_img1, &_img2;
+		const int _patch_size, _nr_patches;
+	};
+}
+
+// Compares the generic distance with the one specialized for the patch size and number of channels, on the patches of
+// a 9 channel image (colors interleaved with gradients) as scored by the CandidateEvaluator.
+TEST(performance_test, specialized_ssd_for_patch_sizes) {
+	theRNG().state = 100;
+	Mat img1(500, 500, CV_32FC(9)), img2(500, 500, CV_32FC(9));
+	randu(img1, 0.0, 1.0);
+	randu(img2, 0.0, 1.0);
+	const int nr_patches = 200000;
+	cout << "Patch size \tGeneric \tSpecialized" << endl;
+	for (int patch_size : {5, 7, 9}) {
+		SpecializedSsdTiming generic(img1, img2, patch_size, nr_patches);
+		generic.run<0, 0>();
+		SpecializedSsdTiming specialized(img1, img2, patch_size, nr_patches);
+		dispatchPatchLayout(patch_size, img1.channels(), specialized);
+
+		cout << patch_size << " \t\t" << generic.milliseconds << " \t" << specialized.milliseconds << endl;
+		EXPECT_NEAR(generic.sum, specialized.sum, 1e-5 * generic.sum);
+	}
+}
@@ -1,6 +1,7 @@
 #include "gtest/gtest.h"
 #include "opencv2/imgproc/imgproc.hpp"
 #include "../src/util.h"
+#include "../src/MaskedPoissonSolver.h"
 #include "../src/PoissonSolver.h"
 
 using namespace std;
@@ -93,4 +94,143 @@ TEST(poisson_solver_test, noisy_natural_image_given) {
     auto expected_ssd = 0;
     // Error here is quite high.
     ASSERT_NEAR(gotten_ssd, expected_ssd, 16);
-}
\ No newline at end of file
+}
+
+TEST(poisson_solver_test, exact_gradients_on_odd_and_even_sizes_given) {
+    // The real DST takes different paths for odd and even lengths, so try all combinations.
+    vector<Size> sizes{Size(3, 3), Size(4, 4), Size(33, 20), Size(20, 33), Size(64, 65)};
+    for (const Size &size: sizes) {
+        Mat img(size, CV_32FC3);
+        randu(img, 0.0, 1.0);
+
+        Mat grad_x, grad_y;
+        computeGradientX(img, grad_x);
+        computeGradientY(img, grad_y);
+
+        // Solve twice, the second solve reuses the cached plan.
+        for (int i = 0; i < 2; i++) {
+            PoissonSolver ps(img, grad_x, grad_y);
+            Mat result;
+            ps.solve(result);
+            ASSERT_EQ(img.size(), result.size());
+            EXPECT_LT(norm(result, img, NORM_INF), 1e-3) << size;
+        }
+    }
+}
+
+TEST(poisson_solver_test, image_without_interior_given) {
+    Mat img(2, 5, CV_32FC3);
+    randu(img, 0.0, 1.0);
+    Mat grad_x, grad_y;
+    computeGradientX(img, grad_x);
+    computeGradientY(img, grad_y);
+
+    PoissonSolver ps(img, grad_x, grad_y);
+    Mat result;
+    ps.solve(result);
+    EXPECT_EQ(0, norm(result, img, NORM_INF));
+}
+
+namespace {
+    /**
+     * Irregular hole: a disc and a thin line, not touching the image border.
+     */
+    Mat irregularMask(Size size) {
+        Mat mask = Mat::zeros(size, CV_8U);
+        circle(mask, Point(size.width / 3, size.height / 2), size.height / 4, Scalar(255), -1);
+        line(mask, Point(5, 10), Point(size.width - 6, size.height - 10), Scalar(255), 1);
+        return mask;
+    }
+}
+
+TEST(poisson_solver_test, masked_exact_gradients_given) {
+    Size full_size(200, 150);
+    Mat img(full_size, CV_32FC3);
+    randu(img, 0.0, 1.0);
+    Mat grad_x, grad_y;
+    computeGradientX(img, grad_x);
+    computeGradientY(img, grad_y);
+    Mat mask = irregularMask(full_size);
+
+    // Destroy the hole, so only the gradients and the boundary are left.
+    Mat img_with_hole = img.clone();
+    img_with_hole.setTo(Scalar::all(0), mask);
+    MaskedPoissonSolver mps(img_with_hole, grad_x, grad_y, mask);
+    Mat result;
+    mps.solve(result);
+
+    EXPECT_GT(mps.nrLevels(), 1);
+    EXPECT_LT(norm(result, img, NORM_INF), 1e-3);
+}
+
+TEST(poisson_solver_test, masked_should_agree_with_rectangular_solver) {
+    Size full_size(60, 45);
+    Mat img(full_size, CV_32FC3);
+    randu(img, 0.0, 1.0);
+    Mat grad_x(full_size, CV_32FC3), grad_y(full_size, CV_32FC3);
+    randn(grad_x, 0, 0.1);
+    randn(grad_y, 0, 0.1);
+    // Everything but the border, i. e. the same problem as solved by PoissonSolver.
+    Mat mask = Mat::zeros(full_size, CV_8U);
+    mask(Rect(1, 1, full_size.width - 2, full_size.height - 2)) = 255;
+
+    Mat expected;
+    PoissonSolver ps(img, grad_x, grad_y);
+    ps.solve(expected);
+    Mat result;
+    MaskedPoissonSolver mps(img, grad_x, grad_y, mask);
+    mps.solve(result);
+
+    EXPECT_LT(norm(result, expected, NORM_INF), 1e-3);
+}
+
+TEST(poisson_solver_test, masked_should_agree_with_rectangular_solver_on_irregular_mask) {
+    Size full_size(80, 60);
+    Mat truth(full_size, CV_32FC3);
+    randu(truth, 0.0, 1.0);
+    GaussianBlur(truth, truth, Size(5, 5), 0);
+    Mat grad_x, grad_y;
+    computeGradientX(truth, grad_x);
+    computeGradientY(truth, grad_y);
+    Mat mask = irregularMask(full_size);
+    // Only the pixels outside of the mask are known, as in the hole filling.
+    Mat img = truth.clone();
+    img.setTo(Scalar::all(0.5), mask);
+
+    Mat expected;
+    PoissonSolver ps(img, grad_x, grad_y);
+    ps.solve(expected);
+    Mat result;
+    MaskedPoissonSolver mps(img, grad_x, grad_y, mask);
+    mps.solve(result);
+
+    EXPECT_LT(norm(result, expected, NORM_INF, mask), 1e-3);
+    // Outside of the mask, the image is kept.
+    EXPECT_EQ(0, norm(result, img, NORM_INF, mask == 0));
+}
+
+TEST(poisson_solver_test, masked_warm_start_should_need_fewer_iterations) {
+    Mat img = imread("test_images/unitobler.jpg");
+    resize(img, img, Size(), 0.25, 0.25);
+    img.convertTo(img, CV_32FC3, 1 / 255.f);
+    Mat grad_x, grad_y;
+    computeGradientX(img, grad_x);
+    computeGradientY(img, grad_y);
+    Mat mask = irregularMask(img.size());
+
+    Mat cold_start = img.clone();
+    cold_start.setTo(Scalar::all(0.5), mask);
+    MaskedPoissonSolver mps(cold_start, grad_x, grad_y, mask);
+    Mat result;
+    mps.solve(result);
+    const int cold_iterations = mps.iterations();
+
+    // Previous solution slightly off, as after an EM step.
+    Mat noise(img.size(), CV_32FC3);
+    randn(noise, 0, 0.01);
+    Mat warm_start = result + noise;
+    mps.solve(result, warm_start);
+
+    EXPECT_GT(cold_iterations, 0);
+    EXPECT_LT(mps.iterations(), cold_iterations);
+}
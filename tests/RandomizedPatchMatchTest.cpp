@@ -6,7 +6,9 @@
 #else
 #include "../src/patch_match_provider/cpu/ExhaustivePatchMatch.h"
 #endif
+#include "../src/patch_match_provider/ParallelMergeOffsetMaps.h"
 #include "../src/patch_match_provider/RandomizedPatchMatch.h"
+#include "../src/ThreadPool.h"
 #include "../src/util.h"
 
 using cv::imread;
@@ -16,6 +18,7 @@ using cv::Scalar;
 using cv::Vec3f;
 using pmutil::convert_for_computation;
 using std::shared_ptr;
+using std::vector;
 
 const double EPSILON = 1e-3;
 
@@ -120,4 +123,141 @@ TEST(randomized_patch_match_test, should_be_close_to_exhaustive_patch_match)
 	// This is in L*a*b* space, so the errors are quite high.
     // Still, rpm should have lower error since rotations are possible there.
 	ASSERT_LT(mean_ssd_rpm, mean_ssd_epm);
-}
\ No newline at end of file
+}
+
+TEST(randomized_patch_match_test, mirrored_target_should_match_better_when_searching_reflections)
+{
+    Mat source = imread("test_images/sonne1.PNG");
+    pmutil::convert_for_computation(source, 0.25f);
+    Mat target;
+    cv::flip(source(Rect(20, 10, 40, 30)), target, 1);
+    const int patch_size = 7;
+
+    SourceTransformations without_mirror;
+    RandomizedPatchMatch rpm(source, target.size(), patch_size, without_mirror, 0.f);
+    rpm.setTargetArea(target);
+    double ssd_without_mirror = rpm.match()->summedDistance();
+
+    SourceTransformations with_mirror;
+    with_mirror.mirror = true;
+    RandomizedPatchMatch rpm_mirror(source, target.size(), patch_size, with_mirror, 0.f);
+    rpm_mirror.setTargetArea(target);
+    shared_ptr<OffsetMap> mirror_offset_map = rpm_mirror.match();
+
+    EXPECT_EQ(10, rpm_mirror.getTransformedSources()->size());
+    // The unrotated, mirrored source contains the target exactly.
+    EXPECT_LT(mirror_offset_map->summedDistance(), ssd_without_mirror);
+}
+
+TEST(randomized_patch_match_test, relit_target_should_match_better_with_gain_bias_compensation)
+{
+    Mat source = imread("test_images/sonne1.PNG");
+    pmutil::convert_for_computation(source, 0.25f);
+    // Darker and with a color cast, but otherwise the same content.
+    Mat target = source(Rect(20, 10, 40, 30)) * 0.8 + Scalar(5, 3, -2);
+    const int patch_size = 7;
+
+    RandomizedPatchMatch rpm(source, target.size(), patch_size, 0.f);
+    rpm.setTargetArea(target);
+    double ssd_uncompensated = rpm.match()->summedDistance();
+
+    RandomizedPatchMatch rpm_compensated(source, target.size(), patch_size, 0.f);
+    GainBiasCompensation compensation;
+    compensation.enabled = true;
+    rpm_compensated.setGainBiasCompensation(compensation);
+    rpm_compensated.setTargetArea(target);
+    double ssd_compensated = rpm_compensated.match()->summedDistance();
+
+    EXPECT_LT(ssd_compensated, ssd_uncompensated * 0.1);
+}
+
+TEST(randomized_patch_match_test, search_constraints_should_be_respected)
+{
+    Mat source(60, 60, CV_32FC3);
+    randu(source, Scalar::all(0), Scalar::all(100));
+    const Rect target_rect(20, 20, 20, 20);
+    Mat target = source(target_rect).clone();
+    const int patch_size = 7;
+    const int max_distance = 20;
+
+    // The target itself must not be found, only patches around it.
+    SearchConstraints constraints;
+    constraints.excluded = Mat::zeros(source.size(), CV_8U);
+    constraints.excluded(target_rect) = 1;
+    constraints.max_distance = max_distance;
+    constraints.target_origin = target_rect.tl();
+
+    RandomizedPatchMatch rpm(source, target.size(), patch_size, SourceTransformations::rotationsOnly(0, 0, 1), 0.f);
+    rpm.setSearchConstraints(constraints);
+    rpm.setTargetArea(target);
+    shared_ptr<OffsetMap> offset_map = rpm.match();
+    for (int x = 0; x < offset_map->_width; x++) {
+        for (int y = 0; y < offset_map->_height; y++) {
+            OffsetMapEntry entry = offset_map->at(y, x);
+            ASSERT_LT(entry.distance, INFINITY) << "No allowed match for (" << x << "," << y << ")";
+            Rect source_patch(x + entry.offset.x, y + entry.offset.y, patch_size, patch_size);
+            ASSERT_EQ(0, (source_patch & target_rect).area()) << "Excluded match for (" << x << "," << y << ")";
+            ASSERT_LE(std::abs(entry.offset.x - target_rect.x), max_distance);
+            ASSERT_LE(std::abs(entry.offset.y - target_rect.y), max_distance);
+        }
+    }
+}
+
+TEST(randomized_patch_match_test, merging_coarse_offsets_should_reach_all_children)
+{
+    Mat source(64, 64, CV_32FC3);
+    randu(source, Scalar::all(0), Scalar::all(100));
+    Mat target = source(Rect(10, 12, 40, 40)).clone();
+    const int patch_size = 7;
+    TransformedSources sources(source, SourceTransformations::rotationsOnly(0, 0, 1), patch_size);
+    CandidateEvaluator evaluator(sources, target, patch_size);
+
+    // Every fine entry starts at the wrong offset 0, the coarse map knows the right one.
+    OffsetMap offset_map(target.cols - patch_size + 1, target.rows - patch_size + 1);
+    for (int x = 0; x < offset_map._width; x++) {
+        for (int y = 0; y < offset_map._height; y++) {
+            OffsetMapEntry *entry = offset_map.ptr(y, x);
+            entry->offset = cv::Point(0, 0);
+            entry->transform_idx = 0;
+            entry->distance = evaluator.distance(entry, x, y);
+        }
+    }
+    OffsetMap coarse((offset_map._width + 1) / 2, (offset_map._height + 1) / 2);
+    for (int x = 0; x < coarse._width; x++) {
+        for (int y = 0; y < coarse._height; y++) {
+            coarse.ptr(y, x)->offset = cv::Point(5, 6);
+            coarse.ptr(y, x)->transform_idx = 0;
+        }
+    }
+    const double distance_before = offset_map.summedDistance();
+
+    ParallelMergeOffsetMaps<> merge(coarse, 2, evaluator, offset_map);
+    ThreadPool::current().parallelFor(cv::Range(0, merge.nrTiles()), merge);
+    ASSERT_GT(distance_before, 0);
+    ASSERT_NEAR(0, offset_map.summedDistance(), EPSILON);
+    ASSERT_EQ(cv::Point(10, 12), offset_map.at(offset_map._height - 1, offset_map._width - 1).offset);
+    ASSERT_GE(merge.counts().evaluated, static_cast<uint64_t>(offset_map._width * offset_map._height));
+}
+
+TEST(randomized_patch_match_test, batched_candidates_should_give_same_result_as_one_by_one)
+{
+    Mat source(60, 60, CV_32FC3);
+    randu(source, Scalar::all(0), Scalar::all(100));
+    Mat target(30, 30, CV_32FC3);
+    randu(target, Scalar::all(0), Scalar::all(100));
+    vector<shared_ptr<OffsetMap>> results;
+    for (int batch_size: {1, 5, CandidateEvaluator::MAX_BATCH_SIZE}) {
+        RandomizedPatchMatch rpm(source, target.size(), 7, 0.5f);
+        rpm.setCandidateBatchSize(batch_size);
+        rpm.setTargetArea(target);
+        results.push_back(rpm.match());
+    }
+    for (size_t i = 1; i < results.size(); i++) {
+        ASSERT_EQ(results[0]->summedDistance(), results[i]->summedDistance());
+        for (int x = 0; x < results[0]->_width; x++) {
+            for (int y = 0; y < results[0]->_height; y++) {
+                ASSERT_EQ(results[0]->at(y, x).offset, results[i]->at(y, x).offset);
+            }
+        }
+    }
+}
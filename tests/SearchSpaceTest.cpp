@@ -0,0 +1,86 @@
+#include "gtest/gtest.h"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "../src/patch_match_provider/SearchSpace.h"
+#include "../src/patch_match_provider/ValidityBitmap.h"
+
+using cv::Mat;
+using cv::Point;
+using cv::randu;
+using cv::Rect;
+using cv::Scalar;
+using cv::Size;
+
+TEST(search_space_test, validity_bitmap_should_match_brute_force)
+{
+    Mat blocked(50, 70, CV_8U);
+    randu(blocked, 0, 100);
+    // About one blocked pixel per 5 x 5 patch, so there are valid and invalid patches.
+    blocked = blocked < 4;
+    const int patch_size = 5;
+    ValidityBitmap bitmap(blocked, patch_size);
+    ASSERT_EQ(70 - patch_size + 1, bitmap.width());
+    ASSERT_EQ(50 - patch_size + 1, bitmap.height());
+
+    size_t valid = 0;
+    for (int y = -2; y < bitmap.height() + 2; y++) {
+        for (int x = -2; x < bitmap.width() + 2; x++) {
+            const Rect patch(x, y, patch_size, patch_size);
+            const bool inside = (patch & Rect(Point(0, 0), blocked.size())) == patch;
+            const bool expected = inside && cv::countNonZero(blocked(patch)) == 0;
+            ASSERT_EQ(expected, bitmap.isValid(x, y)) << "at (" << x << "," << y << ")";
+            valid += expected;
+        }
+    }
+    ASSERT_GT(valid, 0u);
+    ASSERT_EQ(valid, bitmap.count());
+}
+
+TEST(search_space_test, patches_outside_of_rotated_source_should_be_rejected)
+{
+    Mat source(60, 60, CV_32FC3);
+    randu(source, Scalar::all(0), Scalar::all(1));
+    const int patch_size = 7;
+    TransformedSources sources(source, SourceTransformations::rotationsOnly(0, 45, 45), patch_size);
+    ASSERT_EQ(2u, sources.size());
+    const unsigned int rotated = sources.isIdentity(0) ? 1 : 0;
+    const unsigned int identity = 1 - rotated;
+    SearchSpace search_space(SearchConstraints(), sources, patch_size);
+
+    OffsetMapEntry corner;
+    corner.offset = Point(0, 0);
+    corner.transform_idx = identity;
+    ASSERT_TRUE(search_space.allows(corner, 0, 0));
+    // The corners of the image rotated by 45 degrees lie outside of the source.
+    corner.transform_idx = rotated;
+    ASSERT_FALSE(search_space.allows(corner, 0, 0));
+
+    OffsetMapEntry center;
+    center.offset = Point(27, 27);
+    center.transform_idx = rotated;
+    ASSERT_TRUE(search_space.allows(center, 0, 0));
+
+    OffsetMapEntry outside;
+    outside.offset = Point(sources.imageSize().width, 0);
+    outside.transform_idx = identity;
+    ASSERT_FALSE(search_space.allows(outside, 0, 0));
+}
+
+TEST(search_space_test, patches_overlapping_excluded_pixels_should_be_rejected)
+{
+    Mat source(40, 40, CV_32FC3, Scalar::all(0.5));
+    const int patch_size = 5;
+    TransformedSources sources(source, SourceTransformations::rotationsOnly(0, 0, 1), patch_size);
+    SearchConstraints constraints;
+    constraints.excluded = Mat::zeros(source.size(), CV_8U);
+    constraints.excluded(Rect(20, 20, 1, 1)) = 255;
+    SearchSpace search_space(constraints, sources, patch_size);
+
+    OffsetMapEntry entry;
+    for (int y = 0; y < 30; y++) {
+        for (int x = 0; x < 30; x++) {
+            entry.offset = Point(x, y);
+            const bool overlaps = x > 20 - patch_size && x <= 20 && y > 20 - patch_size && y <= 20;
+            ASSERT_EQ(!overlaps, search_space.allows(entry, 0, 0)) << "at (" << x << "," << y << ")";
+        }
+    }
+}
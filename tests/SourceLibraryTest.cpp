@@ -0,0 +1,93 @@
+#include "gtest/gtest.h"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "../src/patch_match_provider/RandomizedPatchMatch.h"
+#include "../src/SourceLibrary.h"
+
+using cv::GaussianBlur;
+using cv::Mat;
+using cv::randu;
+using cv::Rect;
+using cv::Scalar;
+using cv::Size;
+using std::make_shared;
+using std::shared_ptr;
+
+namespace {
+    Mat smoothNoise(int seed) {
+        cv::theRNG().state = static_cast<uint64_t>(seed);
+        Mat img(60, 60, CV_32FC3);
+        randu(img, Scalar::all(0), Scalar::all(100));
+        GaussianBlur(img, img, Size(5, 5), 0);
+        return img;
+    }
+}
+
+TEST(source_library_test, least_recently_used_images_should_be_evicted) {
+    const SourceTransformations identity = SourceTransformations::rotationsOnly(0, 0, 1);
+    const Mat img = smoothNoise(1);
+    const size_t image_bytes = TransformedSources(img, identity, 7, 0, SourceLibrary::MAX_CACHED_TILES)
+            .maxMemoryUsage();
+    // Room for two images.
+    SourceLibrary library(identity, 7, 0, 2 * image_bytes);
+    int loads = 0;
+    for (int i = 0; i < 3; i++) {
+        library.add([&loads, img]() {
+            loads++;
+            return img;
+        });
+    }
+
+    library.sources(0);
+    library.sources(1);
+    library.sources(0);
+    ASSERT_EQ(2, loads);
+    // Evicts image 1, which was used least recently.
+    library.sources(2);
+    library.sources(0);
+    ASSERT_EQ(3, loads);
+    library.sources(1);
+    ASSERT_EQ(4, loads);
+    ASSERT_LE(library.residentBytes(), 2 * image_bytes);
+}
+
+TEST(source_library_test, target_from_library_image_should_be_matched_there) {
+    const Mat source = smoothNoise(2);
+    const Mat library_img = smoothNoise(3);
+    const Mat target = library_img(Rect(15, 20, 30, 30)).clone();
+    const int patch_size = 7;
+
+    RandomizedPatchMatch rpm(source, target.size(), patch_size, 0.f);
+    rpm.setTargetArea(target);
+    const double ssd_without_library = rpm.match()->summedDistance();
+
+    RandomizedPatchMatch rpm_library(source, target.size(), patch_size, 0.f);
+    shared_ptr<SourceLibrary> library = make_shared<SourceLibrary>(
+            SourceTransformations::rotationsOnly(-10, 10, 5), patch_size, 0.f);
+    library->add([library_img]() { return library_img; });
+    rpm_library.setSourceLibrary(library);
+    rpm_library.setTargetArea(target);
+    shared_ptr<OffsetMap> offset_map = rpm_library.match();
+
+    int from_library = 0;
+    for (int x = 0; x < offset_map->_width; x++) {
+        for (int y = 0; y < offset_map->_height; y++)
+            from_library += offset_map->at(y, x).source_idx == 1;
+    }
+    EXPECT_GT(from_library, offset_map->_width * offset_map->_height / 2);
+    EXPECT_LT(offset_map->summedDistance(), ssd_without_library * 0.1);
+}
+
+TEST(source_library_test, library_with_other_transformations_should_be_refused) {
+    const Mat source = smoothNoise(4);
+    const int patch_size = 7;
+    // Five rotations, as the default of the patch match.
+    RandomizedPatchMatch rpm(source, Size(30, 30), patch_size, 0.f);
+    shared_ptr<SourceLibrary> library = make_shared<SourceLibrary>(
+            SourceTransformations::rotationsOnly(0, 0, 1), patch_size, 0.f);
+    EXPECT_EQ(1u, library->nrTransformations());
+    EXPECT_THROW(rpm.setSourceLibrary(library), cv::Exception);
+
+    library = make_shared<SourceLibrary>(SourceTransformations::rotationsOnly(-10, 10, 5), patch_size, 0.f);
+    EXPECT_EQ(5u, library->nrTransformations());
+    EXPECT_NO_THROW(rpm.setSourceLibrary(library));
+}
@@ -0,0 +1,59 @@
+#include "gtest/gtest.h"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "../src/patch_match_provider/SpaceTimePatchMatch.h"
+
+using cv::GaussianBlur;
+using cv::Mat;
+using cv::randu;
+using cv::Rect;
+using cv::Size;
+
+TEST(space_time_patch_match_test, window_should_keep_only_last_frames) {
+    Mat source(32, 32, CV_32FC3);
+    randu(source, 0, 100);
+    Mat target = source(Rect(4, 4, 16, 16)).clone();
+
+    SpaceTimePatchMatch stpm(source.size(), target.size(), 5, 1, 3);
+    for (int i = 0; i < 5; i++)
+        stpm.pushFrame(source, target);
+
+    ASSERT_EQ(3, stpm.offsets().nrFrames());
+    ASSERT_EQ(2, stpm.offsets().firstFrame());
+    ASSERT_EQ(5, stpm.offsets().endFrame());
+    ASSERT_EQ(12, stpm.offsets().frame(4)._width);
+}
+
+TEST(space_time_patch_match_test, target_taken_from_next_frames_should_be_found) {
+    // Independent random frames, the target of frame t is cropped from the source of frame t + 1.
+    const int nr_frames = 5;
+    const Rect crop(6, 8, 14, 14);
+    std::vector<Mat> sources;
+    for (int t = 0; t < nr_frames; t++) {
+        Mat source(28, 28, CV_32FC3);
+        randu(source, 0, 100);
+        GaussianBlur(source, source, Size(5, 5), 0);
+        sources.push_back(source);
+    }
+
+    SpaceTimePatchMatch stpm(sources[0].size(), crop.size(), 5, 1, nr_frames,
+                             SourceTransformations::rotationsOnly(0, 0, 1), 0.5f, 10);
+    for (int t = 0; t < nr_frames; t++) {
+        Mat target = t + 1 < nr_frames ? sources[t + 1](crop).clone() : sources[t](crop).clone();
+        stpm.pushFrame(sources[t], target);
+    }
+    const OffsetVolume &offsets = stpm.match();
+
+    // Frames 1 and 2 only see targets cropped from the next frame.
+    for (long t = 1; t <= 2; t++) {
+        const OffsetMap &offset_map = offsets.frame(t);
+        int exact = 0;
+        for (int x = 0; x < offset_map._width; x++) {
+            for (int y = 0; y < offset_map._height; y++) {
+                SpaceTimeEntry entry = offsets.at(t, y, x);
+                if (entry.frame_offset == 1 && entry.offset == crop.tl() && entry.distance < 1e-3)
+                    exact++;
+            }
+        }
+        ASSERT_GT(exact, 0.8 * offset_map._width * offset_map._height) << "Frame " << t;
+    }
+}
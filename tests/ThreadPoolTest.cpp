@@ -0,0 +1,109 @@
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include "../src/ThreadPool.h"
+
+using cv::Range;
+using std::atomic;
+using std::vector;
+
+namespace {
+    class CountingBody : public cv::ParallelLoopBody {
+    public:
+        explicit CountingBody(vector<atomic<int>> &counts) : _counts(counts) { }
+
+        virtual void operator()(const Range &range) const override {
+            for (int i = range.start; i < range.end; i++)
+                _counts[i]++;
+        }
+
+    private:
+        vector<atomic<int>> &_counts;
+    };
+
+    /**
+     * Runs an inner loop on the current pool for every element of the outer one.
+     */
+    class NestedBody : public cv::ParallelLoopBody {
+    public:
+        NestedBody(vector<atomic<int>> &counts, int inner_size) : _counts(counts), _inner_size(inner_size) { }
+
+        virtual void operator()(const Range &range) const override {
+            for (int i = range.start; i < range.end; i++) {
+                vector<atomic<int>> inner(static_cast<size_t>(_inner_size));
+                CountingBody body(inner);
+                ThreadPool::current().parallelFor(Range(0, _inner_size), body);
+                for (const atomic<int> &count: inner)
+                    _counts[i] += count;
+            }
+        }
+
+    private:
+        vector<atomic<int>> &_counts;
+        const int _inner_size;
+    };
+
+    class ThrowingBody : public cv::ParallelLoopBody {
+    public:
+        virtual void operator()(const Range &range) const override {
+            if (range.start <= 50 && 50 < range.end)
+                throw std::runtime_error("element 50");
+        }
+    };
+}
+
+TEST(thread_pool_test, every_element_should_be_processed_once)
+{
+    ThreadPool pool(4);
+    ASSERT_EQ(4, pool.nrThreads());
+    for (int min_chunk: {1, 7, 1000}) {
+        vector<atomic<int>> counts(1000);
+        CountingBody body(counts);
+        pool.parallelFor(Range(0, 1000), body, min_chunk);
+        for (int i = 0; i < 1000; i++)
+            ASSERT_EQ(1, counts[i]) << "element " << i << " with chunks of at least " << min_chunk;
+    }
+}
+
+TEST(thread_pool_test, nested_loops_should_not_deadlock)
+{
+    ThreadPool pool(3);
+    ThreadPool::Scope scope(pool);
+    ASSERT_EQ(&pool, &ThreadPool::current());
+    vector<atomic<int>> counts(64);
+    NestedBody body(counts, 100);
+    ThreadPool::current().parallelFor(Range(0, 64), body);
+    for (int i = 0; i < 64; i++)
+        ASSERT_EQ(100, counts[i]);
+}
+
+TEST(thread_pool_test, exceptions_should_be_rethrown_by_caller)
+{
+    ThreadPool pool(4);
+    ThrowingBody body;
+    ASSERT_THROW(pool.parallelFor(Range(0, 100), body), std::runtime_error);
+    // The pool is still usable afterwards.
+    vector<atomic<int>> counts(100);
+    CountingBody counting(counts);
+    pool.parallelFor(Range(0, 100), counting);
+    for (int i = 0; i < 100; i++)
+        ASSERT_EQ(1, counts[i]);
+}
+
+TEST(thread_pool_test, pinned_pools_should_get_disjoint_cores)
+{
+    vector<int> first_cores;
+    {
+        ThreadPool first(3, true);
+        ThreadPool second(3, true);
+        first_cores = first.pinnedCores();
+        for (int core: second.pinnedCores())
+            ASSERT_EQ(first_cores.end(), std::find(first_cores.begin(), first_cores.end(), core)) << "core " << core;
+        ASSERT_LE(first.pinnedCores().size(), 2u);
+        ASSERT_TRUE(ThreadPool(3).pinnedCores().empty());
+    }
+    // Cores of destroyed pools are free again.
+    ThreadPool third(3, true);
+    ASSERT_EQ(first_cores, third.pinnedCores());
+}
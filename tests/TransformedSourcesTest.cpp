@@ -0,0 +1,185 @@
+#include "gtest/gtest.h"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "../src/TransformedSources.h"
+#include "../src/util.h"
+
+using cv::GaussianBlur;
+using cv::Mat;
+using cv::Point;
+using cv::randu;
+using cv::Rect;
+using cv::RNG;
+using cv::Size;
+using pmutil::createRotatedImages;
+using pmutil::interleaveWithGradients;
+using std::vector;
+
+namespace {
+    /**
+     * Smooth random image, so small differences in sampling positions do not matter much.
+     */
+    Mat smoothRandomImage(Size size) {
+        Mat img(size, CV_32FC3);
+        randu(img, 0.f, 1.f);
+        GaussianBlur(img, img, Size(0, 0), 3);
+        return img;
+    }
+}
+
+TEST(transformed_sources_test, patches_should_match_eagerly_rotated_images)
+{
+    Mat src = smoothRandomImage(Size(150, 120));
+    const int patch_size = 7;
+    TransformedSources sources(src, -10, 10, 5, patch_size);
+    vector<Mat> eager = createRotatedImages(src, -10, 10, 5);
+    ASSERT_EQ(eager.size(), sources.size());
+
+    RNG rng(42);
+    for (unsigned int idx = 0; idx < sources.size(); idx++) {
+        for (int i = 0; i < 400; i++) {
+            Rect roi(rng.uniform(0, src.cols - patch_size + 1), rng.uniform(0, src.rows - patch_size + 1),
+                     patch_size, patch_size);
+            // Request every patch twice, so both the direct and the cached path are taken.
+            for (int request = 0; request < 2; request++) {
+                Mat lazy_patch = sources.patch(idx, roi);
+                ASSERT_EQ(roi.size(), lazy_patch.size());
+                EXPECT_LT(norm(lazy_patch, eager[idx](roi), cv::NORM_INF), 1e-2)
+                        << "rotation " << idx << " at " << roi << ", request " << request;
+            }
+        }
+    }
+}
+
+TEST(transformed_sources_test, patches_outside_image_should_be_empty)
+{
+    Mat src = smoothRandomImage(Size(50, 40));
+    TransformedSources sources(src, -10, 10, 5, 7);
+    for (unsigned int idx = 0; idx < sources.size(); idx++) {
+        EXPECT_TRUE(sources.patch(idx, Rect(-1, 0, 7, 7)).empty());
+        EXPECT_TRUE(sources.patch(idx, Rect(0, -1, 7, 7)).empty());
+        EXPECT_TRUE(sources.patch(idx, Rect(44, 0, 7, 7)).empty());
+        EXPECT_TRUE(sources.patch(idx, Rect(0, 34, 7, 7)).empty());
+        EXPECT_FALSE(sources.patch(idx, Rect(43, 33, 7, 7)).empty());
+    }
+}
+
+TEST(transformed_sources_test, border_should_reflect_rotated_image)
+{
+    Mat src = smoothRandomImage(Size(60, 50));
+    TransformedSources sources(src, 0, 10, 10, 7);
+    auto bordered = sources.withBorder(1);
+    ASSERT_EQ(Size(61, 51), bordered->imageSize());
+
+    vector<Mat> eager = createRotatedImages(src, 0, 10, 10);
+    for (unsigned int idx = 0; idx < bordered->size(); idx++) {
+        Mat expected;
+        copyMakeBorder(eager[idx], expected, 0, 1, 0, 1, cv::BORDER_REFLECT);
+        Rect bottom_right(Point(61 - 14, 51 - 14), Size(14, 14));
+        EXPECT_LT(norm(bordered->patch(idx, bottom_right), expected(bottom_right), cv::NORM_INF), 1e-2);
+    }
+}
+
+TEST(transformed_sources_test, cache_should_stay_bounded)
+{
+    Mat src = smoothRandomImage(Size(600, 600));
+    const size_t max_cached_tiles = 8;
+    TransformedSources sources(src, -10, 10, 1, 7, 0, max_cached_tiles);
+    ASSERT_EQ(21, sources.size());
+
+    for (unsigned int idx = 0; idx < sources.size(); idx++) {
+        for (int y = 0; y + 7 <= src.rows; y += 20) {
+            for (int x = 0; x + 7 <= src.cols; x += 20) {
+                sources.patch(idx, Rect(x, y, 7, 7));
+                sources.patch(idx, Rect(x, y, 7, 7));
+            }
+        }
+    }
+    EXPECT_LE(sources.cachedTileCount(), max_cached_tiles);
+}
+
+TEST(transformed_sources_test, should_enumerate_scales_and_mirrored_versions)
+{
+    Mat src = smoothRandomImage(Size(80, 60));
+    SourceTransformations transformations;
+    transformations.min_scale = 0.75f;
+    transformations.max_scale = 1.25f;
+    transformations.mirror = true;
+    TransformedSources sources(src, transformations, 7);
+    // 5 rotations, 3 scales, mirrored or not.
+    ASSERT_EQ(30, sources.size());
+
+    // The unrotated, unscaled, mirrored version is just the flipped source.
+    Mat flipped;
+    cv::flip(src, flipped, 1);
+    for (unsigned int idx = 0; idx < sources.size(); idx++) {
+        if (sources.isMirrored(idx) && sources.rotation(idx) == 0 && sources.scale(idx) == 1) {
+            EXPECT_LT(norm(sources.transformed(idx), flipped, cv::NORM_INF), 1e-4);
+        }
+    }
+}
+
+TEST(transformed_sources_test, moments_should_match_patch_pixels)
+{
+    Mat src = smoothRandomImage(Size(150, 120));
+    const int patch_size = 7;
+    TransformedSources sources(src, -10, 10, 5, patch_size);
+
+    RNG rng(7);
+    for (unsigned int idx = 0; idx < sources.size(); idx++) {
+        // Random patches hit the same tiles repeatedly, so moments come from direct warps as well as cached tiles.
+        for (int i = 0; i < 300; i++) {
+            Rect roi(rng.uniform(0, src.cols - patch_size + 1), rng.uniform(0, src.rows - patch_size + 1),
+                     patch_size, patch_size);
+            PatchMoments moments;
+            Mat patch = sources.patch(idx, roi, &moments);
+            Mat squared = patch.mul(patch);
+            cv::Scalar expected_sum = cv::sum(patch);
+            cv::Scalar expected_sqsum = cv::sum(squared);
+            ASSERT_EQ(patch_size * patch_size, moments.count);
+            for (int c = 0; c < 3; c++) {
+                EXPECT_NEAR(expected_sum[c], moments.sum[c], 1e-3) << "transformation " << idx << " at " << roi;
+                EXPECT_NEAR(expected_sqsum[c], moments.sqsum[c], 1e-3) << "transformation " << idx << " at " << roi;
+            }
+        }
+    }
+}
+
+TEST(transformed_sources_test, gradients_should_be_computed_on_transformed_images)
+{
+    Mat src = smoothRandomImage(Size(150, 120));
+    const int patch_size = 7;
+    const float gradient_weight = 0.5f;
+    TransformedSources sources(src, -10, 10, 10, patch_size, 0, TransformedSources::DEFAULT_MAX_CACHED_TILES,
+                               gradient_weight);
+    ASSERT_EQ(3, sources.colorChannels());
+    ASSERT_EQ(9, sources.patchChannels());
+    vector<Mat> eager = createRotatedImages(src, -10, 10, 10);
+
+    RNG rng(3);
+    for (unsigned int idx = 0; idx < sources.size(); idx++) {
+        Mat eager_features;
+        interleaveWithGradients(eager[idx], gradient_weight, eager_features);
+        for (int i = 0; i < 200; i++) {
+            Rect roi(rng.uniform(0, src.cols - patch_size + 1), rng.uniform(0, src.rows - patch_size + 1),
+                     patch_size, patch_size);
+            Mat lazy_patch = sources.patch(idx, roi);
+            ASSERT_EQ(9, lazy_patch.channels());
+            EXPECT_LT(norm(lazy_patch, eager_features(roi), cv::NORM_INF), 1e-2) << "rotation " << idx << " at " << roi;
+        }
+    }
+}
+
+TEST(transformed_sources_test, count_should_match_created_transforms)
+{
+    SourceTransformations transformations;
+    transformations.min_scale = 0.75f;
+    transformations.max_scale = 1.25f;
+    transformations.mirror = true;
+    TransformedSources sources(smoothRandomImage(Size(30, 30)), transformations, 7);
+    EXPECT_EQ(sources.size(), transformations.count());
+    const vector<TransformParameters> parameters = transformations.enumerate();
+    for (unsigned int idx = 0; idx < sources.size(); idx++) {
+        EXPECT_EQ(parameters[idx].rotation, sources.rotation(idx));
+        EXPECT_EQ(parameters[idx].scale, sources.scale(idx));
+    }
+}
@@ -6,7 +6,11 @@ using cv::Mat;
 using cv::Rect;
 using cv::Vec3f;
 using pmutil::naiveMeanShift;
+using pmutil::computeGradientX;
+using pmutil::computeGradientY;
 using pmutil::createRotatedImages;
+using pmutil::interleaveWithGradients;
+using pmutil::ssd_unsafe;
 using std::vector;
 
 TEST(utility_test, naive_mean_shift_with_only_one_color)
@@ -108,4 +112,108 @@ TEST(utility_test, create_rotated_test)
         std::string filename = "rotated" + std::to_string(i) + ".exr";
         cv::imwrite(filename, rotated_srcs[i]);
     }
-}
\ No newline at end of file
+}
+
+TEST(utility_test, interleaved_gradients_should_give_weighted_distance)
+{
+    Mat img1(30, 30, CV_32FC3), img2(30, 30, CV_32FC3);
+    randu(img1, 0.f, 1.f);
+    randu(img2, 0.f, 1.f);
+    const float lambda = 0.5f;
+    Mat features1, features2;
+    interleaveWithGradients(img1, lambda, features1);
+    interleaveWithGradients(img2, lambda, features2);
+    ASSERT_EQ(9, features1.channels());
+
+    Mat gx1, gy1, gx2, gy2;
+    computeGradientX(img1, gx1);
+    computeGradientY(img1, gy1);
+    computeGradientX(img2, gx2);
+    computeGradientY(img2, gy2);
+    Rect patch(10, 12, 7, 7);
+    double expected = ssd_unsafe(img1(patch), img2(patch)) +
+                      lambda * (ssd_unsafe(gx1(patch), gx2(patch)) + ssd_unsafe(gy1(patch), gy2(patch)));
+    EXPECT_NEAR(expected, ssd_unsafe(features1(patch), features2(patch)), 1e-3);
+}
+
+TEST(utility_test, lab_pyramid_should_match_conversion_and_build_pyramid)
+{
+    // Odd sizes, so the borders of every level are reflected differently.
+    Mat img(101, 77, CV_8UC3);
+    cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(255));
+    Mat lab;
+    img.convertTo(lab, CV_32FC3, 1 / 255.f);
+    cvtColor(lab, lab, CV_BGR2Lab);
+    vector<Mat> expected;
+    cv::buildPyramid(lab, expected, 4);
+
+    vector<Mat> pyr;
+    pmutil::buildLabPyramid(img, pyr, 4);
+    ASSERT_EQ(expected.size(), pyr.size());
+    for (size_t level = 0; level < pyr.size(); level++) {
+        ASSERT_EQ(expected[level].size(), pyr[level].size());
+        ASSERT_LT(cv::norm(expected[level], pyr[level], cv::NORM_INF), 1e-3);
+    }
+}
+
+namespace {
+    /**
+     * Compares the distances of the patch layout chosen by pmutil::dispatchPatchLayout() with the generic ones.
+     */
+    class SpecializedSsdCheck {
+    public:
+        SpecializedSsdCheck(const Mat &img1, const Mat &img2, int patch_size)
+                : _img1(img1), _img2(img2), _patch_size(patch_size) { }
+
+        int size = -1, channels = -1;
+
+        template<int SIZE, int CHANNELS>
+        void run() {
+            size = SIZE;
+            channels = CHANNELS;
+            const Mat target = _img1(Rect(3, 5, _patch_size, _patch_size));
+            Mat patches[3];
+            double expected[3];
+            for (int k = 0; k < 3; k++) {
+                patches[k] = _img2(Rect(4 * k + 1, 2 * k + 3, _patch_size, _patch_size));
+                expected[k] = ssd_unsafe(patches[k], target);
+                EXPECT_NEAR(expected[k], (pmutil::PatchSsd<SIZE, CHANNELS>::ssd(patches[k], target, INFINITY)),
+                            1e-5 * expected[k]);
+            }
+            double ssds[3];
+            pmutil::PatchSsd<SIZE, CHANNELS>::batch(target, patches, 3, INFINITY, ssds);
+            for (int k = 0; k < 3; k++)
+                EXPECT_EQ((pmutil::PatchSsd<SIZE, CHANNELS>::ssd(patches[k], target, INFINITY)), ssds[k]);
+        }
+
+    private:
+        const Mat &_img1, &_img2;
+        const int _patch_size;
+    };
+}
+
+TEST(utility_test, specialized_ssd_should_match_generic_ssd)
+{
+    const int channels[] = {1, 3, 9};
+    const int patch_sizes[] = {5, 7, 9};
+    for (int c : channels) {
+        // Patches cut out of larger images, so they are not continuous.
+        Mat img1(40, 40, CV_32FC(c)), img2(40, 40, CV_32FC(c));
+        randu(img1, 0.f, 1.f);
+        randu(img2, 0.f, 1.f);
+        for (int patch_size : patch_sizes) {
+            SpecializedSsdCheck check(img1, img2, patch_size);
+            pmutil::dispatchPatchLayout(patch_size, c, check);
+            ASSERT_EQ(patch_size, check.size);
+            ASSERT_EQ(c, check.channels);
+        }
+    }
+
+    Mat img1(40, 40, CV_32FC3), img2(40, 40, CV_32FC3);
+    randu(img1, 0.f, 1.f);
+    randu(img2, 0.f, 1.f);
+    SpecializedSsdCheck check(img1, img2, 11);
+    pmutil::dispatchPatchLayout(11, 3, check);
+    EXPECT_EQ(0, check.size);
+    EXPECT_EQ(0, check.channels);
+}
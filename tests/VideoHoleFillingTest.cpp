@@ -0,0 +1,109 @@
+#include "gtest/gtest.h"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "../src/BoundedQueue.h"
+#include "../src/VideoHoleFilling.h"
+#include <vector>
+
+using cv::GaussianBlur;
+using cv::Mat;
+using cv::randu;
+using cv::Rect;
+using cv::Scalar;
+using cv::Size;
+using std::vector;
+
+namespace {
+    /**
+     * Frames of a smooth random texture moving to the right by 'speed' pixels per frame, with a fixed square hole.
+     */
+    void translatingSequence(int nr_frames, int speed, vector<Mat> &frames, Mat &hole) {
+        const Size frame_size(64, 64);
+        Mat texture(frame_size.height, frame_size.width + nr_frames * speed, CV_8UC3);
+        randu(texture, Scalar::all(0), Scalar::all(255));
+        GaussianBlur(texture, texture, Size(5, 5), 0);
+        for (int i = 0; i < nr_frames; i++) {
+            // Content moves right, so the visible window moves left.
+            Rect window((nr_frames - 1 - i) * speed, 0, frame_size.width, frame_size.height);
+            frames.push_back(texture(window).clone());
+        }
+        hole = Mat::zeros(frame_size, CV_8U);
+        hole(Rect(28, 28, 8, 8)) = 255;
+    }
+}
+
+TEST(bounded_queue_test, closed_queue_should_be_drained_and_reject_pushes) {
+    BoundedQueue<int> queue(2);
+    ASSERT_TRUE(queue.push(1));
+    ASSERT_TRUE(queue.push(2));
+    ASSERT_EQ(2, queue.size());
+    queue.close();
+    ASSERT_FALSE(queue.push(3));
+
+    int element;
+    ASSERT_TRUE(queue.pop(&element));
+    ASSERT_EQ(1, element);
+    ASSERT_TRUE(queue.pop(&element));
+    ASSERT_EQ(2, element);
+    ASSERT_FALSE(queue.pop(&element));
+}
+
+TEST(video_hole_filling_test, frames_should_be_streamed_in_order_and_seeded) {
+    vector<Mat> frames;
+    Mat hole;
+    translatingSequence(3, 2, frames, hole);
+
+    VideoHoleFilling vhf(7, SourceTransformations(), 1);
+    size_t next = 0;
+    vector<int> indices;
+    vhf.run([&](Mat &frame, Mat &frame_hole) {
+        if (next == frames.size())
+            return false;
+        frame = frames[next++];
+        frame_hole = hole;
+        return true;
+    }, [&](int index, const Mat &filled) {
+        ASSERT_EQ(frames[0].size(), filled.size());
+        indices.push_back(index);
+    });
+
+    ASSERT_EQ((vector<int>{0, 1, 2}), indices);
+    const VideoStatistics &statistics = vhf.statistics();
+    ASSERT_EQ(3, statistics.frames);
+    ASSERT_EQ(2, statistics.seeded);
+    ASSERT_EQ(0, statistics.reused_preprocessing);
+    ASSERT_GT(statistics.framesPerSecond(), 0);
+}
+
+TEST(video_hole_filling_test, unchanged_frame_should_reuse_preprocessing) {
+    vector<Mat> frames;
+    Mat hole;
+    translatingSequence(1, 0, frames, hole);
+
+    VideoHoleFilling vhf(7);
+    Mat first = vhf.fillNext(frames[0], hole);
+    Mat second = vhf.fillNext(frames[0], hole);
+
+    ASSERT_EQ(1, vhf.statistics().reused_preprocessing);
+    ASSERT_EQ(1, vhf.statistics().seeded);
+    ASSERT_EQ(first.size(), second.size());
+}
+
+TEST(video_hole_filling_test, local_change_outside_the_hole_should_not_reuse_preprocessing) {
+    vector<Mat> frames;
+    Mat hole;
+    translatingSequence(1, 0, frames, hole);
+    // A small object appears far from the hole, the mean difference of the frame stays tiny.
+    Mat changed = frames[0].clone();
+    changed(Rect(2, 2, 4, 4)).setTo(Scalar(255, 0, 0));
+
+    VideoHoleFilling vhf(7);
+    vhf.fillNext(frames[0], hole);
+    Mat second = vhf.fillNext(changed, hole);
+    ASSERT_EQ(0, vhf.statistics().reused_preprocessing);
+
+    // The object is in the result, not the stale content of the first frame.
+    Mat expected = changed.clone();
+    expected.convertTo(expected, CV_32FC3, 1 / 255.f);
+    cvtColor(expected, expected, CV_BGR2Lab);
+    EXPECT_LT(cv::norm(expected(Rect(2, 2, 4, 4)), second(Rect(2, 2, 4, 4)), cv::NORM_INF), 1e-2);
+}
@@ -0,0 +1,64 @@
+#include "gtest/gtest.h"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "../src/VotedReconstruction.h"
+
+using cv::Mat;
+using cv::Point;
+using cv::Rect;
+using cv::Size;
+using cv::Vec3f;
+using std::make_shared;
+using std::shared_ptr;
+using std::vector;
+
+TEST(voted_reconstruction_test, voting_index_should_list_entries_covering_the_hole)
+{
+    const int patch_size = 5, scale_change = 2;
+    const Size offset_map_size(20, 15);
+    Mat hole = Mat::zeros((offset_map_size.height - 1 + patch_size) * scale_change,
+                          (offset_map_size.width - 1 + patch_size) * scale_change, CV_8U);
+    hole(Rect(17, 9, 4, 6)).setTo(255);
+    hole.at<uchar>(0, 0) = 255;
+    VotingIndex index(hole, offset_map_size, patch_size, scale_change);
+
+    EXPECT_EQ(static_cast<size_t>(countNonZero(hole)), index.holePixels().size());
+    for (size_t i = 0; i < index.holePixels().size(); i++)
+        EXPECT_EQ(static_cast<int>(i), index.slot(index.holePixels()[i]));
+
+    vector<Point> expected;
+    for (int x = 0; x < offset_map_size.width; x++) {
+        for (int y = 0; y < offset_map_size.height; y++) {
+            const int extent = patch_size * scale_change;
+            if (countNonZero(hole(Rect(x * scale_change, y * scale_change, extent, extent))) > 0)
+                expected.push_back(Point(x, y));
+        }
+    }
+    EXPECT_EQ(expected, index.votingEntries());
+}
+
+TEST(voted_reconstruction_test, only_hole_pixels_should_be_reconstructed)
+{
+    const int patch_size = 7;
+    Mat source(40, 50, CV_32FC3);
+    randu(source, 0.f, 1.f);
+    const shared_ptr<const TransformedSources> sources = make_shared<TransformedSources>(
+            source, SourceTransformations::rotationsOnly(0, 0, 1), patch_size);
+    // Every patch matches itself.
+    const shared_ptr<OffsetMap> offset_map = make_shared<OffsetMap>(source.cols - patch_size + 1,
+                                                                    source.rows - patch_size + 1);
+    Mat hole = Mat::zeros(source.size(), CV_8U);
+    hole(Rect(20, 10, 8, 12)).setTo(255);
+
+    VotedReconstruction vr(offset_map, sources, hole, patch_size);
+    Mat reconstructed;
+    vr.reconstruct(reconstructed, 3);
+    Mat expected = Mat::zeros(source.size(), CV_32FC3);
+    source.copyTo(expected, hole);
+    EXPECT_EQ(0, cv::norm(expected, reconstructed, cv::NORM_INF));
+
+    // Same result with an index shared by several reconstructions.
+    vr.setVotingIndex(make_shared<const VotingIndex>(hole, Size(offset_map->_width, offset_map->_height), patch_size));
+    Mat reconstructed_with_index;
+    vr.reconstruct(reconstructed_with_index, 3);
+    EXPECT_EQ(0, cv::norm(reconstructed, reconstructed_with_index, cv::NORM_INF));
+}